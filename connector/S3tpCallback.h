@@ -6,11 +6,45 @@
 #define S3TP_S3TP_MESSAGE_LISTENER_H
 
 #include <cstdlib>
+#include "../core/S3tpShared.h"
 
 class S3tpCallback {
 public:
     virtual void onNewMessage(char * data, size_t len) = 0;
+    /**
+     * Only called on streaming ports, for messages that are delivered in several chunks.
+     * Chunks are received in order: STREAM_BEGIN, any number of STREAM_CONTINUE, then STREAM_END.
+     * STREAM_ABORT (without data) means the message will not be completed and its chunks should be discarded.
+     * Messages which are available entirely when delivered are passed to onNewMessage instead.
+     */
+    virtual void onNewChunk(char *, size_t, S3tpStreamMarker) {}
+    /**
+     * Called instead of onNewMessage and onNewChunk, along with the port the message was received on.
+     * Only needs to be implemented by applications registering several ports on the same connector.
+     */
+    virtual void onNewPortMessage(uint8_t, char * data, size_t len) {
+        onNewMessage(data, len);
+    }
+    virtual void onNewPortChunk(uint8_t, char * data, size_t len, S3tpStreamMarker marker) {
+        onNewChunk(data, len, marker);
+    }
     virtual void onError(int code, char * error) = 0;
+    /**
+     * Only called on non-blocking connectors, once the daemon is done with a message sent by sendAsync.
+     * The result is CODE_SUCCESS if the message was handed to S3TP, or the error for which it was dropped.
+     * Messages are completed in the order in which they were sent.
+     */
+    virtual void onSendComplete(uint32_t, int) {}
+    /**
+     * Only called on non-blocking connectors, after sendAsync returned CODE_ERROR_WOULD_BLOCK:
+     * the daemon returned credit, so messages can be sent again. On connectors with several ports, this is called
+     * once credit of any port that refused a message came back.
+     */
+    virtual void onSendAvailable() {}
+    /**
+     * Only called on non-blocking connectors, with the amount of payload bytes reclaimed by cancel.
+     */
+    virtual void onCancelComplete(uint32_t, int) {}
 };
 
 #endif //S3TP_S3TP_MESSAGE_LISTENER_H
@@ -5,9 +5,18 @@
 #include "S3tpConnector.h"
 
 S3tpConnector::S3tpConnector() {
-    lastMessageAck = false;
-    s3tpBufferFull = false;
+    cancelAnswered = false;
+    lastCancelledBytes = 0;
+    callback = NULL;
+    arena.resize(CONNECTOR_ARENA_SIZE);
+    arenaOffset = 0;
+    arenaLength = 0;
+    nextMessageId = 1;
     connected = false;
+    shared = NULL;
+    nonBlocking = false;
+    multiplexed = false;
+    outOffset = 0;
 }
 
 S3tpConnector::~S3tpConnector() {
@@ -16,6 +25,7 @@ S3tpConnector::~S3tpConnector() {
     if (listener_thread.joinable()) {
         listener_thread.join();
     }
+    delete shared;
 }
 
 bool S3tpConnector::isConnected() {
@@ -26,10 +36,90 @@ bool S3tpConnector::isConnected() {
 }
 
 int S3tpConnector::init(S3TP_CONFIG config, S3tpCallback * callback) {
+    int result = connectToDaemon(config, callback);
+
+    //Starting asynchronous routine only if callback was set
+    if (result == CODE_SUCCESS && callback != NULL) {
+        listener_thread = std::thread(&S3tpConnector::asyncListener, this);
+    }
+    return result;
+}
+
+int S3tpConnector::initNonBlocking(S3TP_CONFIG config, S3tpCallback * callback) {
+    if (callback == NULL) {
+        LOG_ERROR("Non-blocking connectors require a callback");
+        return CODE_ERROR_SOCKET_CONFIG;
+    }
+    if (config.options & S3TP_OPTION_SHARED_MEMORY) {
+        LOG_WARN("Shared memory is not available to non-blocking connectors. Using the socket instead");
+        config.setSharedMemory(false);
+    }
+    nonBlocking = true;
+    int result = connectToDaemon(config, callback);
+    return (result == CODE_SUCCESS) ? makeNonBlocking() : result;
+}
+
+int S3tpConnector::init(const std::vector<S3TP_CONFIG>& configs, S3tpCallback * callback) {
+    int result = connectMultiplexed(configs, callback);
+
+    if (result == CODE_SUCCESS) {
+        listener_thread = std::thread(&S3tpConnector::asyncListener, this);
+    }
+    return result;
+}
+
+int S3tpConnector::initNonBlocking(const std::vector<S3TP_CONFIG>& configs, S3tpCallback * callback) {
+    std::vector<S3TP_CONFIG> nonBlockingConfigs(configs);
+
+    if (!nonBlockingConfigs.empty() && (nonBlockingConfigs[0].options & S3TP_OPTION_SHARED_MEMORY)) {
+        LOG_WARN("Shared memory is not available to non-blocking connectors. Using the socket instead");
+        nonBlockingConfigs[0].setSharedMemory(false);
+    }
+    nonBlocking = true;
+    int result = connectMultiplexed(nonBlockingConfigs, callback);
+    return (result == CODE_SUCCESS) ? makeNonBlocking() : result;
+}
+
+/**
+ * Handshake is done, from now on the application loop waits for the socket.
+ */
+int S3tpConnector::makeNonBlocking() {
+    int flags = fcntl(socketDescriptor, F_GETFL);
+    if (flags < 0 || fcntl(socketDescriptor, F_SETFL, flags | O_NONBLOCK) < 0) {
+        LOG_ERROR("Couldn't make the S3TP socket non-blocking. Shutting down");
+        closeConnection();
+        return CODE_ERROR_SOCKET_CONFIG;
+    }
+    return CODE_SUCCESS;
+}
+
+/**
+ * Connects to the daemon, sends the configuration and waits for the answer along with the initial credit.
+ */
+int S3tpConnector::connectToDaemon(S3TP_CONFIG config, S3tpCallback * callback) {
     struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(SHM_DESCRIPTOR_COUNT * sizeof(int))];
     ssize_t wr, rd;
     int commCode;
-
+    AppMessageType type;
+    S3TP_CONTROL credit;
+
+    if (config.options & S3TP_OPTION_SHARED_MEMORY) {
+        if (callback == NULL) {
+            LOG_WARN("Shared memory requires a callback. Using the socket instead");
+            config.setSharedMemory(false);
+        } else {
+            shared = new SharedMemoryChannel();
+            if (shared->create() != CODE_SUCCESS) {
+                LOG_WARN("Couldn't create shared memory. Using the socket instead");
+                delete shared;
+                shared = NULL;
+                config.setSharedMemory(false);
+            }
+        }
+    }
     this->config = config;
     this->callback = callback;
 
@@ -49,8 +139,26 @@ int S3tpConnector::init(S3TP_CONFIG config, S3tpCallback * callback) {
     connector_mutex.unlock();
     LOG_INFO("Connected to S3TP Daemon successfully");
 
-    //Sending configuration over to server
-    wr = write(socketDescriptor, &config, sizeof(S3TP_CONFIG));
+    //Sending configuration over to server, along with the shared memory descriptors
+    iov.iov_base = &config;
+    iov.iov_len = sizeof(S3TP_CONFIG);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (shared != NULL) {
+        int descriptors[SHM_DESCRIPTOR_COUNT] = {
+                shared->getMemfd(), shared->getAppDoorbell(), shared->getDaemonDoorbell()
+        };
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(descriptors));
+        memcpy(CMSG_DATA(cmsg), descriptors, sizeof(descriptors));
+    }
+    wr = sendmsg(socketDescriptor, &msg, 0);
     if (wr == 0) {
         LOG_WARN("Connection to S3TP was closed by server");
         connected = false;
@@ -79,72 +187,429 @@ int S3tpConnector::init(S3TP_CONFIG config, S3tpCallback * callback) {
 
         closeConnection();
         return CODE_SERVER_PORT_BUSY;
+    } else if (commCode == CODE_SERVER_ACCEPT_NO_SHARED_MEMORY) {
+        LOG_WARN("S3TP daemon couldn't use the shared memory. Using the socket instead");
+        delete shared;
+        shared = NULL;
     }
 
-    //Starting asynchronous routine only if callback was set
-    if (callback != NULL) {
-        listener_thread = std::thread(&S3tpConnector::asyncListener, this);
+    //Daemon grants the initial credit right after accepting the connection
+    if (read(socketDescriptor, &type, sizeof(type)) != sizeof(type)
+        || read(socketDescriptor, &credit, sizeof(credit)) != sizeof(credit)
+        || safeMessageTypeInterpretation(type) != APP_CONTROL_MESSAGE
+        || safeMessageTypeInterpretation(credit.controlMessageType) != CREDIT) {
+        LOG_ERROR("Couldn't receive credit from server during configuration. Shutting down");
+        closeConnection();
+        return CODE_ERROR_SOCKET_CONFIG;
     }
+    connector_mutex.lock();
+    multiplexed = (config.options & S3TP_OPTION_MULTIPLEX) != 0;
+    S3TP_PORT_STATE& state = addPort(config.port);
+    state.answered = true;
+    state.result = CODE_SERVER_ACCEPT;
+    state.credit_bytes = credit.length;
+    state.credit_messages = credit.messageId;
+    state.credit_window = credit.length;
+    connector_mutex.unlock();
 
     return CODE_SUCCESS;
 }
 
+/**
+ * Connects to the daemon with the first configuration, then registers the other ports over the same connection.
+ */
+int S3tpConnector::connectMultiplexed(std::vector<S3TP_CONFIG> configs, S3tpCallback * callback) {
+    if (callback == NULL || configs.empty()) {
+        LOG_ERROR("Registering several ports requires a callback and at least one configuration");
+        return CODE_ERROR_SOCKET_CONFIG;
+    }
+    configs[0].setMultiplex(true);
+    int result = connectToDaemon(configs[0], callback);
+    return (result == CODE_SUCCESS) ? openPorts(configs) : result;
+}
+
+/**
+ * Asks the daemon to open all ports after the first one, then waits until it answered for all of them.
+ * Messages received in the meantime on ports that were already accepted are handed to the callback.
+ */
+int S3tpConnector::openPorts(const std::vector<S3TP_CONFIG>& configs) {
+    char header[FRAME_PORT_PREFIX_LENGTH + sizeof(AppMessageType)];
+    S3TP_CONTROL request;
+    bool answered = false;
+    int result = CODE_SUCCESS;
+
+    for (size_t i = 1; i < configs.size(); i++) {
+        connector_mutex.lock();
+        bool duplicate = getPortState(configs[i].port) != NULL;
+        if (!duplicate) {
+            addPort(configs[i].port);
+        }
+        connector_mutex.unlock();
+        if (duplicate) {
+            LOG_ERROR(std::string("Port " + std::to_string((int)configs[i].port) + " was configured twice"));
+            closeConnection();
+            return CODE_SERVER_PORT_BUSY;
+        }
+        request.controlMessageType = OPEN;
+        request.error = 0;
+        request.messageId = configs[i].channel;
+        request.length = configs[i].options & ~(S3TP_OPTION_SHARED_MEMORY | S3TP_OPTION_MULTIPLEX);
+        size_t headerLength = encodePortPrefix(header, configs[i].port);
+        header[headerLength++] = (char)APP_CONTROL_MESSAGE;
+        if (write_frame_safe(socketDescriptor, header, headerLength, &request, sizeof(S3TP_CONTROL)) != CODE_SUCCESS) {
+            LOG_ERROR("Couldn't register ports with server during configuration. Shutting down");
+            closeConnection();
+            return CODE_ERROR_SOCKET_CONFIG;
+        }
+    }
+
+    while (!answered) {
+        connector_mutex.lock();
+        answered = true;
+        for (auto const &it : ports) {
+            answered = answered && it.second.answered;
+            if (it.second.answered && it.second.result != CODE_SERVER_ACCEPT && result == CODE_SUCCESS) {
+                LOG_WARN(std::string("Cannot use S3TP on port " + std::to_string((int)it.first)
+                                     + ". Error code: " + std::to_string(it.second.result)));
+                result = it.second.result;
+            }
+        }
+        connector_mutex.unlock();
+        if (!answered) {
+            //Blocking socket is read until the answers arrived
+            int error = fillArena();
+            if (error == CODE_SUCCESS) {
+                error = parseFrames();
+            }
+            if (error != CODE_SUCCESS) {
+                return error;
+            }
+            deliverBatch();
+        }
+    }
+    if (result != CODE_SUCCESS) {
+        closeConnection();
+    }
+    return result;
+}
+
 int S3tpConnector::send(const void * data, size_t len) {
-    ssize_t wr;
+    return send(data, len, PRIORITY_NORMAL);
+}
+
+int S3tpConnector::send(const void * data, size_t len, S3tpPriority priority) {
+    return send(data, len, priority, NULL);
+}
+
+int S3tpConnector::send(const void * data, size_t len, S3tpPriority priority, uint32_t * messageId) {
+    return sendToPort(config.port, data, len, priority, messageId);
+}
+
+int S3tpConnector::sendToPort(uint8_t port, const void * data, size_t len, S3tpPriority priority,
+                              uint32_t * messageId) {
     int error = 0;
-    AppMessageType type = APP_DATA_MESSAGE;
+    uint8_t priorityCode = encodePriority(priority);
 
+    if (nonBlocking) {
+        return sendAsyncToPort(port, data, len, priority, messageId);
+    }
     if (!isConnected()) {
         LOG_ERROR("Trying to write on closed channel. Sutting down");
 
         return CODE_ERROR_SOCKET_NO_CONN;
     }
 
+    //All messages have to travel through the same stream, so that the daemon assigns the expected ids
+    if (shared != NULL && !SharedRing::fits(len)) {
+        LOG_WARN(std::string("Message of " + std::to_string(len) + " bytes doesn't fit into shared memory"));
+        return CODE_ERROR_INVALID_LENGTH;
+    }
+
     std::unique_lock<std::mutex> lock(connector_mutex);
-    do {
-        //Send message type first
-        wr = write(socketDescriptor, &type, sizeof(type));
-        if (wr <= 0) {
-            LOG_WARN("Error while writing to S3TP socket");
+    S3TP_PORT_STATE * state = getPortState(port);
+    if (state == NULL) {
+        LOG_ERROR(std::string("Port " + std::to_string((int)port) + " is not registered on this connector"));
+        return CODE_ERROR_PORT_NOT_REGISTERED;
+    }
+    //Only waiting if the credit of the port is used up
+    state->credit_cond.wait(lock, [this, state, len]{ return hasCredit(*state, len) || !connected; });
+    if (!connected) {
+        LOG_DEBUG("Disconnected from S3TP");
+        return CODE_ERROR_SOCKET_NO_CONN;
+    }
+    if (shared != NULL) {
+        error = writeSharedMessage(port, data, len, priorityCode, lock);
+    } else {
+        error = writeMessage(port, data, len, priorityCode);
+    }
+    if (error != CODE_SUCCESS) {
+        return error;
+    }
+    state->credit_bytes -= len;
+    state->credit_messages--;
+    uint32_t id = takeMessageId();
+    if (messageId != NULL) {
+        *messageId = id;
+    }
+    LOG_DEBUG(std::string("Written " + std::to_string(len) + " bytes to S3TP"));
 
-            return CODE_ERROR_SOCKET_WRITE;
-        }
+    return (int)len;
+}
 
-        //Send message lengths
-        error = write_length_safe(socketDescriptor, len);
-        if (error == CODE_ERROR_SOCKET_WRITE) {
-            LOG_WARN("Error while writing on S3TP socket");
+int S3tpConnector::sendAsync(const void * data, size_t len, S3tpPriority priority, uint32_t * messageId) {
+    return sendAsyncToPort(config.port, data, len, priority, messageId);
+}
 
-            return error;
-        }
+int S3tpConnector::sendAsyncToPort(uint8_t port, const void * data, size_t len, S3tpPriority priority,
+                                   uint32_t * messageId) {
+    char header[FRAME_PORT_PREFIX_LENGTH + FRAME_HEADER_MAX_LENGTH];
+    uint8_t priorityCode = encodePriority(priority);
+
+    if (!nonBlocking) {
+        return sendToPort(port, data, len, priority, messageId);
+    }
+    std::lock_guard<std::mutex> lock(connector_mutex);
+    if (!connected) {
+        LOG_ERROR("Trying to write on closed channel");
+
+        return CODE_ERROR_SOCKET_NO_CONN;
+    }
+    S3TP_PORT_STATE * state = getPortState(port);
+    if (state == NULL) {
+        LOG_ERROR(std::string("Port " + std::to_string((int)port) + " is not registered on this connector"));
+        return CODE_ERROR_PORT_NOT_REGISTERED;
+    }
+    if (!hasCredit(*state, len)) {
+        //Application is told once credit was returned
+        state->send_refused = true;
+        return CODE_ERROR_WOULD_BLOCK;
+    }
+    size_t headerLength = encodePortPrefix(header, port);
+    headerLength += encode_frame_header(header + headerLength, APP_DATA_MESSAGE, &priorityCode, len);
+    int error = queueFrame(header, headerLength, data, len);
+    if (error != CODE_SUCCESS) {
+        return error;
+    }
+    state->credit_bytes -= len;
+    state->credit_messages--;
+    S3TP_PENDING_SEND pending;
+    pending.message_id = takeMessageId();
+    pending.result = CODE_SUCCESS;
+    state->pending_sends.push_back(pending);
+    if (messageId != NULL) {
+        *messageId = pending.message_id;
+    }
+    return (int)len;
+}
+
+/**
+ * Registers a port which didn't get any credit yet. Must be called with the connector lock held.
+ */
+S3TP_PORT_STATE& S3tpConnector::addPort(uint8_t port) {
+    S3TP_PORT_STATE& state = ports[port];
+    state.credit_bytes = 0;
+    state.credit_messages = 0;
+    state.credit_window = 0;
+    state.answered = false;
+    state.result = CODE_SUCCESS;
+    state.send_refused = false;
+    return state;
+}
+
+/**
+ * State of a registered port, or NULL. Must be called with the connector lock held.
+ * Ports are only registered during init, so the state stays valid afterwards.
+ */
+S3TP_PORT_STATE * S3tpConnector::getPortState(uint8_t port) {
+    std::map<uint8_t, S3TP_PORT_STATE>::iterator it = ports.find(port);
+    return (it != ports.end()) ? &it->second : NULL;
+}
+
+/**
+ * Whether a message can be sent on a port without exceeding its credit. Must be called with the connector lock held.
+ * A message larger than the whole window needs all of it.
+ */
+bool S3tpConnector::hasCredit(const S3TP_PORT_STATE& state, size_t len) {
+    return state.credit_bytes >= (int64_t)std::min(len, state.credit_window) && state.credit_messages > 0;
+}
+
+/**
+ * Ids are assigned the same way by the daemon, so they don't need to be sent back.
+ */
+uint32_t S3tpConnector::takeMessageId() {
+    uint32_t messageId = nextMessageId;
+    //Id 0 is reserved for addressing all messages of a port
+    if (++nextMessageId == S3TP_MESSAGE_ID_ALL) {
+        nextMessageId++;
+    }
+    return messageId;
+}
+
+/**
+ * Writes the port a frame belongs to at the beginning of its header, on multiplexed connections.
+ * @return  The length of the prefix.
+ */
+size_t S3tpConnector::encodePortPrefix(char * header, uint8_t port) {
+    if (!multiplexed) {
+        return 0;
+    }
+    header[0] = (char)port;
+    return FRAME_PORT_PREFIX_LENGTH;
+}
 
-        wr = write(socketDescriptor, data, len);
-        if (wr <= 0) {
+/**
+ * Writes a frame on the non-blocking socket if nothing is queued before it, and queues whatever is left.
+ * Must be called with the connector lock held.
+ */
+int S3tpConnector::queueFrame(const void * header, size_t headerLength, const void * payload, size_t len) {
+    size_t written = 0;
+
+    if (outOffset == outBuffer.size()) {
+        ssize_t wr;
+        do {
+            wr = send_frame(socketDescriptor, header, headerLength, payload, len, 0);
+        } while (wr < 0 && errno == EINTR);
+        if (wr < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
             LOG_WARN("Error while writing to S3TP socket");
 
             return CODE_ERROR_SOCKET_WRITE;
         }
+        written = (wr > 0) ? (size_t)wr : 0;
+    }
+    if (written < headerLength) {
+        outBuffer.insert(outBuffer.end(), (const char *)header + written, (const char *)header + headerLength);
+        written = headerLength;
+    }
+    if (written - headerLength < len) {
+        outBuffer.insert(outBuffer.end(), (const char *)payload + (written - headerLength),
+                         (const char *)payload + len);
+    }
+    return CODE_SUCCESS;
+}
+
+int S3tpConnector::writeMessage(uint8_t port, const void * data, size_t len, uint8_t priorityCode) {
+    char header[FRAME_PORT_PREFIX_LENGTH + FRAME_HEADER_MAX_LENGTH];
+
+    //Type, priority class and length are sent along with the payload
+    size_t headerLength = encodePortPrefix(header, port);
+    headerLength += encode_frame_header(header + headerLength, APP_DATA_MESSAGE, &priorityCode, len);
+    if (write_frame_safe(socketDescriptor, header, headerLength, data, len) != CODE_SUCCESS) {
+        LOG_WARN("Error while writing to S3TP socket");
 
-        LOG_DEBUG(std::string("Written " + std::to_string(wr) + " bytes to S3TP"));
+        return CODE_ERROR_SOCKET_WRITE;
+    }
+    return CODE_SUCCESS;
+}
 
-        //Waiting for asynchronous response
-        status_cond.wait(lock);
+/**
+ * Writes the message directly into the upstream ring, where the daemon fragments it from.
+ * Must be called with the connector lock held, which is released while waiting for space.
+ */
+int S3tpConnector::writeSharedMessage(uint8_t port, const void * data, size_t len, uint8_t priorityCode,
+                                      std::unique_lock<std::mutex>& lock) {
+    SharedRing * upstream = shared->getUpstream();
+    char * payload;
+
+    while ((payload = upstream->reserve(len)) == NULL) {
+        if (upstream->isCorrupt()) {
+            LOG_ERROR("Shared memory is corrupt");
+            return CODE_ERROR_SHARED_MEMORY;
+        }
+        //Listener thread is woken up by the daemon once space was freed
+        if (upstream->waitForSpace(len)) {
+            status_cond.wait(lock);
+        }
         if (!connected) {
-            LOG_DEBUG("Discnnected from S3TP");
             return CODE_ERROR_SOCKET_NO_CONN;
         }
+    }
+    memcpy(payload, data, len);
+    upstream->commit(APP_DATA_MESSAGE, priorityCode, 0, port);
+    return CODE_SUCCESS;
+}
 
-        if (lastMessageAck && !s3tpBufferFull) {
-            //ACK was received correctly
-            break;
-        }
-        LOG_DEBUG("Received NACK from S3TP. Queue is currently full. Waiting till queue can be written again");
-        status_cond.wait(lock);
-    } while(connected);
+int S3tpConnector::cancelAll() {
+    return cancel(S3TP_MESSAGE_ID_ALL);
+}
 
-    LOG_DEBUG("Received ACK from S3TP");
+int S3tpConnector::cancel(uint32_t messageId) {
+    return cancelOnPort(config.port, messageId);
+}
+
+int S3tpConnector::cancelOnPort(uint8_t port, uint32_t messageId) {
+    char header[FRAME_PORT_PREFIX_LENGTH + sizeof(AppMessageType)];
+    S3TP_CONTROL control;
 
-    return (int)wr;
+    if (!isConnected()) {
+        LOG_ERROR("Trying to write on closed channel. Sutting down");
+
+        return CODE_ERROR_SOCKET_NO_CONN;
+    }
+    size_t headerLength = encodePortPrefix(header, port);
+    header[headerLength++] = (char)APP_CONTROL_MESSAGE;
+
+    control.controlMessageType = CANCEL;
+    control.error = 0;
+    control.messageId = messageId;
+    control.length = 0;
+
+    std::unique_lock<std::mutex> lock(connector_mutex);
+    if (getPortState(port) == NULL) {
+        LOG_ERROR(std::string("Port " + std::to_string((int)port) + " is not registered on this connector"));
+        return CODE_ERROR_PORT_NOT_REGISTERED;
+    }
+    if (nonBlocking) {
+        //Answer is handled by onReadable
+        return queueFrame(header, headerLength, &control, sizeof(S3TP_CONTROL));
+    }
+    cancelAnswered = false;
+    if (write_frame_safe(socketDescriptor, header, headerLength, &control, sizeof(S3TP_CONTROL)) != CODE_SUCCESS) {
+        LOG_WARN("Error while writing to S3TP socket");
+
+        return CODE_ERROR_SOCKET_WRITE;
+    }
+
+    //Waiting for asynchronous response
+    status_cond.wait(lock, [this]{ return cancelAnswered || !connected; });
+    if (!connected) {
+        LOG_DEBUG("Discnnected from S3TP");
+        return CODE_ERROR_SOCKET_NO_CONN;
+    }
+    LOG_DEBUG(std::string("Cancelled message " + std::to_string(messageId) + ": "
+                          + std::to_string(lastCancelledBytes) + " bytes reclaimed"));
+
+    return (int)lastCancelledBytes;
+}
+
+/**
+ * Returns the messages received since the previous call, reading from the socket only if none is available.
+ * Control messages sent by the daemon (e.g. credit) are handled along the way.
+ */
+int S3tpConnector::recvBatch(const S3TP_MESSAGE_VIEW ** messages) {
+    *messages = NULL;
+    if (callback != NULL) {
+        LOG_WARN("Messages are delivered to the callback, they cannot be received synchronously");
+        return CODE_ERROR_ASYNC_RECEIVE;
+    }
+    if (!isConnected()) {
+        LOG_ERROR("Trying to read from a closed channel. Shutting down");
+
+        return CODE_ERROR_SOCKET_NO_CONN;
+    }
+    //Views returned by the previous call are not used anymore
+    batch.clear();
+    int error = parseFrames();
+    while (error == CODE_SUCCESS && batch.empty()) {
+        error = fillArena();
+        if (error == CODE_SUCCESS) {
+            error = parseFrames();
+        }
+    }
+    if (error != CODE_SUCCESS) {
+        return error;
+    }
+    *messages = batch.data();
+    return (int)batch.size();
 }
 
 //TODO: update recv logic!!
@@ -265,148 +730,344 @@ void S3tpConnector::closeConnection() {
     }
     connected = false;
     status_cond.notify_all();
+    for (auto &it : ports) {
+        it.second.credit_cond.notify_all();
+    }
     connector_mutex.unlock();
 }
 
 /*
- * Asynchronous thread routine
+ * Non-blocking connectors, driven by the event loop of the application
  */
-void S3tpConnector::asyncListener() {
-    ssize_t rd;
-    AppMessageType type;
-    S3TP_CONTROL control;
-
-    LOG_DEBUG("Started Client async listener thread");
+int S3tpConnector::getPollDescriptor() {
+    return socketDescriptor;
+}
 
-    while (isConnected()) {
-        rd = read(socketDescriptor, &type, sizeof(AppMessageType));
-        if (rd == 0) {
-            //Socket was already closed
-            LOG_WARN("Connection to S3TP was closed by server");
+/**
+ * Whether frames are waiting for the socket to become writable.
+ */
+bool S3tpConnector::hasPendingOutput() {
+    std::lock_guard<std::mutex> lock(connector_mutex);
+    return outOffset < outBuffer.size();
+}
 
-            closeConnection();
-            break;
-        } else if (rd < 0) {
-            LOG_ERROR("Unknown error occurred during read phase. Shutting down");
+/**
+ * Reads everything available and handles it: messages, credit, completions and cancel results
+ * are passed to the callback.
+ * @return  CODE_SUCCESS, or a negative error code if the connection was closed.
+ */
+int S3tpConnector::onReadable() {
+    if (!nonBlocking) {
+        return CODE_ERROR_ASYNC_RECEIVE;
+    }
+    while (true) {
+        int error = fillArena();
+        if (error == CODE_ERROR_WOULD_BLOCK) {
+            return CODE_SUCCESS;
+        } else if (error == CODE_SUCCESS) {
+            error = parseFrames();
+        }
+        if (error != CODE_SUCCESS) {
+            return error;
+        }
+        deliverBatch();
+    }
+}
 
-            closeConnection();
+/**
+ * Writes queued frames, as far as the socket allows.
+ * @return  CODE_SUCCESS, or a negative error code if the connection broke.
+ */
+int S3tpConnector::onWritable() {
+    std::lock_guard<std::mutex> lock(connector_mutex);
+    while (outOffset < outBuffer.size()) {
+        ssize_t wr = ::send(socketDescriptor, outBuffer.data() + outOffset, outBuffer.size() - outOffset,
+                            MSG_NOSIGNAL);
+        if (wr > 0) {
+            outOffset += wr;
+            continue;
+        } else if (wr < 0 && errno == EINTR) {
+            continue;
+        } else if (wr < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             break;
         }
-        type = safeMessageTypeInterpretation(type);
-        if (type == APP_CONTROL_MESSAGE) {
-            if (!receiveControlMessage(control)) {
+        LOG_WARN("Error while writing to S3TP socket");
+
+        return CODE_ERROR_SOCKET_WRITE;
+    }
+    if (outOffset == outBuffer.size()) {
+        outBuffer.clear();
+        outOffset = 0;
+    }
+    return CODE_SUCCESS;
+}
+
+/*
+ * Asynchronous thread routine
+ */
+void S3tpConnector::asyncListener() {
+    LOG_DEBUG("Started Client async listener thread");
+
+    while (isConnected()) {
+        if (shared != NULL) {
+            //Waiting for either the socket or the doorbell of the shared memory
+            struct pollfd fds[2];
+            fds[0].fd = socketDescriptor;
+            fds[0].events = POLLIN;
+            fds[1].fd = shared->getAppDoorbell();
+            fds[1].events = POLLIN;
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("Unknown error occurred while waiting for S3TP. Shutting down");
+
+                closeConnection();
                 break;
             }
-        } else if (type == APP_DATA_MESSAGE) {
-            if (!receiveDataMessage()) {
+            if ((fds[1].revents & POLLIN) && !receiveSharedMessages()) {
                 break;
             }
+            if (fds[0].revents == 0) {
+                continue;
+            }
+        }
+        //Everything available is read at once, then all complete frames are handled
+        if (fillArena() != CODE_SUCCESS || parseFrames() != CODE_SUCCESS) {
+            break;
         }
+        deliverBatch();
     }
     LOG_DEBUG("Listener thread: STOP");
 }
 
-bool S3tpConnector::receiveControlMessage(S3TP_CONTROL& control) {
+/**
+ * Reads whatever the daemon sent so far into the arena, blocking until something arrives.
+ * Must only be called with an empty batch, as the data left in the arena is moved to its front.
+ */
+int S3tpConnector::fillArena() {
     ssize_t rd;
 
-    rd = read(socketDescriptor, &control, sizeof(S3TP_CONTROL));
-
-    //Handle socket errors
-    if (rd == 0) {
-        connector_mutex.lock();
-        connected = false;
-        connector_mutex.unlock();
+    if (arenaOffset > 0) {
+        //Only an incomplete frame can be left over
+        memmove(arena.data(), arena.data() + arenaOffset, arenaLength - arenaOffset);
+        arenaLength -= arenaOffset;
+        arenaOffset = 0;
+    }
+    if (arenaLength == arena.size()) {
+        //Frame is larger than the arena
+        arena.resize(arena.size() * 2);
+    }
+    do {
+        rd = read(socketDescriptor, arena.data() + arenaLength, arena.size() - arenaLength);
+    } while (rd < 0 && errno == EINTR);
+    if (rd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        //Non-blocking connectors only
+        return CODE_ERROR_WOULD_BLOCK;
+    } else if (rd == 0) {
         LOG_WARN("Connection to S3TP was closed by server");
-        return false;
+
+        closeConnection();
+        return CODE_ERROR_SOCKET_NO_CONN;
     } else if (rd < 0) {
+        LOG_ERROR("Unknown error occurred during read phase. Shutting down");
+
         closeConnection();
-        return false;
+        return CODE_ERROR_SOCKET_READ;
+    }
+    arenaLength += rd;
+    return CODE_SUCCESS;
+}
+
+/**
+ * Handles all complete frames in the arena. Control messages are applied right away,
+ * data messages and chunks are appended to the batch, pointing into the arena.
+ * @return  CODE_SUCCESS, or an error code if the daemon sent corrupt data, in which case the connection is closed.
+ */
+int S3tpConnector::parseFrames() {
+    //Frames of multiplexed connections start with their port
+    size_t prefix = multiplexed ? FRAME_PORT_PREFIX_LENGTH : 0;
+
+    while (arenaOffset + prefix < arenaLength) {
+        const char * input = arena.data() + arenaOffset + prefix;
+        size_t available = arenaLength - arenaOffset - prefix;
+        uint8_t port = multiplexed ? (uint8_t)arena[arenaOffset] : config.port;
+        AppMessageType type = safeMessageTypeInterpretation((uint8_t)input[0]);
+
+        if (type == APP_CONTROL_MESSAGE) {
+            S3TP_CONTROL control;
+            if (available < sizeof(AppMessageType) + sizeof(S3TP_CONTROL)) {
+                break;
+            }
+            memcpy(&control, input + sizeof(AppMessageType), sizeof(S3TP_CONTROL));
+            arenaOffset += prefix + sizeof(AppMessageType) + sizeof(S3TP_CONTROL);
+            handleControlMessage(port, control);
+            continue;
+        } else if (type != APP_DATA_MESSAGE && type != APP_STREAM_MESSAGE) {
+            LOG_ERROR("Unknown data received from S3TP daemon. Shutting down");
+
+            closeConnection();
+            return CODE_ERROR_INVALID_TYPE;
+        }
+
+        uint8_t markerCode = 0;
+        size_t len;
+        int headerLength = decode_frame_header(input, available, type == APP_STREAM_MESSAGE, &markerCode, &len);
+        if (headerLength == 0) {
+            break;
+        } else if (headerLength < 0 || len > CONNECTOR_MAX_MESSAGE_LENGTH) {
+            LOG_ERROR("Corrupt data received from S3TP daemon. Shutting down");
+
+            closeConnection();
+            return CODE_ERROR_LENGTH_CORRUPT;
+        }
+        if (available < headerLength + len) {
+            break;
+        }
+        S3TP_MESSAGE_VIEW view;
+        view.data = input + headerLength;
+        view.length = len;
+        view.marker = (type == APP_STREAM_MESSAGE) ? safeStreamMarkerInterpretation(markerCode) : STREAM_COMPLETE;
+        view.port = port;
+        batch.push_back(view);
+        arenaOffset += prefix + headerLength + len;
     }
+    return CODE_SUCCESS;
+}
 
-    //Now checking the actual contents of the control message
+/**
+ * Hands the messages of the batch to the callback, which owns the data it receives.
+ */
+void S3tpConnector::deliverBatch() {
+    for (const S3TP_MESSAGE_VIEW& view : batch) {
+        char * message = new char[view.length + 1];
+        memcpy(message, view.data, view.length);
+        message[view.length] = '\0';
+
+        LOG_DEBUG(std::string("Received data (" + std::to_string(view.length)
+                              + " bytes) on port " + std::to_string((int)view.port)));
+        if (view.marker != STREAM_COMPLETE) {
+            callback->onNewPortChunk(view.port, message, view.length, view.marker);
+        } else {
+            callback->onNewPortMessage(view.port, message, view.length);
+        }
+    }
+    batch.clear();
+}
+
+void S3tpConnector::handleControlMessage(uint8_t port, const S3TP_CONTROL& control) {
     AppControlMessageType type = safeMessageTypeInterpretation(control.controlMessageType);
+    int error = (int8_t)control.error;
+    std::vector<S3TP_PENDING_SEND> completed;
+    bool sendAvailable = false;
+
     connector_mutex.lock();
+    S3TP_PORT_STATE * state = getPortState(port);
+    if (state == NULL) {
+        connector_mutex.unlock();
+        LOG_WARN(std::string("Control message received for port " + std::to_string((int)port)
+                             + ", which is not registered on this connector"));
+        return;
+    }
     switch (type) {
-        case ACK:
-            lastMessageAck = true;
+        case CREDIT:
+            state->credit_bytes += control.length;
+            state->credit_messages += control.messageId;
+            state->credit_cond.notify_all();
+            if (state->credit_window == 0) {
+                //Initial credit of a port registered after the handshake
+                state->credit_window = control.length;
+            }
+            if (nonBlocking) {
+                //Credit comes back in the order in which messages were sent
+                for (uint32_t i = 0; i < control.messageId && !state->pending_sends.empty(); i++) {
+                    completed.push_back(state->pending_sends.front());
+                    state->pending_sends.pop_front();
+                }
+                sendAvailable = state->send_refused;
+                state->send_refused = false;
+            }
             break;
         case NACK:
-            lastMessageAck = false;
-            //The type of error is not relevant, as we just cannot write the message
-            s3tpBufferFull = true;
+            for (S3TP_PENDING_SEND& pending : state->pending_sends) {
+                if (pending.message_id == control.messageId) {
+                    pending.result = error;
+                    break;
+                }
+            }
+            break;
+        case CANCEL:
+            lastCancelledBytes = control.length;
+            cancelAnswered = true;
+            status_cond.notify_all();
             break;
-        case AVAILABLE:
-            s3tpBufferFull = false;
+        case OPEN:
+            state->answered = true;
+            state->result = error;
             break;
         default:
             break;
     }
-    status_cond.notify_all();
     connector_mutex.unlock();
-    return true;
-}
-
-bool S3tpConnector::receiveDataMessage() {
-    int err = 0;
-    ssize_t i, rd;
-    size_t len;
-
-    err = read_length_safe(socketDescriptor, &len);
-    if (err == CODE_ERROR_LENGTH_CORRUPT) {
-        LOG_ERROR("Corrupt data received while connecting to S3TP daemon. Shutting down");
-
-        closeConnection();
-        return false;
-    } else if (err == CODE_ERROR_SOCKET_NO_CONN) {
-        //Socket was already closed
-        LOG_WARN("Connection to S3TP was closed by server");
-
-        connector_mutex.lock();
-        connected = false;
-        connector_mutex.unlock();
-        return false;
-    } else if (err < 0) {
-        LOG_ERROR("Unknown error occurred during read phase. Shutting down");
 
-        closeConnection();
-        return false;
+    //Callbacks are invoked outside of the critical section, as they may send more messages
+    for (const S3TP_PENDING_SEND& pending : completed) {
+        callback->onSendComplete(pending.message_id, pending.result);
     }
-    //Length of next message received
-    char * message = new char[len+1];
-    char * currentPosition = message;
-
-    //Read payload
-    rd = 0;
-    do {
-        i = read(socketDescriptor, currentPosition, (len - rd));
-        //Checking errors
-        if (i == 0) {
-            connector_mutex.lock();
-            connected = false;
-            connector_mutex.unlock();
-            delete [] message;
-
-            LOG_WARN("Connection to S3TP was closed by server");
-
-            return false;
-        } else if (i < 0) {
-
-            LOG_WARN("Error while reading from S3TP socket");
-            closeConnection();
-            delete [] message;
-            return false;
+    if (sendAvailable) {
+        callback->onSendAvailable();
+    }
+    if (type == CANCEL && nonBlocking) {
+        callback->onCancelComplete(control.messageId, (int)control.length);
+    } else if (type == NACK && !nonBlocking) {
+        //Sender didn't wait for an answer, so it learns about the dropped message through the callback
+        std::string description = "Message " + std::to_string(control.messageId) + " on port "
+                                  + std::to_string((int)port) + " was dropped by S3TP (error "
+                                  + std::to_string(error) + ")";
+        LOG_WARN(description);
+        if (callback != NULL) {
+            callback->onError(error, (char *)description.c_str());
         }
-        rd += i;
-        currentPosition += i;
-    } while( (unsigned long) rd < len);
-
-    //Payload received entirely
-    message[len] = '\0';
-
-    LOG_DEBUG(std::string("Received data (" + std::to_string(len)
-                          + " bytes) on port " + std::to_string((int)config.port)
-                          + ": <" + message + ">"));
-    callback->onNewMessage(message, len);
+    }
+}
 
+/**
+ * Hands all messages available in the downstream ring to the callback.
+ */
+bool S3tpConnector::receiveSharedMessages() {
+    SHM_RECORD record;
+    SharedRing * downstream = shared->getDownstream();
+
+    SharedMemoryChannel::clearDoorbell(shared->getAppDoorbell());
+    while (true) {
+        char * payload = downstream->front(&record);
+        if (payload == NULL) {
+            if (downstream->isCorrupt()) {
+                LOG_ERROR("Shared memory is corrupt. Shutting down");
+
+                closeConnection();
+                return false;
+            } else if (downstream->waitForData()) {
+                break;
+            }
+            continue;
+        }
+        //Callback owns the message, so it is copied out of the ring
+        char * message = new char[record.length + 1];
+        memcpy(message, payload, record.length);
+        message[record.length] = '\0';
+        downstream->pop();
+
+        uint8_t port = multiplexed ? record.port : config.port;
+        if (safeMessageTypeInterpretation(record.type) == APP_STREAM_MESSAGE) {
+            callback->onNewPortChunk(port, message, record.length, safeStreamMarkerInterpretation(record.marker));
+        } else {
+            callback->onNewPortMessage(port, message, record.length);
+        }
+    }
+    //Doorbell is also rung when space was freed in the upstream ring
+    connector_mutex.lock();
+    status_cond.notify_all();
+    connector_mutex.unlock();
     return true;
 }
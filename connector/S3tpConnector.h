@@ -11,44 +11,221 @@
 #include <stdlib.h>
 #include <cstring>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include "../core/S3tpShared.h"
+#include "../core/SharedRing.h"
 #include "S3tpCallback.h"
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+
+//Bytes read from the socket at once. The arena grows if a single message doesn't fit
+#define CONNECTOR_ARENA_SIZE (256 * 1024)
+//Longest message accepted from the daemon. Longer lengths can only be caused by corrupt data
+#define CONNECTOR_MAX_MESSAGE_LENGTH (1024 * 1024)
+
+/**
+ * Message received by recvBatch. Data points into memory owned by the connector.
+ * Chunks of messages on streaming ports carry their marker, whole messages STREAM_COMPLETE.
+ */
+typedef struct tag_s3tp_message_view {
+    const char * data;
+    size_t length;
+    S3tpStreamMarker marker;
+    uint8_t port;
+}S3TP_MESSAGE_VIEW;
+
+/**
+ * Message sent by a non-blocking connector, which the daemon didn't return the credit of yet.
+ */
+typedef struct tag_s3tp_pending_send {
+    uint32_t message_id;
+    int result;
+}S3TP_PENDING_SEND;
+
+/**
+ * Port registered by the connector. The daemon grants credit to each port separately.
+ */
+typedef struct tag_s3tp_port_state {
+    //Credit may become negative with a message larger than the whole window
+    int64_t credit_bytes;
+    uint32_t credit_messages;
+    size_t credit_window;
+    //Senders waiting for credit of this port only, so that credit of one port doesn't wake up the others
+    std::condition_variable credit_cond;
+    //Set once the daemon answered the registration of the port
+    bool answered;
+    int result;
+    //Non-blocking connectors only
+    bool send_refused;
+    std::deque<S3TP_PENDING_SEND> pending_sends;
+}S3TP_PORT_STATE;
 
 class S3tpConnector {
 public:
     S3tpConnector();
     ~S3tpConnector();
+    /**
+     * Connects to the S3TP daemon, using the given port configuration.
+     * With S3TP_OPTION_SHARED_MEMORY, messages are exchanged with the daemon through shared memory,
+     * saving a copy and a few system calls per message. This requires a callback, as messages are only
+     * received asynchronously then. If the daemon cannot use the shared memory, the socket is used instead.
+     */
     int init(S3TP_CONFIG config, S3tpCallback * callback);
+    /**
+     * Connects to the S3TP daemon like init, but without starting a thread: the connector is driven by
+     * the event loop of the application instead. The loop watches getPollDescriptor, calls onReadable when it is
+     * readable, and onWritable when it is writable while hasPendingOutput. All callbacks are invoked from
+     * within these methods. Sending never blocks (see sendAsync), and neither does cancel, whose result is
+     * reported through onCancelComplete. Shared memory is not available in this mode.
+     * @param callback  Receives messages, completions and errors. Required.
+     */
+    int initNonBlocking(S3TP_CONFIG config, S3tpCallback * callback);
+    /**
+     * Connects to the S3TP daemon and registers all the given ports over the same connection, so that a single
+     * socket (and a single listener thread) serves all of them, on both sides.
+     * Every port has its own credit: a port whose messages cannot be taken yet doesn't hold back the others.
+     * Messages are passed to onNewPortMessage (or onNewPortChunk) along with the port they were received on.
+     * Shared memory, if requested by the first configuration, is used by all ports.
+     * The connection is closed if any of the ports is refused.
+     * @param configs  Configuration of each port. At least one is required, the first one is used by send and cancel.
+     * @param callback  Receives messages and errors of all ports. Required.
+     */
+    int init(const std::vector<S3TP_CONFIG>& configs, S3tpCallback * callback);
+    /**
+     * Registers several ports like init(configs, callback), on a connector driven by the event loop
+     * of the application (see initNonBlocking).
+     */
+    int initNonBlocking(const std::vector<S3TP_CONFIG>& configs, S3tpCallback * callback);
     /**
      * Sends data to the underlying transport layer (S3TP).
-     * As the S3TP module could have its output buffer full and temporarily not be able to send more data,
-     * this method will block as long as long as the data was not written entirely.
+     * The daemon grants a window (credit) of bytes and messages that may be sent without waiting for it,
+     * and returns credit in batches as it takes messages. This method returns as soon as the message was written,
+     * and only blocks while the credit is used up. Messages dropped by S3TP are reported to the callback (onError),
+     * along with their id, as the message was already sent by then. Credit is only returned with a callback set.
      * @param data  Pointer to the data to be written. Can be any kind of data, as long as it is contiguous in memory.
      * @param len  The amount of data to be written (i.e. the length of the passed structure).
      * @return  Returns the number of bytes sent.
      */
     int send(const void * data, size_t len);
+    /**
+     * Sends data to the underlying transport layer (S3TP) using the given priority class.
+     * Messages of a higher class overtake messages of a lower class that are still queued on the same port,
+     * but a message that is already being transmitted is never interrupted.
+     * Messages belonging to the same class are always delivered in the order in which they were sent.
+     * @param data  Pointer to the data to be written. Can be any kind of data, as long as it is contiguous in memory.
+     * @param len  The amount of data to be written (i.e. the length of the passed structure).
+     * @param priority  Priority class of the message. send(data, len) uses PRIORITY_NORMAL.
+     * @return  Returns the number of bytes sent.
+     */
+    int send(const void * data, size_t len, S3tpPriority priority);
+    /**
+     * Same as send(data, len, priority), but also returns the id assigned to the message by S3TP.
+     * Ids are assigned in the order in which messages are sent, so they are known without asking the daemon.
+     * The id can be used to cancel the message later on, as long as it was not transmitted yet.
+     * @param messageId  Output parameter that will hold the id of the message. Not modified if the message was rejected.
+     * @return  Returns the number of bytes sent.
+     */
+    int send(const void * data, size_t len, S3tpPriority priority, uint32_t * messageId);
+    /**
+     * Sends a message without ever blocking, on non-blocking connectors (same as send otherwise).
+     * If the credit is used up, CODE_ERROR_WOULD_BLOCK is returned, and onSendAvailable is called once
+     * messages can be sent again. Once the daemon is done with the message, onSendComplete is called with its id.
+     * @param messageId  Output parameter that will hold the id of the message, identifying its completion.
+     * @return  Returns the number of bytes sent, or a negative error code.
+     */
+    int sendAsync(const void * data, size_t len, S3tpPriority priority, uint32_t * messageId);
+    /**
+     * Same as send and sendAsync, on one of the ports registered by init(configs, callback).
+     * Only the credit of that port is used. Message ids are unique across all ports of the connector.
+     * @return  Returns the number of bytes sent, or a negative error code
+     * (CODE_ERROR_PORT_NOT_REGISTERED if the port wasn't registered).
+     */
+    int sendToPort(uint8_t port, const void * data, size_t len, S3tpPriority priority, uint32_t * messageId);
+    int sendAsyncToPort(uint8_t port, const void * data, size_t len, S3tpPriority priority, uint32_t * messageId);
+    /**
+     * Removes a previously sent message from the S3TP output buffer.
+     * Fragments that were already transmitted cannot be taken back, so a message which is currently
+     * being transmitted is not cancelled.
+     * @param messageId  The id returned by send, or S3TP_MESSAGE_ID_ALL to cancel all messages queued on this port.
+     * @return  Returns the number of payload bytes that were reclaimed, or a negative error code.
+     */
+    int cancel(uint32_t messageId);
+    int cancelAll();
+    /**
+     * Same as cancel, for messages sent on one of the ports registered by init(configs, callback).
+     */
+    int cancelOnPort(uint8_t port, uint32_t messageId);
+    /**
+     * Receives all messages available, waiting for at least one. Only available without a callback.
+     * The socket is read in large chunks into a buffer reused across calls, and as many messages
+     * as it contains are returned at once, without copying them.
+     * @param messages  Output parameter that will point to the received messages.
+     * These are only valid until the next call of recvBatch.
+     * @return  Returns the number of messages received, or a negative error code.
+     */
+    int recvBatch(const S3TP_MESSAGE_VIEW ** messages);
     char * recvRaw(size_t * len, int * error);
     int recv(void * buffer, size_t len);
     void closeConnection();
     bool isConnected();
+    /*
+     * Non-blocking connectors only
+     */
+    int getPollDescriptor();
+    bool hasPendingOutput();
+    int onReadable();
+    int onWritable();
 private:
     int socketDescriptor;
     bool connected;
-    bool lastMessageAck;
-    bool s3tpBufferFull;
+    bool cancelAnswered;
+    uint32_t lastCancelledBytes;
+    //Ids are counted across all ports of the connection, as the daemon does
+    uint32_t nextMessageId;
     std::mutex connector_mutex;
     std::thread listener_thread;
     std::condition_variable status_cond;
     S3TP_CONFIG config;
     S3tpCallback * callback;
+    SharedMemoryChannel * shared;
+    bool nonBlocking;
+    bool multiplexed;
+    std::map<uint8_t, S3TP_PORT_STATE> ports;
+    //Frames not written yet by a non-blocking connector
+    std::vector<char> outBuffer;
+    size_t outOffset;
+
+    //Used by the listener thread, or by recvBatch if there is no callback
+    std::vector<char> arena;
+    size_t arenaOffset;
+    size_t arenaLength;
+    std::vector<S3TP_MESSAGE_VIEW> batch;
 
+    int connectToDaemon(S3TP_CONFIG config, S3tpCallback * callback);
+    int connectMultiplexed(std::vector<S3TP_CONFIG> configs, S3tpCallback * callback);
+    int openPorts(const std::vector<S3TP_CONFIG>& configs);
+    int makeNonBlocking();
+    S3TP_PORT_STATE& addPort(uint8_t port);
+    S3TP_PORT_STATE * getPortState(uint8_t port);
+    bool hasCredit(const S3TP_PORT_STATE& state, size_t len);
+    uint32_t takeMessageId();
+    size_t encodePortPrefix(char * header, uint8_t port);
+    int queueFrame(const void * header, size_t headerLength, const void * payload, size_t len);
     void asyncListener();
-    bool receiveControlMessage(S3TP_CONTROL& control);
-    bool receiveDataMessage();
+    int fillArena();
+    int parseFrames();
+    void deliverBatch();
+    void handleControlMessage(uint8_t port, const S3TP_CONTROL& control);
+    bool receiveSharedMessages();
+    int writeMessage(uint8_t port, const void * data, size_t len, uint8_t priorityCode);
+    int writeSharedMessage(uint8_t port, const void * data, size_t len, uint8_t priorityCode,
+                           std::unique_lock<std::mutex>& lock);
 };
 
 #endif //S3TP_S3TP_CONNECTOR_H
@@ -23,17 +23,58 @@ void Buffer::clear() {
     }
     queues.clear();
     packet_counter.clear();
+    fragmented_message_class.clear();
     pthread_mutex_unlock(&buffer_mutex);
 }
 
 void Buffer::clearQueueForPort(uint8_t port) {
     pthread_mutex_lock(&buffer_mutex);
-    std::map<int, PriorityQueue<S3TP_PACKET*>*>::iterator el = queues.find(port);
-    if (el != queues.end()) {
-        el->second->clear();
+    for (uint8_t priority = 0; priority < S3TP_PRIORITY_CLASSES; priority++) {
+        std::map<int, PriorityQueue<S3TP_PACKET*>*>::iterator el = queues.find(getQueueId(port, priority));
+        if (el != queues.end()) {
+            el->second->clear();
+        }
     }
     packet_counter.erase(port);
+    fragmented_message_class.erase(port);
+    pthread_mutex_unlock(&buffer_mutex);
+}
+
+/**
+ * Removes all packets of a message (or of all messages, if S3TP_MESSAGE_ID_ALL is passed) queued on a port.
+ * A message of which some fragments were already consumed is left untouched,
+ * as the receiver would otherwise not be able to reassemble it.
+ * @return  The removed packets. Ownership is passed to the caller.
+ */
+std::vector<S3TP_PACKET *> Buffer::removeMessages(uint8_t port, uint32_t messageId) {
+    std::vector<S3TP_PACKET *> result;
+
+    pthread_mutex_lock(&buffer_mutex);
+    removeMessagesInternal(port, messageId, &result);
     pthread_mutex_unlock(&buffer_mutex);
+
+    return result;
+}
+
+/**
+ * Measures the packets a message written with the S3TP_OPTION_SUPERSEDE option would remove from a port right now.
+ * @return  The payload (in bytes) of these packets. Their number is stored in packets, if not NULL.
+ */
+size_t Buffer::getSupersededPayload(uint8_t port, size_t * packets) {
+    std::vector<S3TP_PACKET *> found;
+    size_t result = 0;
+
+    pthread_mutex_lock(&buffer_mutex);
+    findMessagesInternal(port, S3TP_MESSAGE_ID_ALL, &found, false);
+    for (auto const &packet : found) {
+        result += packet->getHeader()->getPduLength();
+    }
+    pthread_mutex_unlock(&buffer_mutex);
+
+    if (packets != NULL) {
+        *packets = found.size();
+    }
+    return result;
 }
 
 bool Buffer::packetsAvailable() {
@@ -44,38 +85,68 @@ bool Buffer::packetsAvailable() {
     return result;
 }
 
-int Buffer::write(S3TP_PACKET * packet) {
+/**
+ * Writes a packet into the queue matching its port and priority class.
+ * If the packet is the first fragment of a message sent on a port with the S3TP_OPTION_SUPERSEDE option,
+ * all other messages of that port which were not transmitted yet are removed in the same step.
+ * @param superseded  Receives the removed packets, whose ownership is passed to the caller.
+ * Must not be NULL when writing packets with the S3TP_OPTION_SUPERSEDE option.
+ */
+int Buffer::write(S3TP_PACKET * packet, std::vector<S3TP_PACKET *> * superseded) {
+    return writeMessage(std::vector<S3TP_PACKET *>(1, packet), superseded);
+}
+
+/**
+ * Writes the packets of one message (all belonging to the same port and priority class) like write does.
+ * Either all of them are written, or none if the queue cannot hold them all.
+ */
+int Buffer::writeMessage(const std::vector<S3TP_PACKET *>& packets, std::vector<S3TP_PACKET *> * superseded) {
+    if (packets.empty()) {
+        return CODE_SUCCESS;
+    }
+    int result = CODE_SUCCESS;
     pthread_mutex_lock(&buffer_mutex);
-    S3TP_HEADER * hdr = packet->getHeader();
+    S3TP_PACKET * first = packets.front();
+    S3TP_HEADER * hdr = first->getHeader();
     int port = hdr->getPort();
+    bool supersede = (first->options & S3TP_OPTION_SUPERSEDE) && hdr->getSubSequence() == 0 && superseded != NULL;
 
-    PriorityQueue<S3TP_PACKET*> * queue = queues[port];
-    if (queue == NULL) {
-        //Adding new queue to the internal map
-        queue = new PriorityQueue<S3TP_PACKET*>();
-        queues[port] = queue;
+    uint8_t priority = (first->priority < S3TP_PRIORITY_CLASSES) ? first->priority : (uint8_t)PRIORITY_NORMAL;
+    for (auto const &packet : packets) {
+        packet->priority = priority;
     }
+    PriorityQueue<S3TP_PACKET*> * queue = getQueueInternal(port, priority);
 
-    if (!queue->isEmpty() && policyActor->maximumWindowExceeded(queue->peek(), packet)) {
+    if (!supersede && !queue->isEmpty() && policyActor->maximumWindowExceeded(queue->peek(), first)) {
         //Clearing queue, since maximum window was exceeded
+        packet_counter[port] -= queue->getSize();
+        if (packet_counter[port] <= 0) {
+            packet_counter.erase(port);
+        }
         queue->clear();
-        packet_counter.erase(port);
     }
-    if (queue->push(packet, policyActor) == QUEUE_FULL) {
-        LOG_INFO(std::string("Queue " + std::to_string(port)
-                              + " full. Dropped packet with sequence number "
-                              + std::to_string((int)hdr->seq_port)));
+    //Superseded messages are removed only once the new message is known to fit, so that they stay queued otherwise
+    size_t queued = supersede ? 0 : queue->getSize();
+    if (queued + packets.size() > MAX_QUEUE_CAPACITY) {
+        LOG_INFO(std::string("Queue " + std::to_string(port) + " full. Dropped message of "
+                             + std::to_string(packets.size()) + " packets"));
+        result = QUEUE_FULL;
     } else {
-        packet_counter[port] = queue->getSize();
-        LOG_DEBUG(std::string("Queue " + std::to_string(port)
-                              + ": packet "
-                              + std::to_string((int)hdr->seq_port) + " written ("
-                              + std::to_string((int)hdr->getPduLength()) + " bytes)"));
+        if (supersede) {
+            removeMessagesInternal((uint8_t)port, S3TP_MESSAGE_ID_ALL, superseded);
+        }
+        for (auto const &packet : packets) {
+            queue->push(packet, policyActor);
+        }
+        packet_counter[port] += packets.size();
+        LOG_DEBUG(std::string("Queue " + std::to_string(port) + ": message of "
+                              + std::to_string(packets.size()) + " packets written (priority "
+                              + std::to_string((int)priority) + ")"));
     }
 
     pthread_mutex_unlock(&buffer_mutex);
 
-    return CODE_SUCCESS;
+    return result;
 }
 
 std::set<int> Buffer::getActiveQueues() {
@@ -92,22 +163,11 @@ std::set<int> Buffer::getActiveQueues() {
     return result;
 }
 
-PriorityQueue<S3TP_PACKET *> * Buffer::getQueue(int port) {
-    pthread_mutex_lock(&buffer_mutex);
-    PriorityQueue<S3TP_PACKET*> * queue = queues[port];
-    if (queue == nullptr) {
-        queue = new PriorityQueue<S3TP_PACKET *>();
-        queues[port] = queue;
-    }
-    pthread_mutex_unlock(&buffer_mutex);
-    return queue;
-}
-
 S3TP_PACKET * Buffer::peektNextPacket(int port) {
     pthread_mutex_lock(&buffer_mutex);
     S3TP_PACKET * packet = NULL;
-    PriorityQueue<S3TP_PACKET * >* queue = queues[port];
-    if (queue != NULL && !queue->isEmpty()) {
+    PriorityQueue<S3TP_PACKET * >* queue = getNextQueueInternal(port);
+    if (queue != NULL) {
         packet = queue->peek();
     }
     pthread_mutex_unlock(&buffer_mutex);
@@ -117,12 +177,33 @@ S3TP_PACKET * Buffer::peektNextPacket(int port) {
 
 S3TP_PACKET * Buffer::getNextPacket(int port) {
     pthread_mutex_lock(&buffer_mutex);
-    S3TP_PACKET * packet = popPacketInternal(port);
+    S3TP_PACKET * packet = popPacketInternal(port, getNextQueueInternal(port));
     pthread_mutex_unlock(&buffer_mutex);
     return packet;
 }
 
-S3TP_PACKET * Buffer::getNextAvailablePacket() {
+/**
+ * Returns the next packet of a specific priority class on a port.
+ * Returns NULL if a fragmented message of another class is currently being consumed on that port.
+ */
+S3TP_PACKET * Buffer::getNextPacket(int port, uint8_t priority) {
+    pthread_mutex_lock(&buffer_mutex);
+    S3TP_PACKET * packet = NULL;
+    std::map<int, uint8_t>::iterator fragmented = fragmented_message_class.find(port);
+    std::map<int, PriorityQueue<S3TP_PACKET*>*>::iterator el = queues.find(getQueueId(port, priority));
+    if ((fragmented == fragmented_message_class.end() || fragmented->second == priority)
+        && el != queues.end() && !el->second->isEmpty()) {
+        packet = popPacketInternal(port, el->second);
+    }
+    pthread_mutex_unlock(&buffer_mutex);
+    return packet;
+}
+
+/**
+ * Returns the next packet of the highest priority class available on any port.
+ * Only classes strictly higher than priorityLimit are considered (by default all of them).
+ */
+S3TP_PACKET * Buffer::getNextAvailablePacket(uint8_t priorityLimit) {
     pthread_mutex_lock(&buffer_mutex);
     if (packet_counter.empty()) {
         pthread_mutex_unlock(&buffer_mutex);
@@ -130,10 +211,16 @@ S3TP_PACKET * Buffer::getNextAvailablePacket() {
     }
 
     S3TP_PACKET * packet = NULL;
-    for (auto const &it: packet_counter) {
-        packet = popPacketInternal(it.first);
-        if (packet != NULL) {
-            break;
+    for (uint8_t priority = 0; priority < priorityLimit && priority < S3TP_PRIORITY_CLASSES && packet == NULL; priority++) {
+        for (auto const &it: packet_counter) {
+            PriorityQueue<S3TP_PACKET*> * queue = getNextQueueInternal(it.first);
+            if (queue == NULL || queue->peek()->priority != priority) {
+                continue;
+            }
+            packet = popPacketInternal(it.first, queue);
+            if (packet != NULL) {
+                break;
+            }
         }
     }
     pthread_mutex_unlock(&buffer_mutex);
@@ -142,20 +229,146 @@ S3TP_PACKET * Buffer::getNextAvailablePacket() {
 
 int Buffer::getSizeOfQueue(uint8_t port) {
     pthread_mutex_lock(&buffer_mutex);
-    PriorityQueue<S3TP_PACKET*> * queue = queues[port];
-    if (queue == NULL) {
-        pthread_mutex_unlock(&buffer_mutex);
-        return 0;
-    }
-    int res = queue->getSize();
+    std::map<int, int>::iterator it = packet_counter.find(port);
+    int res = (it != packet_counter.end()) ? it->second : 0;
     pthread_mutex_unlock(&buffer_mutex);
 
     return res;
 }
 
-S3TP_PACKET * Buffer::popPacketInternal(int port) {
-    PriorityQueue<S3TP_PACKET*> * queue = queues[port];
-    if (queue == NULL || queue->isEmpty()) {
+int Buffer::getSizeOfQueue(uint8_t port, uint8_t priority) {
+    pthread_mutex_lock(&buffer_mutex);
+    std::map<int, PriorityQueue<S3TP_PACKET*>*>::iterator el = queues.find(getQueueId(port, priority));
+    int res = (el != queues.end()) ? (int)el->second->getSize() : 0;
+    pthread_mutex_unlock(&buffer_mutex);
+
+    return res;
+}
+
+/**
+ * Lists all messages currently queued, grouping the fragments of each message.
+ * Messages are returned per queue in the order in which they would be transmitted.
+ * A message whose last fragment was not queued yet is reported with the fragments available so far.
+ */
+std::vector<S3TP_MESSAGE_INFO> Buffer::getQueuedMessages() {
+    std::vector<S3TP_MESSAGE_INFO> result;
+
+    pthread_mutex_lock(&buffer_mutex);
+    for (auto const &it : queues) {
+        PriorityQueue<S3TP_PACKET*> * queue = it.second;
+        queue->lock();
+        bool newMessage = true;
+        for (PriorityQueue_node<S3TP_PACKET*> * node = queue->getHead(); node != NULL; node = node->next) {
+            S3TP_PACKET * packet = node->element;
+            S3TP_HEADER * hdr = packet->getHeader();
+            if (newMessage) {
+                S3TP_MESSAGE_INFO info;
+                info.message_id = packet->message_id;
+                info.port = hdr->getPort();
+                info.priority = packet->priority;
+                info.fragments = 0;
+                info.bytes = 0;
+                info.timestamp = packet->timestamp;
+                result.push_back(info);
+            }
+            result.back().fragments++;
+            result.back().bytes += hdr->getPduLength();
+            newMessage = !hdr->moreFragments();
+        }
+        queue->unlock();
+    }
+    pthread_mutex_unlock(&buffer_mutex);
+
+    return result;
+}
+
+/*
+ * Internal methods (do not use locking)
+ */
+int Buffer::getQueueId(int port, uint8_t priority) {
+    return port * S3TP_PRIORITY_CLASSES + priority;
+}
+
+PriorityQueue<S3TP_PACKET *> * Buffer::getQueueInternal(int port, uint8_t priority) {
+    PriorityQueue<S3TP_PACKET*> * queue = queues[getQueueId(port, priority)];
+    if (queue == NULL) {
+        //Adding new queue to the internal map
+        queue = new PriorityQueue<S3TP_PACKET*>();
+        queues[getQueueId(port, priority)] = queue;
+    }
+    return queue;
+}
+
+/**
+ * Returns the queue from which the next packet of a port should be taken, or NULL if no packet may be taken.
+ * Fragments of a message are never interleaved with packets of another message on the same port.
+ */
+PriorityQueue<S3TP_PACKET *> * Buffer::getNextQueueInternal(int port) {
+    std::map<int, uint8_t>::iterator fragmented = fragmented_message_class.find(port);
+    if (fragmented != fragmented_message_class.end()) {
+        //Must finish the message first, even if its next fragment is not yet available
+        std::map<int, PriorityQueue<S3TP_PACKET*>*>::iterator el = queues.find(getQueueId(port, fragmented->second));
+        if (el == queues.end() || el->second->isEmpty()) {
+            return NULL;
+        }
+        return el->second;
+    }
+    for (uint8_t priority = 0; priority < S3TP_PRIORITY_CLASSES; priority++) {
+        std::map<int, PriorityQueue<S3TP_PACKET*>*>::iterator el = queues.find(getQueueId(port, priority));
+        if (el != queues.end() && !el->second->isEmpty()) {
+            return el->second;
+        }
+    }
+    return NULL;
+}
+
+void Buffer::removeMessagesInternal(uint8_t port, uint32_t messageId, std::vector<S3TP_PACKET *> * removed) {
+    findMessagesInternal(port, messageId, removed, true);
+}
+
+/**
+ * Collects the packets of a message (or of all messages) queued on a port,
+ * skipping the remaining fragments of the message currently being transmitted. Optionally removes them as well.
+ */
+void Buffer::findMessagesInternal(uint8_t port, uint32_t messageId, std::vector<S3TP_PACKET *> * found,
+                                  bool remove) {
+    size_t count = found->size();
+    std::map<int, uint8_t>::iterator fragmented = fragmented_message_class.find(port);
+    for (uint8_t priority = 0; priority < S3TP_PRIORITY_CLASSES; priority++) {
+        std::map<int, PriorityQueue<S3TP_PACKET*>*>::iterator el = queues.find(getQueueId(port, priority));
+        if (el == queues.end()) {
+            continue;
+        }
+        PriorityQueue<S3TP_PACKET*> * queue = el->second;
+        queue->lock();
+        PriorityQueue_node<S3TP_PACKET*> * node = queue->getHead();
+        if (node != NULL && fragmented != fragmented_message_class.end() && fragmented->second == priority) {
+            //Skipping the remaining fragments of the message currently being transmitted
+            uint32_t inTransmission = node->element->message_id;
+            while (node != NULL && node->element->message_id == inTransmission) {
+                node = node->next;
+            }
+        }
+        while (node != NULL) {
+            if (messageId == S3TP_MESSAGE_ID_ALL || node->element->message_id == messageId) {
+                found->push_back(node->element);
+                node = remove ? queue->erase(node) : node->next;
+            } else {
+                node = node->next;
+            }
+        }
+        queue->unlock();
+    }
+    if (remove && found->size() > count) {
+        packet_counter[port] -= found->size() - count;
+        if (packet_counter[port] <= 0) {
+            packet_counter.erase(port);
+        }
+    }
+}
+
+S3TP_PACKET * Buffer::popPacketInternal(int port, PriorityQueue<S3TP_PACKET *> * queue) {
+    if (queue == NULL) {
         return NULL;
     }
     S3TP_PACKET * packet = queue->peek();
@@ -163,10 +376,13 @@ S3TP_PACKET * Buffer::popPacketInternal(int port) {
         return NULL;
     }
     packet = queue->pop();
-    if (queue->isEmpty()) {
-        packet_counter.erase(port);
+    if (packet->getHeader()->moreFragments()) {
+        fragmented_message_class[port] = packet->priority;
     } else {
-        packet_counter[port] = queue->getSize();
+        fragmented_message_class.erase(port);
+    }
+    if (--packet_counter[port] <= 0) {
+        packet_counter.erase(port);
     }
     return packet;
-}
\ No newline at end of file
+}
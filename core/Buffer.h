@@ -8,30 +8,62 @@
 #include "PriorityQueue.h"
 #include <map>
 #include <set>
+#include <vector>
 
+/**
+ * Summary of a message currently held in a buffer queue.
+ * Bytes only count the payload of all fragments, timestamp refers to the first fragment.
+ */
+struct S3TP_MESSAGE_INFO {
+    uint32_t message_id;
+    uint8_t port;
+    uint8_t priority;
+    uint16_t fragments;
+    size_t bytes;
+    uint64_t timestamp;
+};
+
+/**
+ * Buffer holding one queue per port and priority class.
+ * Packets are always returned from the highest priority class available on a port,
+ * unless a fragmented message of a lower class is currently being consumed on that port.
+ * In that case, the remaining fragments of that message are returned first.
+ * Ports using the S3TP_OPTION_SUPERSEDE option only ever hold their latest message.
+ */
 class Buffer {
 public:
     Buffer(PolicyActor<S3TP_PACKET*> * policyActor);
     ~Buffer();
     bool packetsAvailable();
-    int write(S3TP_PACKET * packet);
+    int write(S3TP_PACKET * packet, std::vector<S3TP_PACKET *> * superseded = NULL);
+    int writeMessage(const std::vector<S3TP_PACKET *>& packets, std::vector<S3TP_PACKET *> * superseded = NULL);
     std::set<int> getActiveQueues();
-    PriorityQueue<S3TP_PACKET *> * getQueue(int port);
     S3TP_PACKET * peektNextPacket(int port);
     S3TP_PACKET * getNextPacket(int port);
-    S3TP_PACKET * getNextAvailablePacket();
+    S3TP_PACKET * getNextPacket(int port, uint8_t priority);
+    S3TP_PACKET * getNextAvailablePacket(uint8_t priorityLimit = S3TP_PRIORITY_CLASSES);
+    std::vector<S3TP_MESSAGE_INFO> getQueuedMessages();
+    size_t getSupersededPayload(uint8_t port, size_t * packets);
     int getSizeOfQueue(uint8_t port);
+    int getSizeOfQueue(uint8_t port, uint8_t priority);
     void clear();
     void clearQueueForPort(uint8_t port);
+    std::vector<S3TP_PACKET *> removeMessages(uint8_t port, uint32_t messageId);
 
 private:
     PolicyActor<S3TP_PACKET *> * policyActor;
     std::map<int, PriorityQueue<S3TP_PACKET*>*> queues;
     std::map<int, int> packet_counter;
+    std::map<int, uint8_t> fragmented_message_class;
 
     pthread_mutex_t buffer_mutex;
 
-    S3TP_PACKET * popPacketInternal(int port);
+    static int getQueueId(int port, uint8_t priority);
+    PriorityQueue<S3TP_PACKET *> * getQueueInternal(int port, uint8_t priority);
+    PriorityQueue<S3TP_PACKET *> * getNextQueueInternal(int port);
+    S3TP_PACKET * popPacketInternal(int port, PriorityQueue<S3TP_PACKET *> * queue);
+    void removeMessagesInternal(uint8_t port, uint32_t messageId, std::vector<S3TP_PACKET *> * removed);
+    void findMessagesInternal(uint8_t port, uint32_t messageId, std::vector<S3TP_PACKET *> * found, bool remove);
 };
 
 #endif //S3TP_BUFFER_H
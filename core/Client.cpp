@@ -4,258 +4,738 @@
 
 #include "Client.h"
 
-Client::Client(SOCKET socket, S3TP_CONFIG config, ClientInterface * listener) {
+Client::Client(SOCKET socket, ClientInterface * listener, int reactorWakeup) {
     this->socket = socket;
-    this->app_port = config.port;
-    this->virtual_channel = config.channel;
-    this->options = config.options;
-    this->client_if = listener;
+    this->state = HANDSHAKE;
     this->connected = true;
+    this->output_blocked = false;
+    this->multiplexed = false;
+    this->next_message_id = 1;
+    this->client_if = listener;
+    this->in_offset = 0;
+    this->discard_remaining = 0;
+    this->out_offset = 0;
+    this->shared = NULL;
+    this->retry_requested = false;
+    this->reactor_wakeup = reactorWakeup;
     pthread_mutex_init(&client_mutex, NULL);
-    pthread_create(&client_thread, NULL, staticClientRoutine, this);
-    //Notify listener that Client is now connected
-    client_if->onConnected(this);
 }
 
-bool Client::isConnected() {
+Client::~Client() {
     pthread_mutex_lock(&client_mutex);
-    bool result = connected;
+    close(socket);
+    LOG_DEBUG(std::string("Closed socket " + std::to_string(socket)));
+    delete shared;
+    closeDescriptors();
     pthread_mutex_unlock(&client_mutex);
-    return result;
+    pthread_mutex_destroy(&client_mutex);
+    for (auto const &it : ports) {
+        delete it.second;
+    }
 }
 
-uint8_t Client::getAppPort() {
-    return app_port;
+SOCKET Client::getSocket() {
+    return socket;
 }
 
-uint8_t Client::getVirtualChannel() {
-    return virtual_channel;
+/**
+ * Descriptor signalled by the application when using shared memory, or -1.
+ */
+int Client::getDoorbell() {
+    return (shared != NULL) ? shared->getDaemonDoorbell() : -1;
 }
 
-uint8_t Client::getOptions() {
-    return options;
+bool Client::isConnected() {
+    pthread_mutex_lock(&client_mutex);
+    bool result = connected && state == CONNECTED;
+    pthread_mutex_unlock(&client_mutex);
+    return result;
+}
+
+bool Client::isHandshakeComplete() {
+    pthread_mutex_lock(&client_mutex);
+    bool result = state != HANDSHAKE;
+    pthread_mutex_unlock(&client_mutex);
+    return result;
 }
 
 /**
- * During communication, a socket error was encountered.
- * We forcefully close the socket, then notify listeners that the connection was closed.
+ * Whether the application has too much data waiting to be read, and should not receive further messages for now.
+ * The listener is notified via onOutputAvailable once the application caught up.
  */
-void Client::closeConnection() {
+bool Client::isOutputBlocked() {
     pthread_mutex_lock(&client_mutex);
-    if (connected) {
-        shutdown(socket, SHUT_RDWR);
-        close(socket);
-
-        LOG_DEBUG(std::string("Closed socket " + std::to_string(socket)));
-    }
-    connected = false;
+    bool result = output_blocked;
     pthread_mutex_unlock(&client_mutex);
-    //Notifying s3tp that a port is available again
-    if (client_if != NULL) {
-        client_if->onDisconnected(this);
-    }
+    return result;
 }
 
 /**
- * During communication, socket was closed from other side.
- * We simply perform the necessary operations, then notify listeners that the connection was closed.
+ * Shuts the connection down. Can be called from any thread:
+ * the reactor notices the shutdown, then closes and destroys the client.
  */
-void Client::handleConnectionClosed() {
+void Client::kill() {
     pthread_mutex_lock(&client_mutex);
     if (connected) {
-        close(socket);
-
-        LOG_DEBUG(std::string("Closed socket " + std::to_string(socket)));
+        shutdown(socket, SHUT_RDWR);
+        connected = false;
     }
-    connected = false;
     pthread_mutex_unlock(&client_mutex);
-    //Notifying s3tp that a port is available again
-    if (client_if != NULL) {
-        client_if->onDisconnected(this);
-    }
 }
 
-void Client::kill() {
-    if (!isConnected()) {
-        //Just waiting for thread to finish (if not finished already)
-        pthread_join(client_thread, NULL);
-        return;
+/**
+ * Tells the reactor that the listener may take held back messages of some port now (see ClientPort::requestRetry).
+ */
+void Client::requestRetry() {
+    if (!retry_requested.exchange(true) && reactor_wakeup >= 0) {
+        SharedMemoryChannel::ringDoorbell(reactor_wakeup);
     }
-    //Kill thread and wait for it to finish
-    closeConnection();
-    pthread_join(client_thread, NULL);
 }
 
-int Client::send(const void * data, size_t len) {
-    ssize_t wr;
-    AppMessageType type = APP_DATA_MESSAGE;
+/**
+ * Sends data received on one of the ports of the application.
+ * Chunks of messages on streaming ports are sent as stream messages, followed by their marker.
+ * Never blocks: data that cannot be written right away is queued.
+ */
+int Client::send(uint8_t port, const void * data, size_t len, S3tpStreamMarker marker) {
+    AppMessageType type = (marker == STREAM_COMPLETE) ? APP_DATA_MESSAGE : APP_STREAM_MESSAGE;
+    uint8_t markerCode = encodeStreamMarker(marker);
 
-    //Sending message type first
-    wr = write(socket, &type, sizeof(type));
-    if (wr == CODE_ERROR_SOCKET_NO_CONN) {
-        LOG_WARN(std::string("Connection was closed by s3tp client " + std::to_string(socket)));
-        handleConnectionClosed();
-        return CODE_ERROR_SOCKET_NO_CONN;
-    } else if (wr < 0) {
-        LOG_WARN(std::string("Error while writing on socket " + std::to_string(socket)));
-        closeConnection();
-        return CODE_ERROR_SOCKET_WRITE;
-    }
-    //Sending length of message
-    int error = write_length_safe(socket, len);
-    if (error == CODE_ERROR_SOCKET_NO_CONN) {
-        LOG_WARN(std::string("Connection was closed by s3tp client " + std::to_string(socket)));
-        handleConnectionClosed();
-        return error;
-    } else if (error == CODE_ERROR_SOCKET_WRITE) {
-        LOG_WARN(std::string("Error while writing on socket " + std::to_string(socket)));
-        closeConnection();
-        return error;
-    }
-    //Sending message content
-    wr = write(socket, data, len);
-    if (wr == 0) {
-        LOG_WARN(std::string("Connection was closed by s3tp client " + std::to_string(socket)));
-        handleConnectionClosed();
+    pthread_mutex_lock(&client_mutex);
+    if (!connected || state != CONNECTED) {
+        pthread_mutex_unlock(&client_mutex);
         return CODE_ERROR_SOCKET_NO_CONN;
-    } else if (wr < 0) {
-        LOG_WARN(std::string("Error while writing data on socket " + std::to_string(socket)));
-        closeConnection();
-        return CODE_ERROR_SOCKET_WRITE;
     }
-    return CODE_SUCCESS;
+    int result;
+    if (shared != NULL) {
+        result = _sendShared(data, len, type, markerCode, port);
+    } else {
+        char header[FRAME_PORT_PREFIX_LENGTH + FRAME_HEADER_MAX_LENGTH];
+        size_t headerLength = encodePortPrefix(header, port);
+        headerLength += encode_frame_header(header + headerLength, type,
+                                            (type == APP_STREAM_MESSAGE) ? &markerCode : NULL, len);
+        result = _sendFrame(header, headerLength, data, len);
+    }
+    if (result == CODE_SUCCESS && !output_blocked
+        && (_getPendingOutput() > CLIENT_OUTPUT_HIGH_WATERMARK || !ring_backlog.empty())) {
+        LOG_DEBUG(std::string("Application on socket " + std::to_string(socket) + " is not keeping up"));
+        output_blocked = true;
+    }
+    pthread_mutex_unlock(&client_mutex);
+    return result;
 }
 
-int Client::sendControlMessage(S3TP_CONTROL message) {
-    ssize_t wr;
-    AppMessageType msgType = APP_CONTROL_MESSAGE;
+int Client::sendControlMessage(uint8_t port, S3TP_CONTROL message) {
+    char header[FRAME_PORT_PREFIX_LENGTH + sizeof(AppMessageType)];
+    size_t headerLength = encodePortPrefix(header, port);
 
-    //Sending message type first
-    wr = write(socket, &msgType, sizeof(msgType));
-    if (wr == CODE_ERROR_SOCKET_NO_CONN) {
-        LOG_WARN(std::string("Connection was closed by s3tp client " + std::to_string(socket)));
-        handleConnectionClosed();
-        return CODE_ERROR_SOCKET_NO_CONN;
-    } else if (wr < 0) {
-        LOG_WARN(std::string("Error while writing on socket " + std::to_string(socket)));
-        closeConnection();
-        return CODE_ERROR_SOCKET_WRITE;
-    }
-
-    //Sending control message
-    wr = write(socket, &message, sizeof(S3TP_CONTROL));
-    if (wr == 0) {
-        LOG_WARN(std::string("Connection was closed by s3tp client " + std::to_string(socket)));
-        handleConnectionClosed();
+    header[headerLength++] = (char)APP_CONTROL_MESSAGE;
+    pthread_mutex_lock(&client_mutex);
+    if (!connected || state != CONNECTED) {
+        pthread_mutex_unlock(&client_mutex);
         return CODE_ERROR_SOCKET_NO_CONN;
-    } else if (wr < 0) {
-        LOG_WARN(std::string("Error while writing data on socket " + std::to_string(socket)));
-        closeConnection();
-        return CODE_ERROR_SOCKET_WRITE;
     }
-    return CODE_SUCCESS;
+    int result = _sendFrame(header, headerLength, &message, sizeof(S3TP_CONTROL));
+    pthread_mutex_unlock(&client_mutex);
+    return result;
 }
 
-void Client::clientRoutine() {
-    ssize_t i = 0, rd = 0;
-    size_t len = 0;
-    int error = 0;
-    AppMessageType type;
-    S3TP_CONTROL control;
+/**
+ * Reads everything available on the socket and handles all complete requests.
+ * @return  False if the connection has to be closed.
+ */
+bool Client::handleReadable() {
+    char chunk[CLIENT_READ_CHUNK];
+    char control[CMSG_SPACE(SHM_DESCRIPTOR_COUNT * sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
 
-    LOG_DEBUG(std::string("Started client thread for socket " + std::to_string(socket)));
-    while (isConnected()) {
-        //Checking message type first
-        rd = read(socket, &type, sizeof(type));
-        if (rd <= 0) {
+    while (true) {
+        //Descriptors may come along with the configuration, if the application offers shared memory
+        iov.iov_base = chunk;
+        iov.iov_len = sizeof(chunk);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t rd = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+        if (rd > 0) {
+            receiveDescriptors(&msg);
+            in_buffer.insert(in_buffer.end(), chunk, chunk + rd);
+            //Handling requests right away, so that at most one request is buffered at a time
+            if (!parseInput()) {
+                return false;
+            }
+            continue;
+        } else if (rd == 0) {
             LOG_INFO(std::string("Client closed socket " + std::to_string(socket)));
-            handleConnectionClosed();
+            return false;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
             break;
         }
-        //TODO: handle logic for reading control messages, maybe not needed
-        error = read_length_safe(socket, &len);
-        if (error == CODE_ERROR_SOCKET_NO_CONN) {
-            LOG_INFO(std::string("Client closed socket " + std::to_string(socket)));
-            handleConnectionClosed();
-            break;
-        } else if (error < 0) {
-            LOG_WARN(std::string("Error while reading from client on socket " + std::to_string(socket)));
-            closeConnection();
+        LOG_WARN(std::string("Error while reading from client on socket " + std::to_string(socket)));
+        return false;
+    }
+    //Credit of everything read at once is returned in a single message
+    flushCredit();
+
+    pthread_mutex_lock(&client_mutex);
+    bool result = connected && (state != CLOSING || _getPendingOutput() > 0);
+    pthread_mutex_unlock(&client_mutex);
+    return result;
+}
+
+/**
+ * Writes queued data, as far as the socket allows.
+ * @return  False if the connection has to be closed.
+ */
+bool Client::handleWritable() {
+    bool notify = false;
+
+    pthread_mutex_lock(&client_mutex);
+    int result = _flush();
+    if (output_blocked && _isOutputAvailable()) {
+        output_blocked = false;
+        notify = true;
+    }
+    bool keep = result == CODE_SUCCESS && connected && (state != CLOSING || _getPendingOutput() > 0);
+    pthread_mutex_unlock(&client_mutex);
+
+    //Notifying outside of the critical section, as the listener may send more data
+    if (notify) {
+        notifyOutputAvailable();
+    }
+    return keep;
+}
+
+/**
+ * The application committed messages to the upstream ring, or freed space in the downstream ring.
+ * @return  False if the connection has to be closed.
+ */
+bool Client::handleDoorbell() {
+    SHM_RECORD record;
+    SharedRing * upstream = shared->getUpstream();
+    bool notify = false;
+
+    SharedMemoryChannel::clearDoorbell(shared->getDaemonDoorbell());
+    while (state == CONNECTED) {
+        //Messages are fragmented straight out of the ring
+        char * payload = upstream->front(&record);
+        if (payload != NULL) {
+            if (safeMessageTypeInterpretation(record.type) == APP_DATA_MESSAGE) {
+                handleApplicationMessage(record.port, payload, record.length, record.priority);
+            } else {
+                LOG_WARN(std::string("Unknown record received from socket " + std::to_string(socket)));
+            }
+            upstream->pop();
+        } else if (upstream->isCorrupt() || upstream->waitForData()) {
             break;
         }
+    }
+    flushCredit();
 
-        //Length of next message received
-        char * message = new char[len+1];
-        message[len] = 0;
+    pthread_mutex_lock(&client_mutex);
+    _flushBacklog();
+    if (output_blocked && _isOutputAvailable()) {
+        output_blocked = false;
+        notify = true;
+    }
+    bool keep = connected && !upstream->isCorrupt() && !shared->getDownstream()->isCorrupt();
+    pthread_mutex_unlock(&client_mutex);
 
-        char * currentPosition = message;
+    if (notify) {
+        notifyOutputAvailable();
+    }
+    if (!keep) {
+        LOG_WARN(std::string("Shared memory of socket " + std::to_string(socket) + " is corrupt"));
+    }
+    return keep;
+}
 
-        //Read payload
-        rd = 0;
-        do {
-            i = read(socket, currentPosition, (len - rd));
-            if (i == 0) {
-                //EOF read
-                LOG_WARN(std::string("Client closed socket " + std::to_string(socket)));
-                closeConnection();
-                delete [] message;
-                //Quitting thread
+/**
+ * Lets the ports which were told that the listener can take more submit their held back messages again.
+ */
+void Client::handleRetries() {
+    if (!retry_requested.exchange(false)) {
+        return;
+    }
+    for (auto const &it : ports) {
+        it.second->handleRetries();
+    }
+}
+
+/**
+ * Tells the listener that all ports of the connection are gone. Called by the reactor before destroying the client.
+ */
+void Client::closePorts() {
+    for (auto const &it : ports) {
+        client_if->onDisconnected(it.second);
+    }
+}
+
+/**
+ * Handles all complete requests in the input buffer. Incomplete ones stay buffered until more data arrives.
+ * @return  False if the application violated the protocol, in which case the connection has to be closed.
+ */
+bool Client::parseInput() {
+    while (true) {
+        size_t available = in_buffer.size() - in_offset;
+        char * input = in_buffer.data() + in_offset;
+
+        if (discard_remaining > 0) {
+            //Skipping the payload of a refused message
+            size_t skipped = (available < discard_remaining) ? available : discard_remaining;
+            in_offset += skipped;
+            discard_remaining -= skipped;
+            if (discard_remaining > 0) {
                 break;
-            } else if (i < 0) {
-                LOG_WARN(std::string("Error while reading message from client on socket " + std::to_string(socket)));
-                closeConnection();
-                delete [] message;
-                //Quitting thread
+            }
+            continue;
+        }
+        if (state == HANDSHAKE) {
+            if (available < sizeof(S3TP_CONFIG) || !handleConfiguration()) {
                 break;
             }
-            rd += i;
-            currentPosition += i;
-        } while(rd < len);
+            continue;
+        } else if (state == CLOSING) {
+            //Connection was refused, nothing else is handled
+            in_offset = in_buffer.size();
+            break;
+        }
+        //Frames of multiplexed connections start with their port
+        size_t prefix = multiplexed ? FRAME_PORT_PREFIX_LENGTH : 0;
+        if (available < prefix + sizeof(AppMessageType)) {
+            break;
+        }
+        uint8_t port = (uint8_t)input[0];
+        input += prefix;
+        available -= prefix;
 
-        //Disconnected during payload transmission -> Exit while loop
-        if (!isConnected()) {
+        AppMessageType type = safeMessageTypeInterpretation((uint8_t)input[0]);
+        if (type == APP_CONTROL_MESSAGE) {
+            if (available < sizeof(AppMessageType) + sizeof(S3TP_CONTROL)) {
+                break;
+            }
+            S3TP_CONTROL control;
+            memcpy(&control, input + sizeof(AppMessageType), sizeof(S3TP_CONTROL));
+            in_offset += prefix + sizeof(AppMessageType) + sizeof(S3TP_CONTROL);
+            handleControlMessage(port, control);
+            continue;
+        } else if (type != APP_DATA_MESSAGE) {
+            LOG_WARN(std::string("Corrupt frame type received from client on socket " + std::to_string(socket)));
+            return false;
+        }
+
+        //Data message: type, priority, length and payload
+        uint8_t priorityCode;
+        size_t len;
+        int headerLength = decode_frame_header(input, available, true, &priorityCode, &len);
+        if (headerLength == 0) {
+            break;
+        } else if (headerLength < 0) {
+            LOG_WARN(std::string("Corrupt length received from client on socket " + std::to_string(socket)));
+            return false;
+        }
+        if (len > CLIENT_MAX_MESSAGE_LENGTH) {
+            LOG_INFO(std::string("Refused message of " + std::to_string(len) + " bytes from socket "
+                                 + std::to_string(socket)));
+            in_offset += prefix + headerLength;
+            discard_remaining = len;
+            uint32_t messageId = assignMessageId();
+            ClientPort * cliPort = getPort(port);
+            if (cliPort != NULL) {
+                cliPort->dropMessage(messageId, len, CODE_ERROR_INVALID_LENGTH);
+            }
+            continue;
+        }
+        if (available < headerLength + len) {
             break;
         }
+        in_offset += prefix + headerLength + len;
+        handleApplicationMessage(port, input + headerLength, len, priorityCode);
+    }
+
+    //Dropping the requests that were handled
+    if (in_offset == in_buffer.size()) {
+        in_buffer.clear();
+        in_offset = 0;
+    } else if (in_offset > 0) {
+        in_buffer.erase(in_buffer.begin(), in_buffer.begin() + in_offset);
+        in_offset = 0;
+    }
+    return true;
+}
+
+void Client::receiveDescriptors(struct msghdr * msg) {
+    for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            received_descriptors.push_back(fd);
+        }
+    }
+}
+
+void Client::closeDescriptors() {
+    for (int fd : received_descriptors) {
+        close(fd);
+    }
+    received_descriptors.clear();
+}
+
+/**
+ * Maps the shared memory offered by the application along with its configuration.
+ * @return  False if the application didn't pass usable descriptors, in which case the socket is used instead.
+ */
+bool Client::attachSharedMemory() {
+    if (received_descriptors.size() != SHM_DESCRIPTOR_COUNT) {
+        LOG_WARN(std::string("Application on socket " + std::to_string(socket)
+                             + " requested shared memory without passing it"));
+        closeDescriptors();
+        return false;
+    }
+    SharedMemoryChannel * channel = new SharedMemoryChannel();
+    //Channel owns the descriptors from now on
+    int result = channel->attach(received_descriptors[0], received_descriptors[1], received_descriptors[2]);
+    received_descriptors.clear();
+    if (result != CODE_SUCCESS) {
+        delete channel;
+        return false;
+    }
+    shared = channel;
+    return true;
+}
+
+/**
+ * Reads the configuration sent by a new application and asks the listener whether its port is accepted.
+ * @return  True if the configuration was consumed.
+ */
+bool Client::handleConfiguration() {
+    S3TP_CONFIG config;
+    int commCode = CODE_SERVER_ACCEPT;
+
+    memcpy(&config, in_buffer.data() + in_offset, sizeof(S3TP_CONFIG));
+    in_offset += sizeof(S3TP_CONFIG);
+    multiplexed = (config.options & S3TP_OPTION_MULTIPLEX) != 0;
+    if ((config.options & S3TP_OPTION_SHARED_MEMORY) && !attachSharedMemory()) {
+        commCode = CODE_SERVER_ACCEPT_NO_SHARED_MEMORY;
+    }
+    closeDescriptors();
+    LOG_DEBUG(std::string("Received configuration from new client on socket "
+                          + std::to_string(socket)
+                          + ": port " + std::to_string((int)config.port)
+                          + ", channel: " + std::to_string((int)config.channel)
+                          + (multiplexed ? ", multiplexed" : "")));
+
+    //Answer and initial credit are queued before the listener can send anything else to the application
+    ClientPort * cliPort = new ClientPort(this, client_if, config);
+    S3TP_CONTROL credit = getInitialCredit();
+    AppMessageType msgType = APP_CONTROL_MESSAGE;
+    pthread_mutex_lock(&client_mutex);
+    size_t answerOffset = out_buffer.size();
+    _queue(&commCode, sizeof(commCode));
+    _queue(&msgType, sizeof(msgType));
+    _queue(&credit, sizeof(credit));
+    state = CONNECTED;
+    pthread_mutex_unlock(&client_mutex);
+
+    int result = (client_if != NULL) ? client_if->onConnected(cliPort) : CODE_SERVER_INTERNAL_ERROR;
 
-        //Payload received entirely
-        LOG_DEBUG(std::string("Received "
-                              + std::to_string(len)
-                              + " bytes from port "
-                              + std::to_string((int)app_port)
-                              + ": <" + message + ">"));
-        if (client_if == NULL) {
-            LOG_WARN(std::string("Client interface is not connected. Aborting client "
-                                 + std::to_string(socket) + " routine"));
-            closeConnection();
+    pthread_mutex_lock(&client_mutex);
+    if (result != CODE_SERVER_ACCEPT) {
+        commCode = result;
+        //Port was not registered by the listener, so nothing else was queued in the meantime
+        memcpy(out_buffer.data() + answerOffset, &commCode, sizeof(commCode));
+        out_buffer.resize(answerOffset + sizeof(commCode));
+        state = CLOSING;
+        LOG_INFO(std::string("Refused client " + std::to_string(socket)
+                             + " on port " + std::to_string((int)config.port) + ": " + std::to_string(commCode)));
+    }
+    _flush();
+    pthread_mutex_unlock(&client_mutex);
+
+    if (result == CODE_SERVER_ACCEPT) {
+        ports[config.port] = cliPort;
+    } else {
+        delete cliPort;
+    }
+    return true;
+}
+
+/**
+ * Registers one more port on a multiplexed connection, and answers with the result.
+ * The listener may deliver messages to the port as soon as it accepted it, so these can reach the application
+ * before the answer. Credit is only granted after the answer.
+ */
+void Client::openPort(uint8_t port, const S3TP_CONTROL& request) {
+    S3TP_CONFIG config;
+    S3TP_CONTROL answer;
+    ClientPort * cliPort = NULL;
+    int result = CODE_SERVER_PORT_BUSY;
+
+    config.port = port;
+    config.channel = (uint8_t)request.messageId;
+    config.options = (uint8_t)request.length;
+    if (ports.find(port) == ports.end()) {
+        cliPort = new ClientPort(this, client_if, config);
+        result = client_if->onConnected(cliPort);
+    }
+    LOG_DEBUG(std::string("Request to open port " + std::to_string((int)port) + " on socket "
+                          + std::to_string(socket) + ": " + std::to_string(result)));
+    answer.controlMessageType = OPEN;
+    answer.error = (S3tpError)result;
+    answer.messageId = request.messageId;
+    answer.length = request.length;
+    sendControlMessage(port, answer);
+    if (result != CODE_SERVER_ACCEPT) {
+        delete cliPort;
+        return;
+    }
+    ports[port] = cliPort;
+    sendControlMessage(port, getInitialCredit());
+}
+
+/**
+ * Handles a control message sent by the application.
+ */
+void Client::handleControlMessage(uint8_t port, S3TP_CONTROL& control) {
+    AppControlMessageType type = safeMessageTypeInterpretation(control.controlMessageType);
+    ClientPort * cliPort = getPort(port);
+
+    if (type == OPEN && multiplexed) {
+        openPort(port, control);
+    } else if (type == CANCEL && cliPort != NULL) {
+        cliPort->handleCancel(control);
+    } else {
+        LOG_WARN(std::string("Unknown control message received from socket " + std::to_string(socket)));
+    }
+}
+
+void Client::handleApplicationMessage(uint8_t port, char * data, size_t len, uint8_t priorityCode) {
+    //Every message consumes an id, so that the application counts the same way
+    uint32_t messageId = assignMessageId();
+    ClientPort * cliPort = getPort(port);
+
+    if (cliPort == NULL) {
+        LOG_WARN(std::string("Application on socket " + std::to_string(socket) + " sent a message to port "
+                             + std::to_string((int)port) + ", which it didn't register"));
+        return;
+    }
+    cliPort->handleApplicationMessage(data, len, priorityCode, messageId);
+}
+
+/**
+ * Port a frame belongs to. Frames of connections which are not multiplexed always belong to their only port.
+ */
+ClientPort * Client::getPort(uint8_t port) {
+    if (!multiplexed) {
+        return ports.empty() ? NULL : ports.begin()->second;
+    }
+    std::map<uint8_t, ClientPort *>::iterator it = ports.find(port);
+    return (it != ports.end()) ? it->second : NULL;
+}
+
+/**
+ * Every message sent by the application consumes an id, so that both sides count the same way.
+ */
+uint32_t Client::assignMessageId() {
+    uint32_t messageId = next_message_id;
+    //Id 0 is reserved for addressing all messages of a port
+    if (++next_message_id == S3TP_MESSAGE_ID_ALL) {
+        next_message_id++;
+    }
+    return messageId;
+}
+
+/**
+ * Sends the credit of everything handled so far, on all ports.
+ */
+void Client::flushCredit() {
+    for (auto const &it : ports) {
+        it.second->flushCredit();
+    }
+}
+
+void Client::notifyOutputAvailable() {
+    for (auto const &it : ports) {
+        client_if->onOutputAvailable(it.second);
+    }
+}
+
+/**
+ * Writes the port a frame belongs to at the beginning of its header, on multiplexed connections.
+ * @return  The length of the prefix.
+ */
+size_t Client::encodePortPrefix(char * header, uint8_t port) {
+    if (!multiplexed) {
+        return 0;
+    }
+    header[0] = (char)port;
+    return FRAME_PORT_PREFIX_LENGTH;
+}
+
+S3TP_CONTROL Client::getInitialCredit() {
+    S3TP_CONTROL credit;
+    credit.controlMessageType = CREDIT;
+    credit.error = 0;
+    credit.messageId = CLIENT_CREDIT_MESSAGES;
+    credit.length = CLIENT_CREDIT_BYTES;
+    return credit;
+}
+
+/*
+ * Internal methods
+ */
+int Client::_queue(const void * data, size_t len) {
+    const char * bytes = (const char *)data;
+    out_buffer.insert(out_buffer.end(), bytes, bytes + len);
+    return CODE_SUCCESS;
+}
+
+/**
+ * Writes as much queued data as the socket accepts without blocking.
+ * Whatever remains is written by the reactor, once the socket becomes writable again.
+ */
+int Client::_flush() {
+    while (out_offset < out_buffer.size()) {
+        ssize_t wr = ::send(socket, out_buffer.data() + out_offset, out_buffer.size() - out_offset, MSG_NOSIGNAL);
+        if (wr > 0) {
+            out_offset += wr;
+            continue;
+        } else if (wr < 0 && errno == EINTR) {
+            continue;
+        } else if (wr < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             break;
         }
-        //Forward data to s3tp module (through Client interface callback)
-        int result = client_if->onApplicationMessage(message, len, this);
-        //s3tp protocol copies contents of message, so we need to free this temp buffer
-        delete[] message;
-
-        if (result != CODE_SUCCESS) {
-            LOG_INFO(std::string("Cannot transmit message to port " + std::to_string((int)app_port)
-                                 + ". Error code: " + std::to_string(result)));
-            control.controlMessageType = NACK;
-            control.error = (S3tpError) result;
-        } else {
-            LOG_DEBUG(std::string("Sending ack to port " + std::to_string((int)app_port)));
-            control.controlMessageType = ACK;
-            control.error = 0;
+        return _abortOutput();
+    }
+    if (out_offset == out_buffer.size()) {
+        out_buffer.clear();
+        out_offset = 0;
+    } else if (out_offset >= CLIENT_OUTPUT_LOW_WATERMARK) {
+        out_buffer.erase(out_buffer.begin(), out_buffer.begin() + out_offset);
+        out_offset = 0;
+    }
+    return CODE_SUCCESS;
+}
+
+/**
+ * Writes a frame straight from the buffers of the caller, with a single system call, if nothing is queued before it.
+ * Whatever the socket doesn't take (all of it, if output is pending) is queued and written by the reactor later on.
+ */
+int Client::_sendFrame(const void * header, size_t headerLength, const void * payload, size_t len) {
+    size_t written = 0;
+
+    if (out_offset == out_buffer.size()) {
+        ssize_t wr;
+        do {
+            wr = send_frame(socket, header, headerLength, payload, len, 0);
+        } while (wr < 0 && errno == EINTR);
+        if (wr < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return _abortOutput();
+        }
+        written = (wr > 0) ? (size_t)wr : 0;
+    }
+    if (written < headerLength) {
+        _queue((const char *)header + written, headerLength - written);
+        written = headerLength;
+    }
+    if (written - headerLength < len) {
+        _queue((const char *)payload + (written - headerLength), len - (written - headerLength));
+    }
+    return CODE_SUCCESS;
+}
+
+/**
+ * Gives up on the output after a write error. The reactor notices the shutdown and closes the connection.
+ */
+int Client::_abortOutput() {
+    LOG_WARN(std::string("Error while writing on socket " + std::to_string(socket)));
+    if (connected) {
+        shutdown(socket, SHUT_RDWR);
+        connected = false;
+    }
+    out_buffer.clear();
+    out_offset = 0;
+    return CODE_ERROR_SOCKET_WRITE;
+}
+
+/**
+ * Writes a message into the downstream ring. If the application is not keeping up and the ring is full,
+ * the message waits in the backlog, which is written once the application frees some space.
+ */
+int Client::_sendShared(const void * data, size_t len, AppMessageType type, uint8_t markerCode, uint8_t port) {
+    SharedRing * downstream = shared->getDownstream();
+    SHM_RECORD record;
+
+    if (!SharedRing::fits(len)) {
+        LOG_WARN(std::string("Message of " + std::to_string(len) + " bytes doesn't fit into shared memory"));
+        return CODE_ERROR_INVALID_LENGTH;
+    }
+    if (ring_backlog.empty()) {
+        char * payload = downstream->reserve(len);
+        if (payload != NULL) {
+            memcpy(payload, data, len);
+            downstream->commit(type, 0, markerCode, port);
+            return CODE_SUCCESS;
+        } else if (downstream->isCorrupt()) {
+            if (connected) {
+                shutdown(socket, SHUT_RDWR);
+                connected = false;
+            }
+            return CODE_ERROR_SHARED_MEMORY;
         }
-        sendControlMessage(control);
+    }
+    record.length = (uint32_t)len;
+    record.type = type;
+    record.priority = 0;
+    record.marker = markerCode;
+    record.port = port;
+    ring_backlog.insert(ring_backlog.end(), (char *)&record, (char *)&record + sizeof(record));
+    ring_backlog.insert(ring_backlog.end(), (const char *)data, (const char *)data + len);
+    //Application rings the daemon doorbell once it freed some space
+    if (!downstream->waitForSpace(len)) {
+        _flushBacklog();
+    }
+    return CODE_SUCCESS;
+}
 
-        if (result < 0) {
-            LOG_ERROR(std::string("Error while communicating with s3tp module " + std::to_string(socket)));
-            //TODO: kill connection?!
+void Client::_flushBacklog() {
+    SharedRing * downstream = shared != NULL ? shared->getDownstream() : NULL;
+    SHM_RECORD record;
+    size_t offset = 0;
+
+    while (downstream != NULL && offset < ring_backlog.size()) {
+        memcpy(&record, ring_backlog.data() + offset, sizeof(SHM_RECORD));
+        char * payload = downstream->reserve(record.length);
+        if (payload == NULL) {
+            if (!downstream->isCorrupt() && !downstream->waitForSpace(record.length)) {
+                //Space was freed in the meantime
+                continue;
+            }
+            break;
         }
+        memcpy(payload, ring_backlog.data() + offset + sizeof(SHM_RECORD), record.length);
+        downstream->commit(record.type, record.priority, record.marker, record.port);
+        offset += sizeof(SHM_RECORD) + record.length;
     }
+    ring_backlog.erase(ring_backlog.begin(), ring_backlog.begin() + offset);
+}
 
-    pthread_exit(NULL);
+size_t Client::_getPendingOutput() {
+    return out_buffer.size() - out_offset + ring_backlog.size();
 }
 
-void * Client::staticClientRoutine(void * args) {
-    static_cast<Client *>(args)->clientRoutine();
-    return NULL;
-}
\ No newline at end of file
+/**
+ * Whether a blocked application caught up enough to receive messages again.
+ */
+bool Client::_isOutputAvailable() {
+    return ring_backlog.empty() && _getPendingOutput() <= CLIENT_OUTPUT_LOW_WATERMARK;
+}
@@ -9,36 +9,118 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <cstring>
 #include <sys/socket.h>
 #include <s3tp/core/S3tpShared.h>
 #include "S3tpShared.h"
 #include "ClientInterface.h"
+#include "SharedRing.h"
+#include "ClientPort.h"
+#include <atomic>
+#include <map>
+#include <vector>
 
+//Bytes read from the socket at once
+#define CLIENT_READ_CHUNK 4096
+//Longest message accepted from an application. Longer messages are refused without being buffered
+#define CLIENT_MAX_MESSAGE_LENGTH (1024 * 1024)
+//Bytes waiting to be written to the application, above which it is considered too slow to receive more messages
+#define CLIENT_OUTPUT_HIGH_WATERMARK (64 * 1024)
+//Bytes waiting to be written to the application, below which it can receive messages again
+#define CLIENT_OUTPUT_LOW_WATERMARK (16 * 1024)
+
+/**
+ * Connection to an application, driven by the Reactor.
+ *
+ * The socket is non-blocking. Incoming bytes are accumulated until a whole request (configuration,
+ * data message or control message) is available, so that a slow writer never blocks the reactor.
+ * Outgoing data can be sent from any thread: whatever does not fit into the socket is queued,
+ * and written by the reactor once the socket becomes writable again.
+ *
+ * Applications may offer shared memory during the handshake. Messages are then exchanged through its rings,
+ * and the socket only carries control messages. The reactor watches the daemon doorbell of such clients.
+ *
+ * The configuration sent during the handshake registers the first port of the connection (see ClientPort).
+ * With S3TP_OPTION_MULTIPLEX, the application may register more ports with OPEN requests, and every frame
+ * exchanged after the handshake starts with the port it belongs to (shared memory records carry it as well).
+ * Message ids are counted per connection, in the order in which the daemon reads the messages of all ports,
+ * so that they stay unique across the ports of a connection.
+ */
 class Client {
 private:
-    pthread_t client_thread;
+    enum STATE {
+        HANDSHAKE,
+        CONNECTED,
+        CLOSING
+    };
+
     pthread_mutex_t client_mutex;
     SOCKET socket;
+    STATE state;
     bool connected;
-    uint8_t app_port;
-    uint8_t virtual_channel;
-    uint8_t options;
+    bool output_blocked;
+    bool multiplexed;
+    uint32_t next_message_id;
     ClientInterface * client_if;
+    //Input is only touched by the reactor thread
+    std::vector<char> in_buffer;
+    size_t in_offset;
+    size_t discard_remaining;
+    std::vector<int> received_descriptors;
+    //Output is protected by the client mutex
+    std::vector<char> out_buffer;
+    size_t out_offset;
+    SharedMemoryChannel * shared;
+    //Records waiting for space in the downstream ring
+    std::vector<char> ring_backlog;
+    //Ports registered by the application, only touched by the reactor thread
+    std::map<uint8_t, ClientPort *> ports;
+    std::atomic<bool> retry_requested;
+    int reactor_wakeup;
 
-    bool isConnected();
-    void closeConnection();
-    void handleConnectionClosed();
+    bool parseInput();
+    void receiveDescriptors(struct msghdr * msg);
+    void closeDescriptors();
+    bool attachSharedMemory();
+    bool handleConfiguration();
+    void handleControlMessage(uint8_t port, S3TP_CONTROL& control);
+    void handleApplicationMessage(uint8_t port, char * data, size_t len, uint8_t priorityCode);
+    void openPort(uint8_t port, const S3TP_CONTROL& request);
+    ClientPort * getPort(uint8_t port);
+    uint32_t assignMessageId();
+    void flushCredit();
+    void notifyOutputAvailable();
+    size_t encodePortPrefix(char * header, uint8_t port);
+    static S3TP_CONTROL getInitialCredit();
 
-    void clientRoutine();
-    static void * staticClientRoutine(void * args);
+    //Internal methods (do not use locking)
+    int _queue(const void * data, size_t len);
+    int _flush();
+    int _sendFrame(const void * header, size_t headerLength, const void * payload, size_t len);
+    int _abortOutput();
+    int _sendShared(const void * data, size_t len, AppMessageType type, uint8_t markerCode, uint8_t port);
+    void _flushBacklog();
+    size_t _getPendingOutput();
+    bool _isOutputAvailable();
 public:
-    Client(SOCKET socket, S3TP_CONFIG config, ClientInterface * listener);
-    uint8_t getAppPort();
-    uint8_t getVirtualChannel();
-    uint8_t getOptions();
-    int send(const void * data, size_t len);
-    int sendControlMessage(S3TP_CONTROL message);
+    Client(SOCKET socket, ClientInterface * listener, int reactorWakeup = -1);
+    ~Client();
+    SOCKET getSocket();
+    int getDoorbell();
+    int send(uint8_t port, const void * data, size_t len, S3tpStreamMarker marker = STREAM_COMPLETE);
+    int sendControlMessage(uint8_t port, S3TP_CONTROL message);
+    bool isConnected();
+    bool isHandshakeComplete();
+    bool isOutputBlocked();
     void kill();
+    void requestRetry();
+    //Called by the reactor thread only
+    bool handleReadable();
+    bool handleWritable();
+    bool handleDoorbell();
+    void handleRetries();
+    void closePorts();
 };
 
 #endif //S3TP_S3TP_CLIENT_H
@@ -5,11 +5,16 @@
 #ifndef S3TP_CONNECTION_LISTENER_H
 #define S3TP_CONNECTION_LISTENER_H
 
+//Params always point to the ClientPort concerned. Applications may register several ports over one connection
 class ClientInterface {
 public:
     virtual void onDisconnected(void * params) = 0;
-    virtual void onConnected(void * params) = 0;
-    virtual int onApplicationMessage(void * data, size_t len, void * params) = 0;
+    //Returns CODE_SERVER_ACCEPT if the client was registered, or the reason why it was refused
+    virtual int onConnected(void * params) = 0;
+    virtual int onApplicationMessage(void * data, size_t len, uint8_t priority, uint32_t messageId, void * params) = 0;
+    virtual int onCancelRequest(uint32_t messageId, void * params) = 0;
+    //Output queued for a slow application was written, so that it can receive messages again
+    virtual void onOutputAvailable(void * params) = 0;
 };
 
 #endif //S3TP_CONNECTION_LISTENER_H
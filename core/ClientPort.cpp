@@ -0,0 +1,231 @@
+//
+// Created on 18/10/26.
+//
+
+#include "ClientPort.h"
+#include "Client.h"
+
+ClientPort::ClientPort(Client * client, ClientInterface * listener, S3TP_CONFIG config) {
+    this->client = client;
+    this->client_if = listener;
+    this->app_port = config.port;
+    this->virtual_channel = config.channel;
+    //Shared memory and multiplexing only concern the connection to the daemon
+    this->options = config.options & ~(S3TP_OPTION_SHARED_MEMORY | S3TP_OPTION_MULTIPLEX);
+    this->held_bytes = 0;
+    this->returned_bytes = 0;
+    this->returned_messages = 0;
+    this->retry_requested = false;
+}
+
+uint8_t ClientPort::getAppPort() {
+    return app_port;
+}
+
+uint8_t ClientPort::getVirtualChannel() {
+    return virtual_channel;
+}
+
+uint8_t ClientPort::getOptions() {
+    return options;
+}
+
+/**
+ * Sends received data to the application, over the connection of the port. Never blocks.
+ */
+int ClientPort::send(const void * data, size_t len, S3tpStreamMarker marker) {
+    return client->send(app_port, data, len, marker);
+}
+
+int ClientPort::sendControlMessage(S3TP_CONTROL message) {
+    return client->sendControlMessage(app_port, message);
+}
+
+bool ClientPort::isConnected() {
+    return client->isConnected();
+}
+
+/**
+ * Whether the application has too much data waiting to be read. Ports sharing a connection also share
+ * its output, so an application that stops reading holds back the messages of all of its ports.
+ */
+bool ClientPort::isOutputBlocked() {
+    return client->isOutputBlocked();
+}
+
+/**
+ * Shuts down the whole connection the port belongs to.
+ */
+void ClientPort::kill() {
+    client->kill();
+}
+
+/**
+ * Tells the reactor that the listener may take held back messages of this port now. Can be called from any thread,
+ * including from within the listener while it handles a message of this port.
+ */
+void ClientPort::requestRetry() {
+    if (!retry_requested.exchange(true)) {
+        client->requestRetry();
+    }
+}
+
+void ClientPort::handleApplicationMessage(char * data, size_t len, uint8_t priorityCode, uint32_t messageId) {
+    LOG_DEBUG(std::string("Received " + std::to_string(len) + " bytes from port " + std::to_string((int)app_port)));
+    if (held_messages.empty()) {
+        if (submitMessage(data, len, priorityCode, messageId) != CODE_SERVER_QUEUE_FULL) {
+            return;
+        }
+    } else if (held_bytes + len > CLIENT_CREDIT_BYTES) {
+        //Application ignored its credit
+        LOG_WARN(std::string("Application on port " + std::to_string((int)app_port) + " exceeded its credit"));
+        dropMessage(messageId, len, CODE_SERVER_QUEUE_FULL);
+        return;
+    }
+    //Later messages wait behind held back ones, so that the order is preserved
+    HELD_MESSAGE held;
+    held.message_id = messageId;
+    held.priority = priorityCode;
+    held.length = len;
+    held.resolved = false;
+    held.data.assign(data, data + len);
+    held_messages.push_back(std::move(held));
+    held_bytes += len;
+}
+
+/**
+ * Answers a cancel request of the application.
+ */
+void ClientPort::handleCancel(S3TP_CONTROL& control) {
+    //Held back messages never reached the listener
+    int result = (int)cancelHeldMessages(control.messageId);
+    result += client_if->onCancelRequest(control.messageId, this);
+    LOG_DEBUG(std::string("Cancelled message " + std::to_string(control.messageId) + " on port "
+                          + std::to_string((int)app_port) + ": " + std::to_string(result) + " bytes reclaimed"));
+    control.controlMessageType = CANCEL;
+    control.error = 0;
+    control.length = (uint32_t)result;
+    sendControlMessage(control);
+    flushCredit();
+}
+
+/**
+ * Reports a message that is not forwarded to the listener. Its credit is returned
+ * after the one of the messages held back before it, so that credit always comes back in id order.
+ */
+void ClientPort::dropMessage(uint32_t messageId, size_t len, int error) {
+    sendResponse(NACK, error, messageId);
+    if (held_messages.empty()) {
+        returnCredit(len);
+        return;
+    }
+    HELD_MESSAGE held;
+    held.message_id = messageId;
+    held.priority = 0;
+    held.length = len;
+    held.resolved = true;
+    held_messages.push_back(std::move(held));
+}
+
+/**
+ * Submits held back messages again, in order, until the listener refuses one of them.
+ * Does nothing unless requestRetry was called since the last time.
+ */
+void ClientPort::handleRetries() {
+    if (!retry_requested.exchange(false)) {
+        return;
+    }
+    while (!held_messages.empty()) {
+        HELD_MESSAGE& held = held_messages.front();
+        if (held.resolved) {
+            returnCredit(held.length);
+        } else if (submitMessage(held.data.data(), held.length, held.priority, held.message_id)
+                   == CODE_SERVER_QUEUE_FULL) {
+            break;
+        } else {
+            held_bytes -= held.length;
+        }
+        held_messages.pop_front();
+    }
+    flushCredit();
+}
+
+/**
+ * Forwards a message to the listener, which copies the contents.
+ * Dropped messages are reported to the application. The credit of the message is returned, unless
+ * the listener cannot take it yet (CODE_SERVER_QUEUE_FULL), in which case the caller holds it back.
+ */
+int ClientPort::submitMessage(const char * data, size_t len, uint8_t priorityCode, uint32_t messageId) {
+    int result = client_if->onApplicationMessage((void *)data, len, safePriorityInterpretation(priorityCode),
+                                                 messageId, this);
+    if (result == CODE_SERVER_QUEUE_FULL) {
+        LOG_DEBUG(std::string("Holding back message " + std::to_string(messageId) + " of port "
+                              + std::to_string((int)app_port)));
+        return result;
+    } else if (result != CODE_SUCCESS) {
+        LOG_INFO(std::string("Cannot transmit message to port " + std::to_string((int)app_port)
+                             + ". Error code: " + std::to_string(result)));
+        sendResponse(NACK, result, messageId);
+    }
+    returnCredit(len);
+    return result;
+}
+
+/**
+ * Drops held back messages matching the id (or all of them).
+ * Their credit is returned once they reach the front of the queue, so that credit always comes back in id order.
+ * @return  The amount of payload bytes dropped.
+ */
+size_t ClientPort::cancelHeldMessages(uint32_t messageId) {
+    size_t reclaimed = 0;
+
+    for (HELD_MESSAGE& held : held_messages) {
+        if (held.resolved || (messageId != S3TP_MESSAGE_ID_ALL && held.message_id != messageId)) {
+            continue;
+        }
+        reclaimed += held.length;
+        held.resolved = true;
+        std::vector<char>().swap(held.data);
+    }
+    held_bytes -= reclaimed;
+    while (!held_messages.empty() && held_messages.front().resolved) {
+        returnCredit(held_messages.front().length);
+        held_messages.pop_front();
+    }
+    return reclaimed;
+}
+
+/**
+ * Accounts for a message the daemon is done with. Credit is sent in batches (see flushCredit),
+ * or right away once half of the window was used up, so that a busy sender never runs dry.
+ */
+void ClientPort::returnCredit(size_t len) {
+    returned_bytes += len;
+    returned_messages++;
+    if (returned_bytes >= CLIENT_CREDIT_BYTES / 2 || returned_messages >= CLIENT_CREDIT_MESSAGES / 2) {
+        flushCredit();
+    }
+}
+
+void ClientPort::flushCredit() {
+    if (returned_messages == 0) {
+        return;
+    }
+    S3TP_CONTROL control;
+    control.controlMessageType = CREDIT;
+    control.error = 0;
+    control.messageId = returned_messages;
+    control.length = (uint32_t)returned_bytes;
+    returned_bytes = 0;
+    returned_messages = 0;
+    sendControlMessage(control);
+}
+
+void ClientPort::sendResponse(AppControlMessageType type, int error, uint32_t messageId) {
+    S3TP_CONTROL control;
+    control.controlMessageType = type;
+    control.error = (S3tpError) error;
+    control.messageId = messageId;
+    control.length = 0;
+    sendControlMessage(control);
+}
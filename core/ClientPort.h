@@ -0,0 +1,83 @@
+//
+// Created on 18/10/26.
+//
+
+#ifndef S3TP_CLIENTPORT_H
+#define S3TP_CLIENTPORT_H
+
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "S3tpShared.h"
+#include "ClientInterface.h"
+
+//Window granted to an application on each of its ports: bytes and messages it may send before the daemon took them
+#define CLIENT_CREDIT_BYTES (256 * 1024)
+#define CLIENT_CREDIT_MESSAGES 256
+
+/**
+ * Message that the listener couldn't take yet (full output buffer, link or channel unavailable).
+ * It keeps its id and its credit until it is submitted again.
+ * Resolved messages (cancelled or dropped) have no data anymore, they only wait to return their credit in order.
+ */
+typedef struct tag_held_message {
+    uint32_t message_id;
+    uint8_t priority;
+    size_t length;
+    bool resolved;
+    std::vector<char> data;
+}HELD_MESSAGE;
+
+class Client;
+
+/**
+ * Port registered by an application over its connection to the daemon (see Client).
+ * This is what the listener is handed in all of its callbacks. A connection carries a single port,
+ * unless the application multiplexes several ports over it.
+ *
+ * Sending is credit based, with a separate window per port: applications send without waiting for a response,
+ * as long as the port has credit left. Credit of the messages taken is returned in batches,
+ * and only dropped messages are answered (with a NACK).
+ * Messages the listener cannot take yet are held back, without returning their credit, and submitted again
+ * once the reactor is told that the listener can take more (see requestRetry). Other ports of the same
+ * connection keep going meanwhile. Credit is returned in the order of the message ids,
+ * so that applications can tell which messages were handled.
+ */
+class ClientPort {
+private:
+    Client * client;
+    ClientInterface * client_if;
+    uint8_t app_port;
+    uint8_t virtual_channel;
+    uint8_t options;
+    //Credit and held back messages are only touched by the reactor thread
+    std::deque<HELD_MESSAGE> held_messages;
+    size_t held_bytes;
+    size_t returned_bytes;
+    uint32_t returned_messages;
+    std::atomic<bool> retry_requested;
+
+    int submitMessage(const char * data, size_t len, uint8_t priorityCode, uint32_t messageId);
+    size_t cancelHeldMessages(uint32_t messageId);
+    void returnCredit(size_t len);
+    void sendResponse(AppControlMessageType type, int error, uint32_t messageId);
+public:
+    ClientPort(Client * client, ClientInterface * listener, S3TP_CONFIG config);
+    uint8_t getAppPort();
+    uint8_t getVirtualChannel();
+    uint8_t getOptions();
+    int send(const void * data, size_t len, S3tpStreamMarker marker = STREAM_COMPLETE);
+    int sendControlMessage(S3TP_CONTROL message);
+    bool isConnected();
+    bool isOutputBlocked();
+    void kill();
+    void requestRetry();
+    //Called by the reactor thread only
+    void handleApplicationMessage(char * data, size_t len, uint8_t priorityCode, uint32_t messageId);
+    void handleCancel(S3TP_CONTROL& control);
+    void dropMessage(uint32_t messageId, size_t len, int error);
+    void handleRetries();
+    void flushCredit();
+};
+
+#endif //S3TP_CLIENTPORT_H
@@ -12,11 +12,22 @@
 #include "Constants.h"
 
 #define S3TP_MSG_DATA 0x00
+#define S3TP_MSG_ACK 0x01
 #define S3TP_MSG_SYNC 0x03
 
 #define S3TP_SYNC_INITIATOR 0x00
 #define S3TP_SYNC_ACK 0xFF
 
+#define S3TP_SYNC_FLAG_KEEPALIVE 0x01
+#define S3TP_SYNC_FLAG_ACK 0x02
+#define S3TP_SYNC_FLAG_WIDE_SEQ 0x04
+#define S3TP_SYNC_FLAG_RESYNC 0x08
+#define LEN_S3TP_SYNC_HDR 7
+
+//Frames may be longer than a packet, in order to carry acknowledgements for the opposite direction
+#define MAX_LEN_S3TP_FRAME MTU
+#define LEN_S3TP_ACK_HDR 3
+
 //Eigth channel should be reserved for now
 #define S3TP_VIRTUAL_CHANNELS 7
 
@@ -37,6 +48,9 @@ typedef uint8_t S3TP_MSG_TYPE;
  *
  * Additionally, the last 2 bits of PDU_LENGTH are reserved to the protocol,
  * whilte the last bit of PORT contains the fragmentation bit.
+ * The third to last bit of PDU_LENGTH marks packets using wide (16 bit) sequences.
+ * Such packets are followed by an S3TP_HEADER_EXT, holding the upper bytes of GLOB_SEQ and PORT_SEQ,
+ * which is part of the frame but not of the payload.
  */
 typedef struct tag_s3tp_header
 {
@@ -94,13 +108,21 @@ typedef struct tag_s3tp_header
 	}
 
     uint16_t getPduLength() {
-        return (uint16_t )(pdu_length & 0x3FFF);
+        return (uint16_t )(pdu_length & 0x1FFF);
     }
 
     void setPduLength(uint16_t pdu_len) {
-        pdu_length = (uint16_t)((pdu_length & 0x4000) | pdu_len);
+        pdu_length = (uint16_t)((pdu_length & 0xE000) | pdu_len);
     }
 
+	bool hasWideSequences() {
+		return (pdu_length & 0x2000) != 0;
+	}
+
+	void setWideSequences(bool wide) {
+		pdu_length = (uint16_t)(wide ? (pdu_length | 0x2000) : (pdu_length & ~0x2000));
+	}
+
 	S3TP_MSG_TYPE getMessageType() {
 		return (uint8_t)(pdu_length >> 14);
 	}
@@ -110,6 +132,14 @@ typedef struct tag_s3tp_header
 	}
 }S3TP_HEADER;
 
+/**
+ * Upper bytes of the sequences of a packet using wide sequences.
+ */
+typedef struct tag_s3tp_header_ext {
+	uint8_t global_seq_high;
+	uint8_t port_seq_high;
+}S3TP_HEADER_EXT;
+
 /**
  * Structure containing an S3TP packet, made up of an S3TP header and its payload.
  * The underlying buffer is given by a char array, in which the first sizeof(S3TP_HEADER) bytes are the header,
@@ -121,8 +151,19 @@ struct S3TP_PACKET{
 	char * packet;
 	uint8_t channel;  /* Logical Channel to be used on the SPI interface */
 	uint8_t options;
+	uint8_t priority; /* Priority class of the message within its port. Not transmitted */
+	uint64_t timestamp; /* Monotonic time (in ms) at which the packet was queued. Not transmitted */
+	uint32_t message_id; /* Id of the application message within its port. Not transmitted */
+	S3TP_HEADER_EXT ext; /* Upper sequence bytes. Only transmitted if the header has the wide sequences flag set */
 
 	S3TP_PACKET(const char * pdu, uint16_t pduLen) {
+		channel = 0;
+		options = 0;
+		priority = PRIORITY_NORMAL;
+		timestamp = 0;
+		message_id = 0;
+		ext.global_seq_high = 0;
+		ext.port_seq_high = 0;
 		packet = new char[sizeof(S3TP_HEADER) + (pduLen * sizeof(char))];
 		memcpy(getPayload(), pdu, pduLen);
 		S3TP_HEADER * header = getHeader();
@@ -130,7 +171,7 @@ struct S3TP_PACKET{
 	}
 
     ~S3TP_PACKET() {
-        delete packet;
+        delete[] packet;
     }
 
 	S3TP_PACKET(const char * packet, int len, uint8_t channel) {
@@ -138,6 +179,12 @@ struct S3TP_PACKET{
 		this->packet = new char[len * sizeof(char)];
 		memcpy(this->packet, packet, (size_t)len);
 		this->channel = channel;
+		this->options = 0;
+		this->priority = PRIORITY_NORMAL;
+		this->timestamp = 0;
+		this->message_id = 0;
+		this->ext.global_seq_high = 0;
+		this->ext.port_seq_high = 0;
 	}
 
 	int getLength() {
@@ -151,15 +198,80 @@ struct S3TP_PACKET{
 	S3TP_HEADER * getHeader() {
 		return (S3TP_HEADER *)packet;
 	}
+
+	uint16_t getGlobalSequence() {
+		return (uint16_t)((ext.global_seq_high << 8) | getHeader()->getGlobalSequence());
+	}
+
+	uint16_t getPortSequence() {
+		return (uint16_t)((ext.port_seq_high << 8) | getHeader()->seq_port);
+	}
 };
 
+struct S3TP_SYNC_ENTRY {
+	uint8_t port;
+	uint16_t seq;
+};
+
+/**
+ * Structure containing a synchronization message.
+ * Only the first entry_count entries are actually transmitted, so the length of a sync
+ * depends on how many port sequences changed since the last acknowledged sync.
+ * A keepalive sync carries no entries at all and is not answered by the receiver.
+ * Sequences are always transmitted with 16 bits, regardless of whether wide sequences are in use.
+ * Both sides set the wide sequences flag if they support wide sequences, which are used once both did so.
+ * The sequence mode holds for the whole session and all of its ports: it only switches back to narrow sequences
+ * once the other side restarted (see the resync flag).
+ * A side which (re)started sets the resync flag until one of its syncs was acknowledged, so that the other side
+ * drops its delta baseline and sends the sequences of all of its ports again.
+ */
 struct S3TP_SYNC {
 	/**
 	 * By default, the ID is 0 if the sender is the initiator,
 	 * FF if the sender responds to a sync */
 	uint8_t syncId;
-	uint8_t tx_global_seq = 0;
-	uint8_t port_seq [DEFAULT_MAX_OUT_PORTS] = {0};
+	uint8_t flags = 0;
+	uint8_t sync_seq = 0;		/* Identifies this sync. Echoed back by the receiver inside ack_seq */
+	uint8_t ack_seq = 0;		/* Valid if syncId is an ack, or if the ack flag is set */
+	uint16_t tx_global_seq = 0;
+	uint8_t entry_count = 0;
+	S3TP_SYNC_ENTRY entries [DEFAULT_MAX_OUT_PORTS];
+
+	uint16_t getLength() {
+		return (uint16_t)(LEN_S3TP_SYNC_HDR + (entry_count * sizeof(S3TP_SYNC_ENTRY)));
+	}
+
+	bool isKeepalive() {
+		return (flags & S3TP_SYNC_FLAG_KEEPALIVE) != 0;
+	}
+
+	bool carriesAck() {
+		return syncId == S3TP_SYNC_ACK || (flags & S3TP_SYNC_FLAG_ACK) != 0;
+	}
+
+	bool offersWideSequences() {
+		return (flags & S3TP_SYNC_FLAG_WIDE_SEQ) != 0;
+	}
+
+	bool requestsResync() {
+		return (flags & S3TP_SYNC_FLAG_RESYNC) != 0;
+	}
+};
+
+/**
+ * Structure containing cumulative acknowledgements, i.e. the next port sequence expected by the receiver.
+ * Acknowledgements are appended to data frames heading to the other side, right after the payload.
+ * If no such frames are sent in time, a standalone S3TP_MSG_ACK frame with an empty payload carries them instead.
+ * The CRC covers entry_count and all transmitted entries.
+ */
+struct S3TP_ACK {
+	uint16_t crc = 0;
+	uint8_t entry_count = 0;
+	S3TP_SYNC_ENTRY entries [DEFAULT_MAX_IN_PORTS];
+
+	uint16_t getLength() {
+		return (uint16_t)(LEN_S3TP_ACK_HDR + (entry_count * sizeof(S3TP_SYNC_ENTRY)));
+	}
 };
 
 #pragma pack(pop)
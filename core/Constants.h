@@ -34,6 +34,9 @@
 //#define DEFAULT_MAX_PDU_LENGTH (1 << 16)
 
 #define CODE_SUCCESS 0
+//Errors of the receive and transmit policy files, kept apart from the error codes of S3tpShared.h
+#define CODE_ERROR_POLICY_FILE -23
+#define CODE_ERROR_POLICY_FORMAT -24
 
 #define REORDERING 0x1
 #define TYPE_SAT 0x2
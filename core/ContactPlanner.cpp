@@ -0,0 +1,163 @@
+//
+// Created on 18/10/26.
+//
+
+#include "ContactPlanner.h"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+ContactPlanner::ContactPlanner() {
+    pthread_mutex_init(&planner_mutex, NULL);
+}
+
+ContactPlanner::~ContactPlanner() {
+    pthread_mutex_destroy(&planner_mutex);
+}
+
+/**
+ * Loads contact windows from a local schedule file.
+ * Each non-empty line not starting with '#' describes one window: <aos> <los> [rate]
+ * with aos and los being UTC timestamps in seconds and rate being the expected link rate in bytes per second.
+ */
+int ContactPlanner::loadSchedule(const char * path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        LOG_ERROR(std::string("Couldn't open contact schedule " + std::string(path)));
+        return CODE_ERROR_SCHEDULE_FILE;
+    }
+
+    std::vector<CONTACT_WINDOW> windows;
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(file, line)) {
+        lineNo++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream stream(line);
+        long long aos, los;
+        uint32_t rate = DEFAULT_LINK_RATE;
+        if (!(stream >> aos >> los) || los <= aos) {
+            LOG_ERROR(std::string("Invalid contact window in line " + std::to_string(lineNo) + " of schedule"));
+            return CODE_ERROR_SCHEDULE_FORMAT;
+        }
+        stream >> rate;
+        CONTACT_WINDOW window;
+        window.aos = (time_t)aos;
+        window.los = (time_t)los;
+        window.rate = rate;
+        windows.push_back(window);
+    }
+
+    pthread_mutex_lock(&planner_mutex);
+    schedule = windows;
+    std::sort(schedule.begin(), schedule.end(), [](const CONTACT_WINDOW& w1, const CONTACT_WINDOW& w2) {
+        return w1.aos < w2.aos;
+    });
+    pthread_mutex_unlock(&planner_mutex);
+
+    LOG_INFO(std::string("Loaded " + std::to_string(windows.size()) + " contact windows"));
+    return CODE_SUCCESS;
+}
+
+/**
+ * Retrieves the contact window which is currently ongoing or, if there is none, the next upcoming one.
+ * @return  False if no such window is known.
+ */
+bool ContactPlanner::getContact(time_t now, CONTACT_WINDOW * window) {
+    pthread_mutex_lock(&planner_mutex);
+    for (auto const &it : schedule) {
+        if (it.los > now) {
+            *window = it;
+            pthread_mutex_unlock(&planner_mutex);
+            return true;
+        }
+    }
+    pthread_mutex_unlock(&planner_mutex);
+    return false;
+}
+
+/**
+ * Sets the maximum age (in ms) after which messages of a port lose their value.
+ * Messages of ports without a deadline are ranked after all messages with a deadline in the same class.
+ */
+void ContactPlanner::setPortDeadline(uint8_t port, uint64_t maxAge) {
+    pthread_mutex_lock(&planner_mutex);
+    if (maxAge == 0) {
+        port_deadline.erase(port);
+    } else {
+        port_deadline[port] = maxAge;
+    }
+    pthread_mutex_unlock(&planner_mutex);
+}
+
+CONTACT_PLAN ContactPlanner::plan(const std::vector<S3TP_MESSAGE_INFO>& queued, CONTACT_WINDOW window, time_t now) {
+    CONTACT_PLAN result;
+    result.window = window;
+
+    //Bytes that can be transmitted during the remaining part of the window
+    time_t start = MAX(now, window.aos);
+    size_t capacity = (window.los > start) ? (size_t)(window.los - start) * window.rate : 0;
+
+    //Messages are grouped by queue, keeping their original order
+    std::map<int, std::deque<S3TP_MESSAGE_INFO>> queues;
+    for (auto const &message : queued) {
+        queues[message.port * S3TP_PRIORITY_CLASSES + message.priority].push_back(message);
+    }
+
+    pthread_mutex_lock(&planner_mutex);
+    while (!queues.empty()) {
+        //Only the heads of the queues are candidates, as messages of a queue must stay in order
+        std::map<int, std::deque<S3TP_MESSAGE_INFO>>::iterator best = queues.begin();
+        for (std::map<int, std::deque<S3TP_MESSAGE_INFO>>::iterator it = queues.begin(); it != queues.end(); ++it) {
+            if (isPreferred(it->second.front(), best->second.front())) {
+                best = it;
+            }
+        }
+        S3TP_MESSAGE_INFO& head = best->second.front();
+        size_t wireBytes = head.bytes + head.fragments * sizeof(S3TP_HEADER);
+        if (wireBytes <= capacity) {
+            capacity -= wireBytes;
+            result.bytesToSend += head.bytes;
+            result.toSend.push_back(head);
+            best->second.pop_front();
+        } else {
+            //Following messages of the same queue may not overtake this one
+            for (auto const &message : best->second) {
+                result.bytesDeferred += message.bytes;
+                result.deferred.push_back(message);
+            }
+            best->second.clear();
+        }
+        if (best->second.empty()) {
+            queues.erase(best);
+        }
+    }
+    pthread_mutex_unlock(&planner_mutex);
+
+    return result;
+}
+
+/*
+ * Internal methods (do not use locking)
+ */
+uint64_t ContactPlanner::computeDeadline(const S3TP_MESSAGE_INFO& message) {
+    std::map<uint8_t, uint64_t>::iterator it = port_deadline.find(message.port);
+    if (it == port_deadline.end()) {
+        return NO_DEADLINE;
+    }
+    return message.timestamp + it->second;
+}
+
+bool ContactPlanner::isPreferred(const S3TP_MESSAGE_INFO& message1, const S3TP_MESSAGE_INFO& message2) {
+    if (message1.priority != message2.priority) {
+        return message1.priority < message2.priority;
+    }
+    uint64_t deadline1 = computeDeadline(message1);
+    uint64_t deadline2 = computeDeadline(message2);
+    if (deadline1 != deadline2) {
+        return deadline1 < deadline2;
+    }
+    return message1.bytes < message2.bytes;
+}
@@ -0,0 +1,68 @@
+//
+// Created on 18/10/26.
+//
+
+#ifndef S3TP_CONTACTPLANNER_H
+#define S3TP_CONTACTPLANNER_H
+
+#include "Buffer.h"
+#include <ctime>
+#include <deque>
+#include <map>
+#include <vector>
+
+#define CODE_ERROR_SCHEDULE_FILE -1
+#define CODE_ERROR_SCHEDULE_FORMAT -2
+
+#define DEFAULT_LINK_RATE 1200 //in bytes per second
+#define NO_DEADLINE UINT64_MAX
+
+/**
+ * A single pass, during which the link is expected to be up.
+ * Times are given as UTC timestamps (in seconds), the rate is given in bytes per second.
+ */
+struct CONTACT_WINDOW {
+    time_t aos;
+    time_t los;
+    uint32_t rate;
+};
+
+/**
+ * Result of planning a contact window.
+ * Messages in toSend are sorted in the order in which they should be transmitted.
+ */
+struct CONTACT_PLAN {
+    CONTACT_WINDOW window;
+    std::deque<S3TP_MESSAGE_INFO> toSend;
+    std::vector<S3TP_MESSAGE_INFO> deferred;
+    size_t bytesToSend = 0;
+    size_t bytesDeferred = 0;
+};
+
+/**
+ * Decides which of the currently queued messages fit into a contact window.
+ *
+ * Messages are ranked by priority class first, then by deadline and finally by size,
+ * so that smaller messages are preferred when everything else is equal.
+ * The order of messages belonging to the same port and priority class is never changed.
+ * If a message does not fit into the window anymore, all following messages of its queue are deferred as well.
+ */
+class ContactPlanner {
+public:
+    ContactPlanner();
+    ~ContactPlanner();
+    int loadSchedule(const char * path);
+    bool getContact(time_t now, CONTACT_WINDOW * window);
+    void setPortDeadline(uint8_t port, uint64_t maxAge);
+    CONTACT_PLAN plan(const std::vector<S3TP_MESSAGE_INFO>& queued, CONTACT_WINDOW window, time_t now);
+
+private:
+    std::vector<CONTACT_WINDOW> schedule;
+    std::map<uint8_t, uint64_t> port_deadline;
+    pthread_mutex_t planner_mutex;
+
+    uint64_t computeDeadline(const S3TP_MESSAGE_INFO& message);
+    bool isPreferred(const S3TP_MESSAGE_INFO& message1, const S3TP_MESSAGE_INFO& message2);
+};
+
+#endif //S3TP_CONTACTPLANNER_H
@@ -0,0 +1,149 @@
+//
+// Created on 18/10/26.
+//
+
+#include "MemoryBudget.h"
+
+MemoryBudget::MemoryBudget(size_t limit, size_t defaultPortQuota) {
+    this->limit = limit;
+    this->default_quota = defaultPortQuota;
+    used = 0;
+    reserved_total = 0;
+    shared_used = 0;
+    pthread_mutex_init(&budget_mutex, NULL);
+}
+
+MemoryBudget::~MemoryBudget() {
+    pthread_mutex_destroy(&budget_mutex);
+}
+
+/**
+ * Atomically checks whether the port can hold the requested amount of bytes and, if so, charges them to the port.
+ * @param replaced  Bytes already charged to the port which the new ones replace, and which will be released
+ * as soon as the new ones are in use. They are not counted against the port quota and the global limit.
+ * @return  True if the bytes were charged, false if either the port quota or the global limit would be exceeded.
+ */
+bool MemoryBudget::reserve(uint8_t port, size_t bytes, size_t replaced) {
+    pthread_mutex_lock(&budget_mutex);
+    if (!_canReserve(port, bytes, replaced)) {
+        pthread_mutex_unlock(&budget_mutex);
+        return false;
+    }
+    size_t usage = port_usage[port];
+    shared_used += _getSharedUsage(port, usage + bytes) - _getSharedUsage(port, usage);
+    port_usage[port] = usage + bytes;
+    used += bytes;
+    pthread_mutex_unlock(&budget_mutex);
+    return true;
+}
+
+void MemoryBudget::release(uint8_t port, size_t bytes) {
+    pthread_mutex_lock(&budget_mutex);
+    size_t usage = port_usage[port];
+    bytes = (bytes > usage) ? usage : bytes;
+    shared_used -= _getSharedUsage(port, usage) - _getSharedUsage(port, usage - bytes);
+    port_usage[port] = usage - bytes;
+    used -= bytes;
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+bool MemoryBudget::canReserve(uint8_t port, size_t bytes) {
+    pthread_mutex_lock(&budget_mutex);
+    bool result = _canReserve(port, bytes);
+    pthread_mutex_unlock(&budget_mutex);
+    return result;
+}
+
+int MemoryBudget::setPortQuota(uint8_t port, size_t bytes) {
+    pthread_mutex_lock(&budget_mutex);
+    if (bytes < _getReservation(port) || bytes > limit) {
+        pthread_mutex_unlock(&budget_mutex);
+        return CODE_ERROR_BUDGET_EXCEEDED;
+    }
+    port_quota[port] = bytes;
+    pthread_mutex_unlock(&budget_mutex);
+    return CODE_SUCCESS;
+}
+
+int MemoryBudget::setPortReservation(uint8_t port, size_t bytes) {
+    pthread_mutex_lock(&budget_mutex);
+    size_t oldReservation = _getReservation(port);
+    if (reserved_total - oldReservation + bytes > limit || bytes > _getQuota(port)) {
+        pthread_mutex_unlock(&budget_mutex);
+        return CODE_ERROR_BUDGET_EXCEEDED;
+    }
+    //Memory already used by the port moves between the reserved and the shared pool
+    size_t usage = port_usage[port];
+    shared_used -= _getSharedUsage(port, usage);
+    port_reservation[port] = bytes;
+    reserved_total = reserved_total - oldReservation + bytes;
+    shared_used += _getSharedUsage(port, usage);
+    pthread_mutex_unlock(&budget_mutex);
+    return CODE_SUCCESS;
+}
+
+size_t MemoryBudget::getLimit() {
+    return limit;
+}
+
+size_t MemoryBudget::getUsage() {
+    pthread_mutex_lock(&budget_mutex);
+    size_t result = used;
+    pthread_mutex_unlock(&budget_mutex);
+    return result;
+}
+
+size_t MemoryBudget::getPortUsage(uint8_t port) {
+    pthread_mutex_lock(&budget_mutex);
+    std::map<uint8_t, size_t>::iterator it = port_usage.find(port);
+    size_t result = (it != port_usage.end()) ? it->second : 0;
+    pthread_mutex_unlock(&budget_mutex);
+    return result;
+}
+
+size_t MemoryBudget::getPortQuota(uint8_t port) {
+    pthread_mutex_lock(&budget_mutex);
+    size_t result = _getQuota(port);
+    pthread_mutex_unlock(&budget_mutex);
+    return result;
+}
+
+/**
+ * Drops all usage information. Quotas and reservations are kept.
+ */
+void MemoryBudget::reset() {
+    pthread_mutex_lock(&budget_mutex);
+    port_usage.clear();
+    used = 0;
+    shared_used = 0;
+    pthread_mutex_unlock(&budget_mutex);
+}
+
+/*
+ * Internal methods
+ */
+bool MemoryBudget::_canReserve(uint8_t port, size_t bytes, size_t replaced) {
+    size_t usage = port_usage[port];
+    size_t remaining = (replaced > usage) ? 0 : usage - replaced;
+    if (remaining + bytes > _getQuota(port)) {
+        return false;
+    }
+    //Shared pool usage once the replaced bytes are released
+    size_t shared = shared_used - _getSharedUsage(port, usage) + _getSharedUsage(port, remaining + bytes);
+    return shared <= limit - reserved_total;
+}
+
+size_t MemoryBudget::_getQuota(uint8_t port) {
+    std::map<uint8_t, size_t>::iterator it = port_quota.find(port);
+    return (it != port_quota.end()) ? it->second : default_quota;
+}
+
+size_t MemoryBudget::_getReservation(uint8_t port) {
+    std::map<uint8_t, size_t>::iterator it = port_reservation.find(port);
+    return (it != port_reservation.end()) ? it->second : 0;
+}
+
+size_t MemoryBudget::_getSharedUsage(uint8_t port, size_t usage) {
+    size_t reservation = _getReservation(port);
+    return (usage > reservation) ? usage - reservation : 0;
+}
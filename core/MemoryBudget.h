@@ -0,0 +1,55 @@
+//
+// Created on 18/10/26.
+//
+
+#ifndef S3TP_MEMORYBUDGET_H
+#define S3TP_MEMORYBUDGET_H
+
+#include "Constants.h"
+#include <pthread.h>
+#include <map>
+
+#define CODE_ERROR_BUDGET_EXCEEDED -1
+
+/**
+ * Byte-level accounting of the memory held by the daemon on behalf of its ports.
+ *
+ * Every port may use up to its quota. Part of the quota can be reserved for the port,
+ * in which case that amount is always available to it, regardless of what other ports are doing.
+ * Memory used beyond a port's reservation is taken from a shared pool,
+ * which is what remains of the global limit after subtracting all reservations.
+ */
+class MemoryBudget {
+public:
+    MemoryBudget(size_t limit, size_t defaultPortQuota);
+    ~MemoryBudget();
+    bool reserve(uint8_t port, size_t bytes, size_t replaced = 0);
+    void release(uint8_t port, size_t bytes);
+    bool canReserve(uint8_t port, size_t bytes);
+    int setPortQuota(uint8_t port, size_t bytes);
+    int setPortReservation(uint8_t port, size_t bytes);
+    size_t getLimit();
+    size_t getUsage();
+    size_t getPortUsage(uint8_t port);
+    size_t getPortQuota(uint8_t port);
+    void reset();
+
+private:
+    size_t limit;
+    size_t default_quota;
+    size_t used;
+    size_t reserved_total;
+    size_t shared_used;
+    std::map<uint8_t, size_t> port_usage;
+    std::map<uint8_t, size_t> port_quota;
+    std::map<uint8_t, size_t> port_reservation;
+    pthread_mutex_t budget_mutex;
+
+    //Internal methods (do not use locking)
+    bool _canReserve(uint8_t port, size_t bytes, size_t replaced = 0);
+    size_t _getQuota(uint8_t port);
+    size_t _getReservation(uint8_t port);
+    size_t _getSharedUsage(uint8_t port, size_t usage);
+};
+
+#endif //S3TP_MEMORYBUDGET_H
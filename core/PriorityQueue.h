@@ -15,9 +15,10 @@
 #include <pthread.h>
 #include <assert.h>
 
-#define MB 1 << 20
+#define MB (1 << 20)
 #define MAX_QUEUE_SIZE (1*MB)
-#define MAX_QUEUE_CAPACITY (MAX_QUEUE_SIZE / sizeof(S3TP_PACKET))
+//Number of packets fitting into MAX_QUEUE_SIZE bytes, if every packet had the smallest possible size
+#define MAX_QUEUE_CAPACITY (MAX_QUEUE_SIZE / (sizeof(S3TP_PACKET) + sizeof(S3TP_HEADER)))
 #define QUEUE_FULL -1
 
 template <typename T>
@@ -38,18 +39,18 @@ public:
 	T peek();
 	bool isEmpty();
 	int push(T element, PolicyActor<T> * comparator);
-	uint32_t computeBufferSize();
-	uint16_t getSize();
+	uint32_t getSize();
 	void clear();
 	void lock();
 	void unlock();
 	PriorityQueue_node<T> * getHead();
+	PriorityQueue_node<T> * erase(PriorityQueue_node<T> * node);
 
 private:
 	PriorityQueue_node<T> * head;
 	PriorityQueue_node<T> * tail;
 	pthread_mutex_t q_mutex;
-	uint16_t size;
+	uint32_t size;
 };
 
 
@@ -189,17 +190,9 @@ int PriorityQueue<T>::push(T element, PolicyActor<T> * comparator) {
 }
 
 template <typename T>
-uint32_t PriorityQueue<T>::computeBufferSize() {
+uint32_t PriorityQueue<T>::getSize() {
 	pthread_mutex_lock(&q_mutex);
-	uint32_t result = size * sizeof(S3TP_PACKET);
-	pthread_mutex_unlock(&q_mutex);
-	return result;
-}
-
-template <typename T>
-uint16_t PriorityQueue<T>::getSize() {
-	pthread_mutex_lock(&q_mutex);
-	uint16_t result = size;
+	uint32_t result = size;
 	pthread_mutex_unlock(&q_mutex);
 	return result;
 }
@@ -233,4 +226,26 @@ PriorityQueue_node<T> * PriorityQueue<T>::getHead() {
 	return head;
 }
 
+/**
+ * Removes a node from the queue. Must be called while holding the queue lock.
+ * @return  The node following the removed one.
+ */
+template <typename T>
+PriorityQueue_node<T> * PriorityQueue<T>::erase(PriorityQueue_node<T> * node) {
+	PriorityQueue_node<T> * next = node->next;
+	if (node->prev != NULL) {
+		node->prev->next = next;
+	} else {
+		head = next;
+	}
+	if (next != NULL) {
+		next->prev = node->prev;
+	} else {
+		tail = node->prev;
+	}
+	delete node;
+	size -= 1;
+	return next;
+}
+
 #endif /* CORE_QUEUE_H_ */
@@ -0,0 +1,238 @@
+//
+// Created on 18/10/26.
+//
+
+#include "Reactor.h"
+#include "utilities.h"
+
+Reactor::Reactor(ClientInterface * listener) {
+    this->listener = listener;
+    this->server = -1;
+    this->epoll_fd = -1;
+    this->wakeup_fd = -1;
+    this->active = false;
+    this->client_count = 0;
+}
+
+Reactor::~Reactor() {
+    while (!clients.empty()) {
+        closeClient(*clients.begin());
+    }
+    destroyClosedClients();
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    if (wakeup_fd >= 0) {
+        close(wakeup_fd);
+    }
+}
+
+/**
+ * Sets up the reactor on a socket that is already bound and listening.
+ */
+int Reactor::init(SOCKET server) {
+    struct epoll_event ev;
+
+    this->server = server;
+    int flags = fcntl(server, F_GETFL, 0);
+    if (flags < 0 || fcntl(server, F_SETFL, flags | O_NONBLOCK) < 0) {
+        LOG_ERROR("Error configuring daemon socket");
+        return CODE_ERROR_SOCKET_CONFIG;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wakeup_fd < 0) {
+        LOG_ERROR("Error creating reactor");
+        return CODE_ERROR_SOCKET_CREATE;
+    }
+    //Listening socket and wakeup descriptor are told apart from clients by their address
+    ev.events = EPOLLIN;
+    ev.data.ptr = &this->server;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server, &ev) < 0) {
+        LOG_ERROR("Error registering daemon socket");
+        return CODE_ERROR_SOCKET_CONFIG;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wakeup_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) < 0) {
+        LOG_ERROR("Error registering reactor wakeup");
+        return CODE_ERROR_SOCKET_CONFIG;
+    }
+    active = true;
+    return CODE_SUCCESS;
+}
+
+/**
+ * Handles connections until stop is called. Blocks the calling thread.
+ */
+void Reactor::run() {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    uint64_t lastSweep = get_monotonic_time_ms();
+
+    LOG_INFO("Daemon started listening...");
+    while (active) {
+        int count = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, REACTOR_SWEEP_INTERVAL);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("Error while waiting for client events");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &server) {
+                acceptClients();
+            } else if (events[i].data.ptr == &wakeup_fd) {
+                uint64_t value;
+                if (read(wakeup_fd, &value, sizeof(value)) < 0) {
+                    LOG_DEBUG("Reactor wakeup already consumed");
+                }
+                //Clients are also woken up once they may submit held back messages again
+                for (Client * cli : clients) {
+                    cli->handleRetries();
+                }
+            } else {
+                uint64_t tagged = events[i].data.u64;
+                handleClientEvent((Client *)(uintptr_t)(tagged & ~(uint64_t)REACTOR_DOORBELL_TAG), events[i].events,
+                                  (tagged & REACTOR_DOORBELL_TAG) != 0);
+            }
+        }
+        uint64_t now = get_monotonic_time_ms();
+        if (now - lastSweep >= REACTOR_SWEEP_INTERVAL) {
+            sweepHandshakes(now);
+            lastSweep = now;
+        }
+        destroyClosedClients();
+    }
+    LOG_INFO("Daemon stopped listening");
+}
+
+/**
+ * Makes run return. Can be called from any thread.
+ */
+void Reactor::stop() {
+    uint64_t value = 1;
+    active = false;
+    if (wakeup_fd >= 0 && write(wakeup_fd, &value, sizeof(value)) < 0) {
+        LOG_WARN("Couldn't wake reactor up");
+    }
+}
+
+size_t Reactor::getClientCount() {
+    return client_count;
+}
+
+/*
+ * Reactor thread only
+ */
+void Reactor::acceptClients() {
+    struct epoll_event ev;
+
+    while (true) {
+        SOCKET newSocket = accept4(server, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newSocket < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERROR("Error connecting to new client");
+            }
+            break;
+        }
+        LOG_INFO(std::string("Connected to new client on socket " + std::to_string(newSocket)));
+
+        //Client waits for its configuration, which may have been sent already
+        Client * cli = new Client(newSocket, listener, wakeup_fd);
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = cli;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, newSocket, &ev) < 0) {
+            LOG_WARN(std::string("Couldn't register client " + std::to_string(newSocket) + ". Closing socket"));
+            delete cli;
+            continue;
+        }
+        clients.insert(cli);
+        pending_handshakes[cli] = get_monotonic_time_ms();
+        client_count++;
+    }
+}
+
+/**
+ * Watches the doorbell of a client using shared memory, once its handshake is complete.
+ */
+void Reactor::registerDoorbell(Client * cli) {
+    struct epoll_event ev;
+
+    if (cli->getDoorbell() < 0) {
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = (uint64_t)(uintptr_t)cli | REACTOR_DOORBELL_TAG;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cli->getDoorbell(), &ev) < 0) {
+        LOG_WARN(std::string("Couldn't register doorbell of client " + std::to_string(cli->getSocket())));
+        cli->kill();
+    }
+}
+
+void Reactor::handleClientEvent(Client * cli, uint32_t events, bool doorbell) {
+    bool keep = true;
+
+    if (clients.find(cli) == clients.end()) {
+        //Closed while handling a previous event of the same wakeup
+        return;
+    }
+    if (doorbell) {
+        keep = cli->handleDoorbell();
+    } else {
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            //Errors and hangups are detected while reading
+            keep = cli->handleReadable();
+        }
+        if (keep && (events & EPOLLOUT)) {
+            keep = cli->handleWritable();
+        }
+    }
+    if (!keep) {
+        closeClient(cli);
+    } else if (cli->isHandshakeComplete() && pending_handshakes.erase(cli) > 0) {
+        registerDoorbell(cli);
+    }
+}
+
+void Reactor::closeClient(Client * cli) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cli->getSocket(), NULL);
+    if (cli->getDoorbell() >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cli->getDoorbell(), NULL);
+    }
+    pending_handshakes.erase(cli);
+    clients.erase(cli);
+    client_count--;
+    //Listener forgets about the ports of the client before it is destroyed
+    if (listener != NULL) {
+        cli->closePorts();
+    }
+    closed_clients.push_back(cli);
+}
+
+void Reactor::destroyClosedClients() {
+    for (Client * cli : closed_clients) {
+        delete cli;
+    }
+    closed_clients.clear();
+}
+
+/**
+ * Closes connections that didn't send their configuration in time.
+ */
+void Reactor::sweepHandshakes(uint64_t now) {
+    std::map<Client *, uint64_t>::iterator it = pending_handshakes.begin();
+    while (it != pending_handshakes.end()) {
+        Client * cli = it->first;
+        uint64_t accepted = it->second;
+        //Closing the client removes it from the map
+        ++it;
+        if (now - accepted >= CLIENT_HANDSHAKE_TIMEOUT) {
+            LOG_WARN(std::string("Client on socket " + std::to_string(cli->getSocket())
+                                 + " didn't send its configuration in time. Closing socket"));
+            closeClient(cli);
+        }
+    }
+}
@@ -0,0 +1,66 @@
+//
+// Created on 18/10/26.
+//
+
+#ifndef S3TP_REACTOR_H
+#define S3TP_REACTOR_H
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <atomic>
+#include <map>
+#include <set>
+#include <vector>
+#include "Client.h"
+#include "ClientInterface.h"
+
+//Events handled per wakeup of the reactor
+#define REACTOR_MAX_EVENTS 64
+//Time (in ms) a new connection has to send its configuration, before being closed
+#define CLIENT_HANDSHAKE_TIMEOUT 2000
+//Maximum time (in ms) between two checks for expired handshakes
+#define REACTOR_SWEEP_INTERVAL 500
+//Set on the event data of client doorbells, to tell them apart from client sockets
+#define REACTOR_DOORBELL_TAG 0x1
+
+/**
+ * Event loop owning the listening socket and the sockets of all connected applications.
+ *
+ * A single thread waits on epoll for any socket to become readable or writable, then lets the client
+ * read or write as much as possible without blocking. This replaces one thread per application,
+ * so that the daemon scales with the number of applications, and a slow application cannot stall the others.
+ * Clients are created, closed and destroyed by the reactor thread only.
+ */
+class Reactor {
+public:
+    Reactor(ClientInterface * listener);
+    ~Reactor();
+    int init(SOCKET server);
+    void run();
+    void stop();
+    size_t getClientCount();
+
+private:
+    ClientInterface * listener;
+    SOCKET server;
+    int epoll_fd;
+    //Used to wake the reactor thread up when stopping, or when clients may retry held back messages
+    int wakeup_fd;
+    std::atomic<bool> active;
+    std::atomic<size_t> client_count;
+    //Only accessed by the reactor thread
+    std::set<Client *> clients;
+    std::map<Client *, uint64_t> pending_handshakes;
+    //Destroyed once all events of the current wakeup were handled, as more events may refer to them
+    std::vector<Client *> closed_clients;
+
+    void acceptClients();
+    void registerDoorbell(Client * cli);
+    void handleClientEvent(Client * cli, uint32_t events, bool doorbell);
+    void closeClient(Client * cli);
+    void destroyClosedClients();
+    void sweepHandshakes(uint64_t now);
+};
+
+#endif //S3TP_REACTOR_H
@@ -0,0 +1,235 @@
+//
+// Created on 18/10/26.
+//
+
+#include "ReorderBuffer.h"
+
+ReorderBuffer::ReorderBuffer() {
+    head = 0;
+    count = 0;
+    delivered = 0;
+    size = 0;
+    std::fill(slots, slots + REORDER_BUFFER_SLOTS, (S3TP_PACKET *)NULL);
+    std::fill(occupied, occupied + REORDER_BUFFER_WORDS, (uint64_t)0);
+}
+
+ReorderBuffer::~ReorderBuffer() {
+    clear();
+}
+
+/**
+ * Stores a packet at the given distance from the next expected packet.
+ * On failure, the packet is not stored and remains owned by the caller.
+ * @return  CODE_SUCCESS, CODE_ERROR_DUPLICATE_PACKET if a packet is already stored at that position,
+ * or CODE_ERROR_OUT_OF_WINDOW if the distance exceeds the size of the buffer.
+ */
+int ReorderBuffer::insert(S3TP_PACKET * packet, uint16_t distance) {
+    if (distance >= REORDER_BUFFER_SLOTS) {
+        return CODE_ERROR_OUT_OF_WINDOW;
+    }
+    uint16_t index = getIndex(distance);
+    if (isOccupied(index)) {
+        return CODE_ERROR_DUPLICATE_PACKET;
+    }
+    slots[index] = packet;
+    setOccupied(index, true);
+    count++;
+    size += getFootprint(packet);
+    return CODE_SUCCESS;
+}
+
+/**
+ * Checks whether a packet was already received at the given distance (even if it was delivered already),
+ * without touching the packet itself.
+ */
+bool ReorderBuffer::contains(uint16_t distance) {
+    return distance < REORDER_BUFFER_SLOTS && isOccupied(getIndex(distance));
+}
+
+S3TP_PACKET * ReorderBuffer::peek(uint16_t distance) {
+    if (distance >= REORDER_BUFFER_SLOTS) {
+        return NULL;
+    }
+    return slots[getIndex(distance)];
+}
+
+/**
+ * @return  The stored packet closest to the next expected one, or NULL if the buffer is empty.
+ */
+S3TP_PACKET * ReorderBuffer::peekFirst() {
+    for (uint16_t distance = findOccupied(0); distance < REORDER_BUFFER_SLOTS; distance = findOccupied(distance + 1)) {
+        if (slots[getIndex(distance)] != NULL) {
+            return slots[getIndex(distance)];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Scans the bitmap a word at a time.
+ * @return  The smallest distance >= from at which a packet is stored, or REORDER_BUFFER_SLOTS if there is none.
+ */
+uint16_t ReorderBuffer::findOccupied(uint16_t from) {
+    uint32_t distance = from;
+    while (distance < REORDER_BUFFER_SLOTS && (count > 0 || delivered > 0)) {
+        uint16_t index = getIndex((uint16_t)distance);
+        //Slots of a word are consecutive, as the buffer only wraps around at a word boundary
+        uint64_t word = occupied[index >> 6] >> (index & 63);
+        if (word != 0) {
+            distance += __builtin_ctzll(word);
+            return (uint16_t)((distance < REORDER_BUFFER_SLOTS) ? distance : REORDER_BUFFER_SLOTS);
+        }
+        distance += 64 - (index & 63);
+    }
+    return REORDER_BUFFER_SLOTS;
+}
+
+/**
+ * Removes the next expected packet and moves on to the following one.
+ * @return  The packet, or NULL if it was not received yet (in which case the buffer is left untouched).
+ */
+S3TP_PACKET * ReorderBuffer::pop() {
+    S3TP_PACKET * packet = slots[head];
+    if (packet == NULL) {
+        return NULL;
+    }
+    slots[head] = NULL;
+    setOccupied(head, false);
+    head = getIndex(1);
+    count--;
+    size -= getFootprint(packet);
+    return packet;
+}
+
+/**
+ * Removes a packet ahead of the next expected one, e.g. because it is delivered out of order.
+ * Its position stays marked as received, so that duplicates are still recognized,
+ * until the expected sequence moves past it.
+ * @return  The packet, or NULL if there is none at the given distance.
+ */
+S3TP_PACKET * ReorderBuffer::take(uint16_t distance) {
+    if (distance >= REORDER_BUFFER_SLOTS || slots[getIndex(distance)] == NULL) {
+        return NULL;
+    }
+    uint16_t index = getIndex(distance);
+    S3TP_PACKET * packet = slots[index];
+    slots[index] = NULL;
+    count--;
+    delivered++;
+    size -= getFootprint(packet);
+    return packet;
+}
+
+/**
+ * Moves past the positions at the head whose packets were already taken.
+ * @return  The amount of positions the head was moved by.
+ */
+uint16_t ReorderBuffer::skipDelivered() {
+    uint16_t steps = 0;
+    while (delivered > 0 && slots[head] == NULL && isOccupied(head)) {
+        setOccupied(head, false);
+        delivered--;
+        head = getIndex(1);
+        steps++;
+    }
+    return steps;
+}
+
+/**
+ * Skips the given amount of packets, e.g. because the expected sequence was moved forward by a sync.
+ * Packets stored in the skipped positions are deleted.
+ */
+void ReorderBuffer::advance(uint16_t steps) {
+    if (steps >= REORDER_BUFFER_SLOTS) {
+        clear();
+        return;
+    }
+    for (uint16_t distance = findOccupied(0); distance < steps; distance = findOccupied(distance + 1)) {
+        release(getIndex(distance), true);
+    }
+    head = getIndex(steps);
+}
+
+/**
+ * Removes all packets, ordered by their distance. Ownership is passed to the caller.
+ * Positions of packets taken before are forgotten.
+ */
+std::vector<S3TP_PACKET *> ReorderBuffer::drain() {
+    std::vector<S3TP_PACKET *> result;
+    for (uint16_t distance = findOccupied(0); distance < REORDER_BUFFER_SLOTS; distance = findOccupied(distance + 1)) {
+        uint16_t index = getIndex(distance);
+        if (slots[index] != NULL) {
+            result.push_back(slots[index]);
+        }
+        release(index, false);
+    }
+    head = 0;
+    return result;
+}
+
+uint16_t ReorderBuffer::getCount() {
+    return count;
+}
+
+/**
+ * Number of positions marked as received, including the ones whose packets were already taken.
+ */
+uint16_t ReorderBuffer::getReceivedCount() {
+    return count + delivered;
+}
+
+/**
+ * Memory (in bytes) held by the stored packets.
+ */
+size_t ReorderBuffer::getSize() {
+    return size;
+}
+
+bool ReorderBuffer::isEmpty() {
+    return count == 0 && delivered == 0;
+}
+
+void ReorderBuffer::clear() {
+    for (uint16_t distance = findOccupied(0); distance < REORDER_BUFFER_SLOTS; distance = findOccupied(distance + 1)) {
+        release(getIndex(distance), true);
+    }
+    head = 0;
+}
+
+size_t ReorderBuffer::getFootprint(S3TP_PACKET * packet) {
+    return sizeof(S3TP_PACKET) + packet->getLength();
+}
+
+/*
+ * Internal methods
+ */
+uint16_t ReorderBuffer::getIndex(uint16_t distance) {
+    return (uint16_t)((head + distance) & (REORDER_BUFFER_SLOTS - 1));
+}
+
+//Frees a position, deleting its packet if requested
+void ReorderBuffer::release(uint16_t index, bool deletePacket) {
+    if (slots[index] != NULL) {
+        size -= getFootprint(slots[index]);
+        if (deletePacket) {
+            delete slots[index];
+        }
+        slots[index] = NULL;
+        count--;
+    } else {
+        delivered--;
+    }
+    setOccupied(index, false);
+}
+
+bool ReorderBuffer::isOccupied(uint16_t index) {
+    return ((occupied[index >> 6] >> (index & 63)) & 1) != 0;
+}
+
+void ReorderBuffer::setOccupied(uint16_t index, bool value) {
+    if (value) {
+        occupied[index >> 6] |= ((uint64_t)1 << (index & 63));
+    } else {
+        occupied[index >> 6] &= ~((uint64_t)1 << (index & 63));
+    }
+}
@@ -0,0 +1,64 @@
+//
+// Created on 18/10/26.
+//
+
+#ifndef S3TP_REORDERBUFFER_H
+#define S3TP_REORDERBUFFER_H
+
+#include "CommonTypes.h"
+#include <vector>
+#include <algorithm>
+
+//Must be a power of 2, and at least 64 (the size of a bitmap word)
+#define REORDER_BUFFER_SLOTS 4096
+#define REORDER_BUFFER_WORDS (REORDER_BUFFER_SLOTS / 64)
+
+//Kept apart from the error codes of S3tpShared.h and RxModule.h
+#define CODE_ERROR_DUPLICATE_PACKET -20
+#define CODE_ERROR_OUT_OF_WINDOW -21
+
+/**
+ * Fixed-size circular array holding the received packets of a single port, until they can be delivered in order.
+ *
+ * Packets are addressed by their distance from the next expected port sequence,
+ * so that inserting, checking for duplicates and popping the next in-order packet are O(1).
+ * A bitmap of the occupied slots allows rejecting duplicates and skipping empty regions a word at a time.
+ * The buffer performs no locking and no allocations after construction.
+ * It must be protected by the lock of its owner.
+ */
+class ReorderBuffer {
+public:
+    ReorderBuffer();
+    ~ReorderBuffer();
+    int insert(S3TP_PACKET * packet, uint16_t distance);
+    bool contains(uint16_t distance);
+    S3TP_PACKET * peek(uint16_t distance);
+    S3TP_PACKET * peekFirst();
+    uint16_t findOccupied(uint16_t from);
+    S3TP_PACKET * pop();
+    S3TP_PACKET * take(uint16_t distance);
+    uint16_t skipDelivered();
+    void advance(uint16_t steps);
+    std::vector<S3TP_PACKET *> drain();
+    uint16_t getCount();
+    uint16_t getReceivedCount();
+    size_t getSize();
+    bool isEmpty();
+    void clear();
+    static size_t getFootprint(S3TP_PACKET * packet);
+
+private:
+    S3TP_PACKET * slots[REORDER_BUFFER_SLOTS];
+    uint64_t occupied[REORDER_BUFFER_WORDS];
+    uint16_t head;
+    uint16_t count;
+    uint16_t delivered;
+    size_t size;
+
+    uint16_t getIndex(uint16_t distance);
+    void release(uint16_t index, bool deletePacket);
+    bool isOccupied(uint16_t index);
+    void setOccupied(uint16_t index, bool value);
+};
+
+#endif //S3TP_REORDERBUFFER_H
@@ -0,0 +1,72 @@
+//
+// Created on 18/10/26.
+//
+
+#ifndef S3TP_RINGBUFFER_H
+#define S3TP_RINGBUFFER_H
+
+#include <atomic>
+#include <cstddef>
+
+#define RING_BUFFER_CACHE_LINE 64
+
+/**
+ * Bounded lock-free queue for exactly one producer thread and one consumer thread.
+ *
+ * Elements are stored in place, so that the producer can fill a slot directly (reserve + commit)
+ * and the consumer can process it without copying (front + pop).
+ * Capacity must be a power of 2.
+ */
+template <typename T, size_t Capacity>
+class RingBuffer {
+public:
+    RingBuffer() : head(0), tail(0) {
+        static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+    }
+
+    //Producer side. Returns NULL if the buffer is full
+    T * reserve() {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) >= Capacity) {
+            return NULL;
+        }
+        return &slots[t & (Capacity - 1)];
+    }
+
+    //Producer side. Publishes the slot previously returned by reserve
+    void commit() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+    }
+
+    //Consumer side. Returns NULL if the buffer is empty
+    T * front() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_seq_cst)) {
+            return NULL;
+        }
+        return &slots[h & (Capacity - 1)];
+    }
+
+    //Consumer side. Releases the slot previously returned by front
+    void pop() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool isEmpty() {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_seq_cst);
+    }
+
+private:
+    T slots[Capacity];
+    /*
+     * Indexes only grow, the slot is obtained by masking. Padding keeps them on separate cache lines
+     * to avoid false sharing. Alignment is avoided, as rings are allocated with plain new.
+     */
+    char head_padding[RING_BUFFER_CACHE_LINE];
+    std::atomic<size_t> head;
+    char tail_padding[RING_BUFFER_CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+    char end_padding[RING_BUFFER_CACHE_LINE - sizeof(std::atomic<size_t>)];
+};
+
+#endif //S3TP_RINGBUFFER_H
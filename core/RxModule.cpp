@@ -3,36 +3,66 @@
 //
 
 #include "RxModule.h"
+#include <fstream>
+#include <sstream>
 
 RxModule::RxModule() {
-    to_consume_global_seq = 0;
-    receiving_window = 0;
-    lastReceivedGlobalSeq = to_consume_global_seq;
+    reorder_delay = DEFAULT_REORDER_DELAY;
+    wide_sequences = false;
+    last_served_port = 0;
+    std::fill(duplicate_frames, duplicate_frames + DEFAULT_MAX_IN_PORTS, (uint32_t)0);
+    std::fill(lost_packets, lost_packets + DEFAULT_MAX_IN_PORTS, (uint32_t)0);
+    std::fill(late_packets, late_packets + DEFAULT_MAX_IN_PORTS, (uint32_t)0);
+    memory_budget = new MemoryBudget(DEFAULT_RX_MEMORY_BUDGET, DEFAULT_RX_PORT_QUOTA);
+    std::fill(shed_policy, shed_policy + DEFAULT_MAX_IN_PORTS, SHED_DROP_NEWEST);
     pthread_mutex_init(&rx_mutex, NULL);
     pthread_cond_init(&available_msg_cond, NULL);
-    inBuffer = new Buffer(this);
+    std::fill(reorder_buffers, reorder_buffers + DEFAULT_MAX_IN_PORTS, (ReorderBuffer *)NULL);
     statusInterface = NULL;
+    ingress_ring = new RingBuffer<S3TP_INGRESS_FRAME, INGRESS_RING_CAPACITY>();
+    ingress_overflows = 0;
+    ingress_sleeping = false;
+    ingress_running = false;
+    pthread_mutex_init(&ingress_mutex, NULL);
+    init_monotonic_cond(&ingress_cond);
 }
 
 RxModule::~RxModule() {
     stopModule();
     pthread_mutex_lock(&rx_mutex);
-    delete inBuffer;
+    for (int i = 0; i < DEFAULT_MAX_IN_PORTS; i++) {
+        delete reorder_buffers[i];
+        reorder_buffers[i] = NULL;
+    }
     pthread_cond_destroy(&available_msg_cond);
 
     pthread_mutex_unlock(&rx_mutex);
     pthread_mutex_destroy(&rx_mutex);
+    delete memory_budget;
+    delete ingress_ring;
+    pthread_cond_destroy(&ingress_cond);
+    pthread_mutex_destroy(&ingress_mutex);
     //TODO: implement. Also remember to close all ports
 }
 
 void RxModule::reset() {
     pthread_mutex_lock(&rx_mutex);
-    receiving_window = 0;
-    to_consume_global_seq = 0;
-    lastReceivedGlobalSeq = to_consume_global_seq;
-    inBuffer->clear();
-    current_port_sequence.clear();
+    reorder_delay = DEFAULT_REORDER_DELAY;
+    wide_sequences = false;
+    for (int i = 0; i < DEFAULT_MAX_IN_PORTS; i++) {
+        if (reorder_buffers[i] != NULL) {
+            reorder_buffers[i]->clear();
+        }
+    }
+    reassembly.clear();
     available_messages.clear();
+    paused_ports.clear();
+    std::fill(duplicate_frames, duplicate_frames + DEFAULT_MAX_IN_PORTS, (uint32_t)0);
+    std::fill(lost_packets, lost_packets + DEFAULT_MAX_IN_PORTS, (uint32_t)0);
+    std::fill(late_packets, late_packets + DEFAULT_MAX_IN_PORTS, (uint32_t)0);
+    std::fill(shed_stats, shed_stats + DEFAULT_MAX_IN_PORTS, S3TP_SHED_STATS());
+    memory_budget->reset();
+    refusing_ports.clear();
     open_ports.clear();
     pthread_mutex_unlock(&rx_mutex);
 }
@@ -45,9 +75,17 @@ void RxModule::setStatusInterface(StatusInterface * statusInterface) {
 
 void RxModule::startModule() {
     pthread_mutex_lock(&rx_mutex);
-    receiving_window = 0;
     active = true;
     pthread_mutex_unlock(&rx_mutex);
+
+    pthread_mutex_lock(&ingress_mutex);
+    if (!ingress_running) {
+        //Frames received while the module was stopped belong to the previous session
+        discardIngressFrames();
+        ingress_running = true;
+        pthread_create(&ingress_thread, NULL, &staticIngressRoutine, this);
+    }
+    pthread_mutex_unlock(&ingress_mutex);
 }
 
 void RxModule::stopModule() {
@@ -57,6 +95,17 @@ void RxModule::stopModule() {
     // Such thread should then check the status of the module, in order to avoid waiting forever.
     pthread_cond_signal(&available_msg_cond);
     pthread_mutex_unlock(&rx_mutex);
+
+    pthread_mutex_lock(&ingress_mutex);
+    bool joinIngress = ingress_running;
+    ingress_running = false;
+    pthread_cond_signal(&ingress_cond);
+    pthread_mutex_unlock(&ingress_mutex);
+    if (joinIngress) {
+        pthread_join(ingress_thread, NULL);
+        //Frames still in the ingress ring are discarded
+        discardIngressFrames();
+    }
 }
 
 bool RxModule::isActive() {
@@ -70,13 +119,183 @@ bool RxModule::isActive() {
  * Callback implementation
  */
 void RxModule::handleFrame(bool arq, int channel, const void* data, int length) {
-    if (length > MAX_LEN_S3TP_PACKET) {
-        //TODO: handle error
+    //Runs on the transceiver thread: the frame is only copied, all processing is done by the ingress thread
+    if (length <= 0 || length > MAX_LEN_S3TP_FRAME) {
+        LOG_WARN(std::string("RX: Dropped frame with invalid length " + std::to_string(length)));
+        return;
+    }
+    S3TP_INGRESS_FRAME * frame = ingress_ring->reserve();
+    if (frame == NULL) {
+        //Ingress thread is not keeping up
+        ingress_overflows++;
+        return;
+    }
+    frame->arq = arq;
+    frame->channel = channel;
+    frame->length = length;
+    memcpy(frame->data, data, (size_t)length);
+    ingress_ring->commit();
+    if (ingress_sleeping.load()) {
+        pthread_mutex_lock(&ingress_mutex);
+        pthread_cond_signal(&ingress_cond);
+        pthread_mutex_unlock(&ingress_mutex);
+    }
+}
+
+/**
+ * Empties the ingress ring. Only called while the ingress thread is not running, as the ring allows a single consumer.
+ */
+void RxModule::discardIngressFrames() {
+    uint32_t discarded = 0;
+    while (ingress_ring->front() != NULL) {
+        ingress_ring->pop();
+        discarded++;
+    }
+    if (discarded > 0) {
+        LOG_DEBUG(std::string("RX: Discarded " + std::to_string(discarded) + " frames left in the ingress ring"));
+    }
+}
+
+/**
+ * Number of frames dropped because the ingress ring was full.
+ */
+uint32_t RxModule::getIngressOverflowCount() {
+    return ingress_overflows.load();
+}
+
+/*
+ * Ingress thread logic
+ */
+void RxModule::ingressRoutine() {
+    std::vector<S3TP_PACKET *> batch;
+    uint32_t reportedOverflows = 0;
+
+    struct timespec deadline;
+    uint64_t nextGapCheck = get_monotonic_time_ms() + GAP_CHECK_INTERVAL;
+
+    while (true) {
+        pthread_mutex_lock(&ingress_mutex);
+        ingress_sleeping.store(true);
+        //Waking up periodically even without traffic, as gaps may time out on a quiet link
+        compute_monotonic_deadline(&deadline, nextGapCheck);
+        if (ingress_running && ingress_ring->isEmpty()) {
+            pthread_cond_timedwait(&ingress_cond, &ingress_mutex, &deadline);
+        }
+        ingress_sleeping.store(false);
+        bool running = ingress_running;
+        pthread_mutex_unlock(&ingress_mutex);
+        if (!running) {
+            break;
+        }
+
+        //Frames are decoded without locking, then buffered under a single lock acquisition
+        S3TP_INGRESS_FRAME * frame;
+        while (batch.size() < INGRESS_BATCH_SIZE && (frame = ingress_ring->front()) != NULL) {
+            S3TP_PACKET * packet = decodeFrame(frame->arq, frame->channel, frame->data, frame->length);
+            ingress_ring->pop();
+            if (packet == NULL) {
+                continue;
+            }
+            if (packet->getHeader()->getMessageType() == S3TP_MSG_SYNC) {
+                //Packets received before the sync must be buffered before sequences are changed
+                bufferPackets(batch);
+                handleSyncPacket(packet);
+            } else {
+                batch.push_back(packet);
+            }
+        }
+        bufferPackets(batch);
+
+        uint64_t now = get_monotonic_time_ms();
+        if (now >= nextGapCheck) {
+            pthread_mutex_lock(&rx_mutex);
+            checkGapTimers(now);
+            pthread_mutex_unlock(&rx_mutex);
+            nextGapCheck = now + GAP_CHECK_INTERVAL;
+        }
+
+        uint32_t overflows = ingress_overflows.load();
+        if (overflows != reportedOverflows) {
+            LOG_WARN(std::string("RX: " + std::to_string(overflows - reportedOverflows)
+                                 + " frames dropped because the ingress ring was full"));
+            reportedOverflows = overflows;
+        }
+    }
+    pthread_exit(NULL);
+}
+
+void * RxModule::staticIngressRoutine(void * args) {
+    static_cast<RxModule*>(args)->ingressRoutine();
+    return NULL;
+}
+
+/**
+ * Validates a frame and extracts the packet it contains. Acknowledgements carried by the frame are processed directly.
+ * @return  The packet (data or sync) or NULL if there is nothing to be buffered.
+ */
+S3TP_PACKET * RxModule::decodeFrame(bool arq, int channel, const char * data, int length) {
+    if (length < (int)sizeof(S3TP_HEADER) || length > MAX_LEN_S3TP_FRAME) {
+        LOG_WARN(std::string("RX: Dropped frame with invalid length " + std::to_string(length)));
+        return NULL;
+    }
+    S3TP_HEADER * hdr = (S3TP_HEADER *)data;
+    int extLength = hdr->hasWideSequences() ? sizeof(S3TP_HEADER_EXT) : 0;
+    int packetLength = sizeof(S3TP_HEADER) + extLength + hdr->getPduLength();
+    if (packetLength > length) {
+        LOG_WARN(std::string("RX: Dropped truncated frame (" + std::to_string(length) + " bytes)"));
+        return NULL;
+    }
+    if (length > packetLength) {
+        //Bytes following the packet contain acknowledgements for our own transmissions
+        handleAcknowledgements(data + packetLength, length - packetLength);
     }
-    //Copying packet. Data argument is not needed anymore afterwards
-    S3TP_PACKET * packet = new S3TP_PACKET((char *)data, length, (uint8_t)channel);
-    int result = handleReceivedPacket(packet);
-    //TODO: handle error
+    S3TP_MSG_TYPE type = hdr->getMessageType();
+    if (type == S3TP_MSG_ACK) {
+        //Standalone acknowledgement, no packet to process
+        return NULL;
+    } else if (type != S3TP_MSG_DATA && type != S3TP_MSG_SYNC) {
+        //Not recognized data message
+        LOG_WARN(std::string("Unrecognized message type received: " + std::to_string((int)type)));
+        return NULL;
+    }
+    //Checking CRC
+    const char * payload = data + sizeof(S3TP_HEADER) + extLength;
+    if (!verify_checksum(payload, hdr->getPduLength(), hdr->crc)) {
+        LOG_WARN(std::string("Wrong CRC for packet " + std::to_string((int)hdr->getGlobalSequence())));
+        return NULL;
+    }
+    //Copying packet. Frame is not needed anymore afterwards
+    S3TP_PACKET * packet = new S3TP_PACKET(data, packetLength - extLength, (uint8_t)channel);
+    if (extLength > 0) {
+        //Header extension is not part of the payload
+        memcpy(&packet->ext, data + sizeof(S3TP_HEADER), sizeof(S3TP_HEADER_EXT));
+        memcpy(packet->getPayload(), payload, hdr->getPduLength());
+    }
+    if (arq) {
+        packet->options |= S3TP_OPTION_ARQ;
+    }
+    return packet;
+}
+
+void RxModule::handleAcknowledgements(const char * data, int length) {
+    S3TP_ACK * ack = (S3TP_ACK *)data;
+    if (length < LEN_S3TP_ACK_HDR
+        || ack->entry_count > DEFAULT_MAX_IN_PORTS
+        || ack->getLength() > length) {
+        LOG_WARN("RX: Malformed acknowledgements received");
+        return;
+    }
+    if (!verify_checksum(data + sizeof(uint16_t), (uint16_t)(ack->getLength() - sizeof(uint16_t)), ack->crc)) {
+        LOG_WARN("RX: Wrong CRC for acknowledgements");
+        return;
+    }
+    pthread_mutex_lock(&rx_mutex);
+    if (statusInterface != NULL) {
+        for (int i=0; i<ack->entry_count; i++) {
+            statusInterface->onAcknowledgement(ack->entries[i].port, ack->entries[i].seq);
+        }
+    }
+    pthread_mutex_unlock(&rx_mutex);
 }
 
 void RxModule::handleLinkStatus(bool linkStatus) {
@@ -97,7 +316,11 @@ void RxModule::handleBufferEmpty(int channel) {
     pthread_mutex_unlock(&rx_mutex);
 }
 
-int RxModule::openPort(uint8_t port) {
+/**
+ * @param options  Client options of the application using the port (S3TP_OPTION_UNORDERED, S3TP_OPTION_STREAMING).
+ * Streaming only applies to ordered ports.
+ */
+int RxModule::openPort(uint8_t port, uint8_t options) {
     pthread_mutex_lock(&rx_mutex);
     if (!active) {
         pthread_mutex_unlock(&rx_mutex);
@@ -109,6 +332,21 @@ int RxModule::openPort(uint8_t port) {
         return PORT_ALREADY_OPEN;
     }
     open_ports[port] = 1;
+    duplicate_frames[port] = 0;
+    lost_packets[port] = 0;
+    late_packets[port] = 0;
+    shed_stats[port] = S3TP_SHED_STATS();
+    refusing_ports.erase(port);
+    if (reorder_buffers[port] == NULL) {
+        reorder_buffers[port] = new ReorderBuffer();
+    }
+    S3TP_REASSEMBLY_STATE& state = reassembly[port];
+    state.unordered = (options & S3TP_OPTION_UNORDERED) != 0;
+    state.streaming = !state.unordered && (options & S3TP_OPTION_STREAMING) != 0;
+    state.stream_open = false;
+    state.stream_aborted = false;
+    state.given_up.clear();
+    resetReassembly(port);
     pthread_mutex_unlock(&rx_mutex);
 
     return CODE_SUCCESS;
@@ -122,6 +360,13 @@ int RxModule::closePort(uint8_t port) {
     }
     if (open_ports.find(port) != open_ports.end()) {
         open_ports.erase(port);
+        //Undelivered packets for the port are discarded
+        delete reorder_buffers[port];
+        reorder_buffers[port] = NULL;
+        updateMemoryUsage(port);
+        available_messages.erase(port);
+        paused_ports.erase(port);
+        resetReassembly(port);
         pthread_mutex_unlock(&rx_mutex);
         return CODE_SUCCESS;
     }
@@ -137,126 +382,85 @@ bool RxModule::isPortOpen(uint8_t port) {
     return result;
 }
 
-int RxModule::handleReceivedPacket(S3TP_PACKET * packet) {
-    if (!isActive()) {
-        return MODULE_INACTIVE;
-    }
-
-    //Checking CRC
+void RxModule::handleSyncPacket(S3TP_PACKET * packet) {
     S3TP_HEADER * hdr = packet->getHeader();
-    //TODO: check if pdu length + header size > total length (there might've been an error), otherwise buffer overflow
-    if (!verify_checksum(packet->getPayload(), hdr->getPduLength(), hdr->crc)) {
-        LOG_WARN(std::string("Wrong CRC for packet " + std::to_string((int)hdr->getGlobalSequence())));
-        return CODE_ERROR_CRC_INVALID;
-    }
-
-    S3TP_MSG_TYPE type = hdr->getMessageType();
-    if (type == S3TP_MSG_SYNC) {
-        S3TP_SYNC * sync = (S3TP_SYNC*)packet->getPayload();
+    S3TP_SYNC * sync = (S3TP_SYNC*)packet->getPayload();
+    if (hdr->getPduLength() < LEN_S3TP_SYNC_HDR
+        || sync->entry_count > DEFAULT_MAX_OUT_PORTS
+        || hdr->getPduLength() < sync->getLength()) {
+        LOG_WARN("RX: Malformed sync packet received");
+    } else {
         LOG_DEBUG("RX: Sync Packet received");
         synchronizeStatus(*sync);
-        return CODE_SUCCESS;
-    } else if (type != S3TP_MSG_DATA) {
-        //Not recognized data message
-        LOG_WARN(std::string("Unrecognized message type received: " + std::to_string((int)type)));
-        return CODE_ERROR_INVALID_TYPE;
-    }
-
-    if (!isPortOpen(hdr->getPort())) {
-        //Dropping packet right away
-        LOG_INFO(std::string("Incoming packet " + std::to_string(hdr->getGlobalSequence())
-                             + "for port " + std::to_string(hdr->getPort())
-                             + " was dropped because port is closed"));
-        return CODE_ERROR_PORT_CLOSED;
     }
+    delete packet;
+}
 
-    int result = inBuffer->write(packet);
-    if (result != CODE_SUCCESS) {
-        //Something bad happened, couldn't put packet in buffer
-        return result;
+/**
+ * Buffers a batch of data packets under a single lock acquisition. The batch is emptied.
+ */
+void RxModule::bufferPackets(std::vector<S3TP_PACKET *>& packets) {
+    if (packets.empty()) {
+        return;
     }
-
-    LOG_DEBUG(std::string("RX: Packet received from SPI to port "
-                          + std::to_string((int)hdr->getPort())
-                          + " -> glob_seq " + std::to_string((int)hdr->getGlobalSequence())
-                          + ", sub_seq " + std::to_string((int)hdr->getSubSequence())
-                          + ", port_seq " + std::to_string((int)hdr->seq_port)));
-
+    uint64_t now = get_monotonic_time_ms();
     pthread_mutex_lock(&rx_mutex);
-    if (isCompleteMessageForPortAvailable(hdr->getPort())) {
-        //New message is available, notify
-        available_messages[hdr->getPort()] = 1;
-        pthread_cond_signal(&available_msg_cond);
+    for (S3TP_PACKET * packet : packets) {
+        //Packet is owned by the module from now on, even in case of errors
+        bufferPacket(packet, now);
     }
     pthread_mutex_unlock(&rx_mutex);
+    packets.clear();
+}
 
-    //This variable doesn't need locking, as it is a purely internal counter
-    uint8_t relativeGlobSeq = (hdr->getGlobalSequence() - to_consume_global_seq);
-    if (relativeGlobSeq < RECEIVING_WINDOW_SIZE && relativeGlobSeq > lastReceivedGlobalSeq) {
-        lastReceivedGlobalSeq = hdr->getGlobalSequence();
+int RxModule::synchronizeStatus(S3TP_SYNC& sync) {
+    pthread_mutex_lock(&rx_mutex);
+    if (!active) {
+        pthread_mutex_unlock(&rx_mutex);
+        return MODULE_INACTIVE;
     }
-    receiving_window++;
-    if (receiving_window >= RECEIVING_WINDOW_SIZE) {
-        //Update global sequence number and flush queues
-        LOG_DEBUG("Receiving window reached. Flushing queues now..");
-        flushQueues();
-        receiving_window = 0;
+    //Sync only contains the ports whose sequence changed since the last acknowledged sync
+    if (sync.requestsResync() && wide_sequences) {
+        //Other side restarted, it only switches to wide sequences again once both sides offered them
+        LOG_INFO("RX: Other side restarted, back to narrow sequences");
+        wide_sequences = false;
+    }
+    for (int i=0; i<sync.entry_count; i++) {
+        rebasePort(sync.entries[i].port, sync.entries[i].seq);
     }
 
-    return CODE_SUCCESS;
-}
-
-void RxModule::synchronizeStatus(S3TP_SYNC& sync) {
-    pthread_mutex_lock(&rx_mutex);
-    for (int i=0; i<DEFAULT_MAX_OUT_PORTS; i++) {
-        if (sync.port_seq[i] != 0) {
-            current_port_sequence[i] = sync.port_seq[i];
+    if (sync.isKeepalive()) {
+        //Keepalives are never answered
+        if (statusInterface != NULL) {
+            statusInterface->onSequenceModeOffered(sync.offersWideSequences());
         }
+        pthread_mutex_unlock(&rx_mutex);
+        return CODE_SUCCESS;
     }
-    //TODO: clear useless stuff
-    //Check all queues and remove useless stuff
-    //uint8_t seq1 = sync.tx_global_seq - to_consume_global_seq;
-    //uint8_t seq2 = lastReceivedGlobalSeq - to_consume_global_seq;
-    lastReceivedGlobalSeq = sync.tx_global_seq;
 
     //Notify main module
     LOG_DEBUG("Receiver sequences synchronized correctly");
-    statusInterface->onSynchronization(sync.syncId);
-    pthread_mutex_unlock(&rx_mutex);
-}
-
-bool RxModule::isCompleteMessageForPortAvailable(int port) {
-    //Method is called internally, no need for locks
-    PriorityQueue<S3TP_PACKET*> * q = inBuffer->getQueue(port);
-    q->lock();
-    PriorityQueue_node<S3TP_PACKET*> * node = q->getHead();
-    uint8_t fragment = 0;
-    while (node != NULL) {
-        S3TP_PACKET * pkt = node->element;
-        S3TP_HEADER * hdr = pkt->getHeader();
-        if (hdr->seq_port != (current_port_sequence[port] + fragment)) {
-            //Packet in queue is not the one with highest priority
-            break; //Will return false
-        } else if (hdr->moreFragments() && hdr->getSubSequence() != fragment) {
-            //Current fragment number is not the expected number,
-            // i.e. at least one fragment is missing to complete the message
-            break; //Will return false
-        } else if (!hdr->moreFragments() && hdr->getSubSequence() == fragment) {
-            //Packet is last fragment, message is complete
-            q->unlock();
-            return true;
-        }
-        fragment++;
-        node = node->next;
+    if (statusInterface == NULL) {
+        pthread_mutex_unlock(&rx_mutex);
+        return CODE_SUCCESS;
     }
-    //End of queue reached
-    q->unlock();
-    return false;
+    if (sync.carriesAck()) {
+        statusInterface->onSynchronizationAck(sync.ack_seq);
+    }
+    if (sync.requestsResync()) {
+        //Handled after the ack, which would otherwise restore the baseline being dropped
+        statusInterface->onResyncRequested();
+    }
+    //Handled after the resync, which drops the offer of the restarted side
+    statusInterface->onSequenceModeOffered(sync.offersWideSequences());
+    statusInterface->onSynchronization(sync.syncId, sync.sync_seq);
+    pthread_mutex_unlock(&rx_mutex);
+    return CODE_SUCCESS;
 }
 
 bool RxModule::isNewMessageAvailable() {
     pthread_mutex_lock(&rx_mutex);
-    bool result = !available_messages.empty();
+    bool result = getNextAvailablePort() != available_messages.end();
     pthread_mutex_unlock(&rx_mutex);
 
     return result;
@@ -269,10 +473,17 @@ void RxModule::waitForNextAvailableMessage(pthread_mutex_t * callerMutex) {
     pthread_cond_wait(&available_msg_cond, callerMutex);
 }
 
-char * RxModule::getNextCompleteMessage(uint16_t * len, int * error, uint8_t * port) {
+/**
+ * @param marker  Position of the returned data within its message. On streaming ports, the returned data
+ * may only be a chunk of the message, in which case the marker is needed to make sense of it.
+ */
+char * RxModule::getNextCompleteMessage(uint16_t * len, int * error, uint8_t * port, S3tpStreamMarker * marker) {
     *len = 0;
     *port = 0;
     *error = CODE_SUCCESS;
+    if (marker != NULL) {
+        *marker = STREAM_COMPLETE;
+    }
     if (!isActive()) {
         *error = MODULE_INACTIVE;
         LOG_WARN("RX: Module currently inactive, cannot consume messages");
@@ -287,27 +498,103 @@ char * RxModule::getNextCompleteMessage(uint16_t * len, int * error, uint8_t * p
     }
 
     pthread_mutex_lock(&rx_mutex);
-    std::map<uint8_t, uint8_t>::iterator it = available_messages.begin();
+    std::map<uint8_t, uint8_t>::iterator it = getNextAvailablePort();
+    if (it == available_messages.end()) {
+        //Port was paused or closed in the meantime
+        pthread_mutex_unlock(&rx_mutex);
+        *error = CODE_NO_MESSAGES_AVAILABLE;
+        return NULL;
+    }
     bool messageAssembled = false;
     std::vector<char> assembledData;
-    while (!messageAssembled) {
-        S3TP_PACKET * pkt = inBuffer->getNextPacket(it->first);
-        S3TP_HEADER * hdr = pkt->getHeader();
-        if (hdr->seq_port != current_port_sequence[it->first]) {
+    last_served_port = it->first;
+    ReorderBuffer * buffer = reorder_buffers[it->first];
+    S3TP_REASSEMBLY_STATE& state = reassembly[it->first];
+    if (state.stream_aborted) {
+        //Application has to discard the chunks it received for the message being streamed
+        state.stream_aborted = false;
+        *port = it->first;
+        if (marker != NULL) {
+            *marker = STREAM_ABORT;
+        }
+        if (!isCompleteMessageForPortAvailable(it->first)) {
+            available_messages.erase(it->first);
+        }
+        pthread_mutex_unlock(&rx_mutex);
+        return new char[0];
+    }
+    bool startsMessage = !state.stream_open;
+    bool chunkComplete = false;
+    uint16_t chunkFragments = 0;
+    uint16_t distance = 0;
+    if (state.unordered) {
+        //Complete messages are delivered in the order they were completed, wherever they are in the window
+        distance = sequenceDistance(state.expected_seq, state.ready_messages.front(), wide_sequences);
+        state.ready_messages.pop_front();
+    }
+    while (!messageAssembled && !chunkComplete) {
+        S3TP_PACKET * pkt = state.unordered ? buffer->take(distance++) : buffer->pop();
+        if (pkt == NULL || (!state.unordered && pkt->getPortSequence() != state.expected_seq)) {
             *error = CODE_ERROR_INCONSISTENT_STATE;
             LOG_ERROR("RX: inconsistency between packet sequence port and expected sequence port");
+            available_messages.erase(it->first);
+            resetReassembly(it->first);
+            updateMemoryUsage(it->first);
+            if (state.stream_open) {
+                abortStream(it->first);
+            }
+            pthread_mutex_unlock(&rx_mutex);
+            delete pkt;
             return NULL;
         }
+        S3TP_HEADER * hdr = pkt->getHeader();
         char * end = pkt->getPayload() + (sizeof(char) * hdr->getPduLength());
         assembledData.insert(assembledData.end(), pkt->getPayload(), end);
         *len += hdr->getPduLength();
-        current_port_sequence[it->first]++;
+        if (!state.unordered) {
+            state.expected_seq = nextSequence(state.expected_seq, wide_sequences);
+            state.fragments_present--;
+        }
         if (!hdr->moreFragments()) {
             *port = it->first;
             messageAssembled = true;
-            // Not updating the global sequence right away,
-            // as this will be done after the recv window has been filled
+            if (!state.unordered) {
+                state.last_fragments.pop_front();
+            }
+        } else if (state.streaming) {
+            //Handing out the fragments available so far, the rest of the message follows in further chunks
+            chunkFragments++;
+            chunkComplete = state.fragments_present == 0 || chunkFragments == MAX_STREAM_CHUNK_FRAGMENTS;
+        }
+        delete pkt;
+    }
+    if (state.streaming) {
+        *port = it->first;
+        state.stream_open = !messageAssembled;
+        if (marker != NULL && startsMessage) {
+            *marker = messageAssembled ? STREAM_COMPLETE : STREAM_BEGIN;
+        } else if (marker != NULL) {
+            *marker = messageAssembled ? STREAM_END : STREAM_CONTINUE;
+        }
+    }
+    if (state.unordered) {
+        //Expected sequence only moves once everything before it was delivered
+        for (uint16_t steps = buffer->skipDelivered(); steps > 0; steps--) {
+            state.expected_seq = nextSequence(state.expected_seq, wide_sequences);
+        }
+        state.fragments_present = 0;
+        updateReassembly(it->first);
+        if (!isWaitingForPackets(it->first)) {
+            state.gap_since = 0;
         }
+    } else if (state.stream_open && state.gap_since == 0 && isWaitingForPackets(it->first)) {
+        //Rest of the streamed message has to arrive in time as well
+        state.gap_since = get_monotonic_time_ms();
+    }
+    updateMemoryUsage(it->first);
+    //Acknowledging everything up to the consumed message to the other side
+    if (statusInterface != NULL) {
+        statusInterface->onMessageConsumed(it->first, state.expected_seq);
     }
     //Message was assembled correctly, checking if there are further available messages
     if (isCompleteMessageForPortAvailable(it->first)) {
@@ -317,7 +604,6 @@ char * RxModule::getNextCompleteMessage(uint16_t * len, int * error, uint8_t * p
     } else {
         available_messages.erase(it->first);
     }
-    //Increase global sequence
     pthread_mutex_unlock(&rx_mutex);
     //Copying the entire data array, as vector memory will be released at end of function
     char * data = new char[assembledData.size()];
@@ -325,65 +611,678 @@ char * RxModule::getNextCompleteMessage(uint16_t * len, int * error, uint8_t * p
     return data;
 }
 
-void RxModule::flushQueues() {
-    std::set<int> activeQueues = inBuffer->getActiveQueues();
-    uint8_t pktGlobalSequence;
-    //Will flush only queues which currently hold data
-    for (auto port : activeQueues) {
-        PriorityQueue<S3TP_PACKET*>* queue = inBuffer->getQueue(port);
-        if (queue->isEmpty()) {
-            LOG_DEBUG("WTF????");
-            //TODO: there's some serious error here
+/**
+ * @return  The number of duplicate frames dropped for the port since it was opened.
+ * Packets arriving after they were given up on are not duplicates, see getLateCount.
+ */
+uint32_t RxModule::getDuplicateCount(uint8_t port) {
+    pthread_mutex_lock(&rx_mutex);
+    uint32_t result = duplicate_frames[port & 0x7F];
+    pthread_mutex_unlock(&rx_mutex);
+    return result;
+}
+
+/**
+ * @return  The number of packets dropped for the port since it was opened, because they arrived
+ * after they were given up on. These are also part of the lost packets.
+ */
+uint32_t RxModule::getLateCount(uint8_t port) {
+    pthread_mutex_lock(&rx_mutex);
+    uint32_t result = late_packets[port & 0x7F];
+    pthread_mutex_unlock(&rx_mutex);
+    return result;
+}
+
+/**
+ * @return  The number of packets given up as lost for the port since it was opened.
+ */
+uint32_t RxModule::getLostCount(uint8_t port) {
+    pthread_mutex_lock(&rx_mutex);
+    uint32_t result = lost_packets[port & 0x7F];
+    pthread_mutex_unlock(&rx_mutex);
+    return result;
+}
+
+/**
+ * @return  The current estimate (in ms) of how late out of order packets arrive.
+ */
+uint64_t RxModule::getReorderDelay() {
+    pthread_mutex_lock(&rx_mutex);
+    uint64_t result = reorder_delay;
+    pthread_mutex_unlock(&rx_mutex);
+    return result;
+}
+
+/**
+ * Limits the memory that packets received for a port may use while waiting to be delivered.
+ */
+int RxModule::setPortQuota(uint8_t port, size_t bytes) {
+    return memory_budget->setPortQuota(port, bytes);
+}
+
+void RxModule::setShedPolicy(uint8_t port, RxShedPolicy policy) {
+    pthread_mutex_lock(&rx_mutex);
+    shed_policy[port & 0x7F] = policy;
+    pthread_mutex_unlock(&rx_mutex);
+}
+
+/**
+ * Loads the receive quotas and shed policies of the ports from a file. Each line holds a port,
+ * its quota in bytes and optionally its policy (drop-newest, drop-oldest or refuse). Lines starting with # are ignored.
+ * Ports not listed keep their settings. Nothing is applied if any line is invalid.
+ */
+int RxModule::loadReceivePolicies(const char * path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        LOG_ERROR(std::string("Couldn't open receive policies " + std::string(path)));
+        return CODE_ERROR_POLICY_FILE;
+    }
+
+    std::map<uint8_t, std::pair<size_t, RxShedPolicy>> policies;
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(file, line)) {
+        lineNo++;
+        if (line.empty() || line[0] == '#') {
             continue;
         }
-        S3TP_PACKET * packet = queue->peek();
-        pktGlobalSequence = packet->getHeader()->getGlobalSequence() - to_consume_global_seq;
-        if (pktGlobalSequence >= MAX_REORDERING_WINDOW) {
-            // pktGlobalSequence < glob_seq
-            // Packet is too old, clearing the queue
-            inBuffer->clearQueueForPort((uint8_t) port);
-            //TODO: send error to application
-            continue;
+        std::istringstream stream(line);
+        int port;
+        long long quota;
+        std::string name = "drop-newest";
+        if (!(stream >> port >> quota) || port < 0 || port >= DEFAULT_MAX_IN_PORTS || quota < 0) {
+            LOG_ERROR(std::string("Invalid receive policy in line " + std::to_string(lineNo)));
+            return CODE_ERROR_POLICY_FORMAT;
+        }
+        stream >> name;
+        RxShedPolicy policy;
+        if (name == "drop-newest") {
+            policy = SHED_DROP_NEWEST;
+        } else if (name == "drop-oldest") {
+            policy = SHED_DROP_OLDEST;
+        } else if (name == "refuse") {
+            policy = SHED_REFUSE;
+        } else {
+            LOG_ERROR(std::string("Unknown shed policy " + name + " in line " + std::to_string(lineNo)));
+            return CODE_ERROR_POLICY_FORMAT;
         }
+        policies[(uint8_t)port] = std::make_pair((size_t)quota, policy);
     }
 
-    //Updating current global sequence
-    /*if (highestReceivedGlobalSeq - MAX_REORDERING_WINDOW != to_consume_global_seq) {
-        LOG_INFO("Packets were lost somewhere...");
-    }*/
-    to_consume_global_seq = lastReceivedGlobalSeq;
+    for (auto& entry : policies) {
+        if (entry.second.first > memory_budget->getLimit()) {
+            LOG_ERROR(std::string("Receive quota of port " + std::to_string((int)entry.first)
+                                  + " exceeds the receive budget"));
+            return CODE_ERROR_POLICY_FORMAT;
+        }
+    }
+    for (auto& entry : policies) {
+        setPortQuota(entry.first, entry.second.first);
+        setShedPolicy(entry.first, entry.second.second);
+    }
+    LOG_INFO(std::string("Loaded receive policies for " + std::to_string(policies.size()) + " ports"));
+    return CODE_SUCCESS;
 }
 
-int RxModule::comparePriority(S3TP_PACKET* element1, S3TP_PACKET* element2) {
-    int comp = 0;
-    uint8_t seq1, seq2, offset;
+/**
+ * @return  The packets shed by the port because of its receive budget, since it was opened.
+ */
+S3TP_SHED_STATS RxModule::getShedStats(uint8_t port) {
     pthread_mutex_lock(&rx_mutex);
-
-    offset = current_port_sequence[element1->getHeader()->getPort()];
-    seq1 = element1->getHeader()->seq_port - offset;
-    seq2 = element2->getHeader()->seq_port - offset;
-    if (seq1 < seq2) {
-        comp = -1; //Element 1 is lower, hence has higher priority
-    } else if (seq1 > seq2) {
-        comp = 1; //Element 2 is lower, hence has higher priority
-    }
+    S3TP_SHED_STATS result = shed_stats[port & 0x7F];
     pthread_mutex_unlock(&rx_mutex);
-    return comp;
+    return result;
 }
 
-bool RxModule::isElementValid(S3TP_PACKET * element) {
-    //Not needed for Rx Module. Return true by default
-    return true;
+/**
+ * @return  The memory (in bytes) currently used by received packets, over all ports.
+ */
+size_t RxModule::getMemoryUsage() {
+    return memory_budget->getUsage();
 }
 
-bool RxModule::maximumWindowExceeded(S3TP_PACKET* queueHead, S3TP_PACKET* newElement) {
-    uint8_t offset, headSeq, newSeq;
+/**
+ * Stops handing out messages of a port, e.g. because the application cannot keep up.
+ * Incoming packets for the port are still buffered, within the limits of the reordering window.
+ */
+void RxModule::pausePort(uint8_t port) {
+    pthread_mutex_lock(&rx_mutex);
+    paused_ports.insert(port);
+    pthread_mutex_unlock(&rx_mutex);
+}
 
+void RxModule::resumePort(uint8_t port) {
     pthread_mutex_lock(&rx_mutex);
-    offset = to_consume_global_seq;
-    headSeq = queueHead->getHeader()->getGlobalSequence() - offset;
-    newSeq = newElement->getHeader()->getGlobalSequence() - offset;
+    if (paused_ports.erase(port) > 0 && available_messages.find(port) != available_messages.end()) {
+        //Messages were held back while the port was paused
+        pthread_cond_signal(&available_msg_cond);
+    }
     pthread_mutex_unlock(&rx_mutex);
+}
+
+/*
+ * Internal methods (do not use locking)
+ */
+/**
+ * Maximum distance from the expected port sequence at which packets are accepted.
+ * In narrow mode, larger distances are packets that were already delivered.
+ */
+uint16_t RxModule::getPortWindow() {
+    return wide_sequences ? (uint16_t)REORDER_BUFFER_SLOTS : (uint16_t)MAX_REORDERING_WINDOW;
+}
+
+/**
+ * Moves the expected sequence of a port, keeping the stored packets at their position relative to the new sequence.
+ * Packets that end up behind the new sequence or outside of the window are discarded.
+ */
+void RxModule::rebasePort(uint8_t port, uint16_t sequence) {
+    uint16_t current = reassembly[port].expected_seq;
+    reassembly[port].expected_seq = sequence;
+    //Sender restarted its sequences, so older ones can't be told apart anymore
+    reassembly[port].given_up.clear();
+    if (current != sequence && reassembly[port].stream_open) {
+        abortStream(port);
+    }
+    ReorderBuffer * buffer = reorder_buffers[port];
+    if (buffer == NULL || buffer->isEmpty() || current == sequence) {
+        return;
+    }
+    if (compareSequences(current, sequence, wide_sequences) < 0) {
+        //Sequence moved forward, everything before it will never be delivered
+        buffer->advance(sequenceDistance(current, sequence, wide_sequences));
+    } else {
+        std::vector<S3TP_PACKET *> packets = buffer->drain();
+        for (S3TP_PACKET * pkt : packets) {
+            uint16_t distance = sequenceDistance(sequence, pkt->getPortSequence(), wide_sequences);
+            if (distance >= getPortWindow() || buffer->insert(pkt, distance) != CODE_SUCCESS) {
+                delete pkt;
+            }
+        }
+    }
+    resetReassembly(port);
+    updateMemoryUsage(port);
+    if (isCompleteMessageForPortAvailable(port)) {
+        available_messages[port] = 1;
+        pthread_cond_signal(&available_msg_cond);
+    } else {
+        available_messages.erase(port);
+    }
+}
+
+/**
+ * A message is complete once its last fragment is part of the packets available without gaps.
+ * On streaming ports, any packet available without gaps can be delivered right away.
+ */
+bool RxModule::isCompleteMessageForPortAvailable(int port) {
+    std::map<uint8_t, S3TP_REASSEMBLY_STATE>::iterator it = reassembly.find((uint8_t)port);
+    if (it == reassembly.end()) {
+        return false;
+    }
+    S3TP_REASSEMBLY_STATE& state = it->second;
+    if (state.streaming && (state.fragments_present > 0 || state.stream_aborted)) {
+        return true;
+    }
+    return !state.last_fragments.empty() || !state.ready_messages.empty();
+}
+
+/**
+ * Checks whether all fragments of the message whose first fragment is at the given distance are present.
+ */
+bool RxModule::isMessageComplete(ReorderBuffer * buffer, uint16_t start) {
+    for (uint16_t fragment = 0; fragment < DEFAULT_MAX_FRAGMENTS; fragment++) {
+        S3TP_PACKET * pkt = buffer->peek((uint16_t)(start + fragment));
+        if (pkt == NULL || pkt->getHeader()->getSubSequence() != fragment) {
+            return false;
+        } else if (!pkt->getHeader()->moreFragments()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Extends the packets available without gaps as far as possible, recording the last fragments found.
+ * Each packet is visited once while it is stored, so the cost is constant per packet.
+ */
+void RxModule::updateReassembly(uint8_t port) {
+    ReorderBuffer * buffer = reorder_buffers[port];
+    if (buffer == NULL) {
+        return;
+    }
+    S3TP_REASSEMBLY_STATE& state = reassembly[port];
+    if (state.fragments_present == 0 && !state.stream_open) {
+        discardOrphanFragments(port);
+    }
+    S3TP_PACKET * pkt;
+    while ((pkt = buffer->peek(state.fragments_present)) != NULL) {
+        if (!state.unordered && !pkt->getHeader()->moreFragments()) {
+            state.last_fragments.push_back(pkt->getPortSequence());
+        }
+        state.fragments_present++;
+    }
+}
+
+/**
+ * Drops the fragments at the expected sequence which don't start a message. Their message was given up on
+ * (see skipGap), or the expected sequence was moved into it, so they could only be delivered as a corrupt message.
+ */
+void RxModule::discardOrphanFragments(uint8_t port) {
+    ReorderBuffer * buffer = reorder_buffers[port];
+    S3TP_REASSEMBLY_STATE& state = reassembly[port];
+    uint16_t dropped = 0;
+    S3TP_PACKET * pkt;
+    while ((pkt = buffer->peek(0)) != NULL && pkt->getHeader()->getSubSequence() != 0) {
+        buffer->advance(1);
+        state.expected_seq = nextSequence(state.expected_seq, wide_sequences);
+        dropped++;
+    }
+    if (dropped == 0) {
+        return;
+    }
+    LOG_DEBUG(std::string("RX: Discarded " + std::to_string(dropped) + " fragments of a message given up on for port "
+                          + std::to_string((int)port)));
+    updateMemoryUsage(port);
+    if (statusInterface != NULL) {
+        statusInterface->onMessageConsumed(port, state.expected_seq);
+    }
+}
+
+/**
+ * Whether packets of a port are missing: either some were received after a missing one,
+ * or the last available message still lacks its last fragments.
+ */
+bool RxModule::isWaitingForPackets(uint8_t port) {
+    ReorderBuffer * buffer = reorder_buffers[port];
+    S3TP_REASSEMBLY_STATE& state = reassembly[port];
+    if (buffer == NULL) {
+        return false;
+    }
+    if (buffer->getReceivedCount() > state.fragments_present) {
+        return true;
+    }
+    if (state.fragments_present == 0) {
+        //Streamed message was handed out up to its last available fragment
+        return state.stream_open;
+    }
+    S3TP_PACKET * last = buffer->peek((uint16_t)(state.fragments_present - 1));
+    return last != NULL && last->getHeader()->moreFragments();
+}
+
+/**
+ * The message being streamed on a port will not be completed.
+ * The application is notified with an empty chunk, so that it can discard the chunks it already received.
+ */
+void RxModule::abortStream(uint8_t port) {
+    S3TP_REASSEMBLY_STATE& state = reassembly[port];
+    LOG_WARN(std::string("RX: Aborted message being streamed on port " + std::to_string((int)port)));
+    state.stream_open = false;
+    state.stream_aborted = true;
+    available_messages[port] = 1;
+    pthread_cond_signal(&available_msg_cond);
+}
+
+/**
+ * Recomputes the reassembly state of a port from scratch, after its buffer was modified in bulk.
+ */
+void RxModule::resetReassembly(uint8_t port) {
+    S3TP_REASSEMBLY_STATE& state = reassembly[port];
+    state.fragments_present = 0;
+    state.last_fragments.clear();
+    state.ready_messages.clear();
+    updateReassembly(port);
+    ReorderBuffer * buffer = reorder_buffers[port];
+    if (buffer != NULL && state.unordered) {
+        //Looking for complete messages anywhere in the window
+        for (uint16_t d = buffer->findOccupied(0); d < REORDER_BUFFER_SLOTS; d = buffer->findOccupied((uint16_t)(d + 1))) {
+            S3TP_PACKET * pkt = buffer->peek(d);
+            if (pkt != NULL && pkt->getHeader()->getSubSequence() == 0 && isMessageComplete(buffer, d)) {
+                state.ready_messages.push_back(pkt->getPortSequence());
+            }
+        }
+    }
+    if (!isWaitingForPackets(port)) {
+        state.gap_since = 0;
+    } else if (state.gap_since == 0) {
+        state.gap_since = getGapStart(port, get_monotonic_time_ms());
+    }
+}
+
+/**
+ * Gap after the available packets has been there since the first packet following it arrived,
+ * not since the previous gap was closed or skipped.
+ */
+uint64_t RxModule::getGapStart(uint8_t port, uint64_t now) {
+    ReorderBuffer * buffer = reorder_buffers[port];
+    S3TP_PACKET * first = buffer->peek(buffer->findOccupied(reassembly[port].fragments_present));
+    return (first != NULL && first->timestamp != 0) ? std::min(first->timestamp, now) : now;
+}
 
-    return abs(newSeq - headSeq) > MAX_REORDERING_WINDOW;
-}
\ No newline at end of file
+uint64_t RxModule::getGapTimeout(bool arq) {
+    uint64_t timeout = GAP_TIMEOUT_FACTOR * reorder_delay;
+    if (arq) {
+        timeout *= ARQ_GAP_TIMEOUT_FACTOR;
+    }
+    return std::max((uint64_t)MIN_GAP_TIMEOUT, std::min(timeout, (uint64_t)MAX_GAP_TIMEOUT));
+}
+
+void RxModule::checkGapTimers(uint64_t now) {
+    for (auto& entry : open_ports) {
+        S3TP_REASSEMBLY_STATE& state = reassembly[entry.first];
+        if (state.gap_since != 0 && !isCompleteMessageForPortAvailable(entry.first)
+            && now - state.gap_since >= getGapTimeout(state.arq)) {
+            //Complete messages before the gap are delivered first, so only incomplete data is skipped
+            skipGap(entry.first);
+        }
+    }
+}
+
+/**
+ * Gives up on the packets missing after the ones available without gaps.
+ * The incomplete message they belong to is discarded, and reception resumes with the next message
+ * that starts after the gap. Complete messages found there become available right away.
+ * Fragments of the discarded message arriving later on are dropped (see discardOrphanFragments).
+ */
+void RxModule::skipGap(uint8_t port) {
+    ReorderBuffer * buffer = reorder_buffers[port];
+    S3TP_REASSEMBLY_STATE& state = reassembly[port];
+    if (!isWaitingForPackets(port)) {
+        //Gap was closed in the meantime
+        state.gap_since = 0;
+        return;
+    }
+    uint16_t next = buffer->findOccupied(state.fragments_present);
+    if (next >= REORDER_BUFFER_SLOTS) {
+        //Nothing was received after the last available message, which is missing its last fragments
+        lost_packets[port]++;
+        LOG_WARN(std::string("RX: Gave up on the last fragments of a message for port " + std::to_string((int)port)
+                             + " after " + std::to_string(get_monotonic_time_ms() - state.gap_since) + " ms, "
+                             + std::to_string(state.fragments_present) + " packets discarded"));
+        discardPackets(port, state.fragments_present);
+        return;
+    }
+    uint16_t last = next;
+    //Packets right after the gap might still belong to the message that spans it
+    //Positions of packets delivered out of order always start a message
+    while (next < REORDER_BUFFER_SLOTS && buffer->peek(next) != NULL
+           && buffer->peek(next)->getHeader()->getSubSequence() != 0) {
+        last = next;
+        next = buffer->findOccupied((uint16_t)(next + 1));
+    }
+    uint16_t skip = (next < REORDER_BUFFER_SLOTS) ? next : (uint16_t)(last + 1);
+    uint16_t discarded = 0;
+    for (uint16_t d = buffer->findOccupied(0); d < skip; d = buffer->findOccupied((uint16_t)(d + 1))) {
+        discarded++;
+    }
+    uint16_t lost = skip - discarded;
+    lost_packets[port] += lost;
+    LOG_WARN(std::string("RX: Gave up on " + std::to_string(lost) + " missing packets for port "
+                         + std::to_string((int)port) + " after "
+                         + std::to_string(get_monotonic_time_ms() - state.gap_since) + " ms, "
+                         + std::to_string(discarded) + " packets of incomplete messages discarded"));
+
+    discardPackets(port, skip);
+}
+
+/**
+ * Moves the expected sequence of a port forward by the given amount of positions, deleting the packets stored there.
+ * Reception resumes with the packets following them.
+ */
+void RxModule::discardPackets(uint8_t port, uint16_t steps) {
+    ReorderBuffer * buffer = reorder_buffers[port];
+    S3TP_REASSEMBLY_STATE& state = reassembly[port];
+    uint16_t seq = state.expected_seq;
+    for (uint16_t i = 0; i < steps; i++) {
+        if (!buffer->contains(i)) {
+            state.given_up.insert(seq);
+        }
+        seq = nextSequence(seq, wide_sequences);
+    }
+    buffer->advance(steps);
+    steps += buffer->skipDelivered();
+    if (state.stream_open) {
+        //Remaining fragments of the message being streamed were discarded
+        abortStream(port);
+    }
+    for (uint16_t i = 0; i < steps; i++) {
+        state.expected_seq = nextSequence(state.expected_seq, wide_sequences);
+    }
+    //Packets further behind are dropped as duplicates anyway
+    for (std::set<uint16_t>::iterator it = state.given_up.begin(); it != state.given_up.end();) {
+        if (sequenceDistance(*it, state.expected_seq, wide_sequences) > getPortWindow()) {
+            it = state.given_up.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    state.gap_since = 0;
+    resetReassembly(port);
+    updateMemoryUsage(port);
+    //Sender does not need to keep the discarded packets
+    if (statusInterface != NULL) {
+        statusInterface->onMessageConsumed(port, state.expected_seq);
+    }
+    if (isCompleteMessageForPortAvailable(port)) {
+        available_messages[port] = 1;
+        pthread_cond_signal(&available_msg_cond);
+    }
+}
+
+/**
+ * Charges the memory of an incoming packet to its port. If the receive budget is exhausted,
+ * packets are shed according to the policy of the port.
+ * @return  CODE_SUCCESS if the packet can be buffered, CODE_ERROR_RECEIVE_BUDGET_EXCEEDED if it must be dropped.
+ */
+int RxModule::admitPacket(uint8_t port, S3TP_PACKET * packet) {
+    size_t footprint = ReorderBuffer::getFootprint(packet);
+    S3TP_SHED_STATS& stats = shed_stats[port];
+    if (refusing_ports.find(port) != refusing_ports.end() && packet->getHeader()->getSubSequence() == 0) {
+        //Port is draining, only fragments of messages already started are accepted
+        stats.refused++;
+        return CODE_ERROR_RECEIVE_BUDGET_EXCEEDED;
+    }
+    if (memory_budget->reserve(port, footprint)) {
+        return CODE_SUCCESS;
+    }
+    if (memory_budget->getPortUsage(port) + footprint > memory_budget->getPortQuota(port)) {
+        stats.port_quota_exceeded++;
+    } else {
+        stats.global_limit_exceeded++;
+    }
+
+    switch (shed_policy[port]) {
+        case SHED_DROP_OLDEST:
+            for (uint16_t shed = shedOldestMessage(port); shed > 0; shed = shedOldestMessage(port)) {
+                stats.dropped_oldest += shed;
+                if (compareSequences(packet->getPortSequence(), reassembly[port].expected_seq, wide_sequences) < 0) {
+                    //Incoming packet belonged to the messages that were just shed, it was never buffered
+                    stats.dropped_newest++;
+                    return CODE_ERROR_RECEIVE_BUDGET_EXCEEDED;
+                }
+                if (memory_budget->reserve(port, footprint)) {
+                    return CODE_SUCCESS;
+                }
+            }
+            //Port holds nothing that could make room, the budget is used by other ports
+            stats.dropped_newest++;
+            return CODE_ERROR_RECEIVE_BUDGET_EXCEEDED;
+        case SHED_REFUSE:
+            if (refusing_ports.insert(port).second) {
+                LOG_WARN(std::string("RX: Receive budget exhausted, port " + std::to_string((int)port)
+                                     + " refuses new messages until it drained"));
+            }
+            stats.refused++;
+            return CODE_ERROR_RECEIVE_BUDGET_EXCEEDED;
+        default:
+            stats.dropped_newest++;
+            return CODE_ERROR_RECEIVE_BUDGET_EXCEEDED;
+    }
+}
+
+/**
+ * Drops the buffered message closest to the expected sequence, together with any missing packets before it.
+ * @return  The amount of packets dropped, 0 if the port has no packets buffered.
+ */
+uint16_t RxModule::shedOldestMessage(uint8_t port) {
+    ReorderBuffer * buffer = reorder_buffers[port];
+    uint16_t first = buffer->findOccupied(0);
+    //Positions of packets delivered out of order hold no memory
+    while (first < REORDER_BUFFER_SLOTS && buffer->peek(first) == NULL) {
+        first = buffer->findOccupied((uint16_t)(first + 1));
+    }
+    if (first >= REORDER_BUFFER_SLOTS) {
+        return 0;
+    }
+    uint16_t last = first;
+    uint16_t next = buffer->findOccupied((uint16_t)(first + 1));
+    while (next < REORDER_BUFFER_SLOTS && buffer->peek(next) != NULL
+           && buffer->peek(next)->getHeader()->getSubSequence() != 0) {
+        last = next;
+        next = buffer->findOccupied((uint16_t)(next + 1));
+    }
+    uint16_t end = (next < REORDER_BUFFER_SLOTS) ? next : (uint16_t)(last + 1);
+    uint16_t received = 0;
+    uint16_t dropped = 0;
+    for (uint16_t d = buffer->findOccupied(0); d < end; d = buffer->findOccupied((uint16_t)(d + 1))) {
+        received++;
+        if (buffer->peek(d) != NULL) {
+            dropped++;
+        }
+    }
+    lost_packets[port] += end - received;
+    LOG_WARN(std::string("RX: Receive budget exhausted, dropped " + std::to_string(dropped)
+                         + " packets of the oldest message of port " + std::to_string((int)port)));
+    discardPackets(port, end);
+    return dropped;
+}
+
+/**
+ * Gives back to the budget the memory of the packets that left the buffer of a port.
+ */
+void RxModule::updateMemoryUsage(uint8_t port) {
+    ReorderBuffer * buffer = reorder_buffers[port];
+    size_t size = (buffer != NULL) ? buffer->getSize() : 0;
+    size_t usage = memory_budget->getPortUsage(port);
+    if (usage > size) {
+        memory_budget->release(port, usage - size);
+    }
+    if (size <= memory_budget->getPortQuota(port) / 2 && refusing_ports.erase(port) > 0) {
+        LOG_INFO(std::string("RX: Port " + std::to_string((int)port) + " accepts new messages again"));
+    }
+}
+
+/**
+ * Ports with available messages are served round robin, skipping paused ports.
+ * @return  The entry of the next port to be served, or the end of available_messages if there is none.
+ */
+std::map<uint8_t, uint8_t>::iterator RxModule::getNextAvailablePort() {
+    std::map<uint8_t, uint8_t>::iterator it = available_messages.upper_bound(last_served_port);
+    for (size_t i = 0; i < available_messages.size(); i++, it++) {
+        if (it == available_messages.end()) {
+            it = available_messages.begin();
+        }
+        if (paused_ports.find(it->first) == paused_ports.end()) {
+            return it;
+        }
+    }
+    return available_messages.end();
+}
+
+int RxModule::bufferPacket(S3TP_PACKET * packet, uint64_t now) {
+    S3TP_HEADER * hdr = packet->getHeader();
+    uint8_t port = hdr->getPort();
+    if (!active) {
+        delete packet;
+        return MODULE_INACTIVE;
+    }
+    ReorderBuffer * buffer = reorder_buffers[port];
+    if (open_ports.find(port) == open_ports.end() || buffer == NULL) {
+        //Dropping packet right away
+        LOG_INFO(std::string("Incoming packet " + std::to_string(packet->getGlobalSequence())
+                             + "for port " + std::to_string(port)
+                             + " was dropped because port is closed"));
+        delete packet;
+        return CODE_ERROR_PORT_CLOSED;
+    }
+    if (hdr->hasWideSequences() && !wide_sequences) {
+        LOG_INFO("RX: Other side switched to wide sequences");
+        wide_sequences = true;
+    } else if (!hdr->hasWideSequences() && wide_sequences) {
+        //Sequence mode holds for the whole session, only a restart of the other side switches it back
+        LOG_DEBUG(std::string("RX: Dropped narrow packet for port " + std::to_string((int)port)
+                              + " of a wide sequences session"));
+        delete packet;
+        return CODE_ERROR_OUT_OF_WINDOW;
+    }
+
+    S3TP_REASSEMBLY_STATE& state = reassembly[port];
+    uint16_t distance = sequenceDistance(state.expected_seq, packet->getPortSequence(), wide_sequences);
+    int result;
+    bool late = false;
+    if (compareSequences(packet->getPortSequence(), state.expected_seq, wide_sequences) < 0
+        && state.given_up.erase(packet->getPortSequence()) > 0) {
+        //Packet was given up on before it arrived
+        result = CODE_ERROR_DUPLICATE_PACKET;
+        late = true;
+        late_packets[port]++;
+    } else if (compareSequences(packet->getPortSequence(), state.expected_seq, wide_sequences) < 0
+        || buffer->contains(distance)) {
+        //Packet was already delivered or is already buffered, e.g. after a link layer retransmission
+        result = CODE_ERROR_DUPLICATE_PACKET;
+        duplicate_frames[port]++;
+    } else if (distance >= getPortWindow()) {
+        result = CODE_ERROR_OUT_OF_WINDOW;
+    } else if ((result = admitPacket(port, packet)) == CODE_SUCCESS) {
+        //Oldest messages may have been shed to make room, moving the expected sequence
+        distance = sequenceDistance(state.expected_seq, packet->getPortSequence(), wide_sequences);
+        packet->timestamp = now;
+        result = buffer->insert(packet, distance);
+        if (result != CODE_SUCCESS) {
+            //Giving back the memory charged for the packet
+            updateMemoryUsage(port);
+        }
+    }
+    if (result != CODE_SUCCESS) {
+        const char * reason = late ? "late" : (result == CODE_ERROR_DUPLICATE_PACKET) ? "duplicate"
+                              : (result == CODE_ERROR_RECEIVE_BUDGET_EXCEEDED) ? "over budget" : "out of window";
+        LOG_DEBUG(std::string("RX: Dropped " + std::string(reason)
+                              + " packet for port " + std::to_string((int)port)
+                              + " -> port_seq " + std::to_string((int)packet->getPortSequence())));
+        delete packet;
+        return result;
+    }
+
+    LOG_DEBUG(std::string("RX: Packet received from SPI to port "
+                          + std::to_string((int)port)
+                          + " -> glob_seq " + std::to_string((int)packet->getGlobalSequence())
+                          + ", sub_seq " + std::to_string((int)hdr->getSubSequence())
+                          + ", port_seq " + std::to_string((int)packet->getPortSequence())));
+
+    state.arq = (packet->options & S3TP_OPTION_ARQ) != 0;
+    uint8_t subSequence = hdr->getSubSequence();
+    if (state.unordered && subSequence <= distance && isMessageComplete(buffer, distance - subSequence)) {
+        //Packet completes a message, which can be delivered without waiting for previous ones
+        state.ready_messages.push_back(buffer->peek(distance - subSequence)->getPortSequence());
+    }
+    if (distance == state.fragments_present) {
+        //Packet closes the gap after the available packets
+        bool overtaken = buffer->getReceivedCount() > state.fragments_present + 1;
+        updateReassembly(port);
+        if (state.gap_since != 0) {
+            if (overtaken) {
+                //Time the missing packet was late by is a sample of the reordering delay
+                reorder_delay = (7 * reorder_delay + (now - state.gap_since)) / 8;
+            }
+            state.gap_since = 0;
+        }
+    }
+    if (state.gap_since == 0 && isWaitingForPackets(port)) {
+        //Some packet is missing before the ones just buffered, or the message is not complete yet
+        state.gap_since = getGapStart(port, now);
+    }
+    if (isCompleteMessageForPortAvailable(port)) {
+        //New message is available, notify
+        available_messages[port] = 1;
+        pthread_cond_signal(&available_msg_cond);
+    }
+    return CODE_SUCCESS;
+}
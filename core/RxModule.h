@@ -5,12 +5,18 @@
 #ifndef S3TP_RXMODULE_H
 #define S3TP_RXMODULE_H
 
-#include "Buffer.h"
+#include "ReorderBuffer.h"
+#include "RingBuffer.h"
+#include "MemoryBudget.h"
 #include "Constants.h"
 #include "utilities.h"
 #include "StatusInterface.h"
+#include "SerialNumber.h"
 #include <cstring>
 #include <map>
+#include <deque>
+#include <set>
+#include <atomic>
 #include <vector>
 #include <trctrl/LinkCallback.h>
 
@@ -21,12 +27,104 @@
 #define CODE_NO_MESSAGES_AVAILABLE -4
 #define CODE_ERROR_PORT_CLOSED -5
 #define CODE_ERROR_INCONSISTENT_STATE -6
+//Kept apart from the error codes of S3tpShared.h and ReorderBuffer.h
+#define CODE_ERROR_RECEIVE_BUDGET_EXCEEDED -22
 
+//Maximum distance from the expected port sequence of buffered packets (with 8 bit sequences)
 #define MAX_REORDERING_WINDOW 128
-#define RECEIVING_WINDOW_SIZE 128
 
-class RxModule: public Transceiver::LinkCallback,
-                        PolicyActor<S3TP_PACKET*> {
+//A missing packet is given up after GAP_TIMEOUT_FACTOR times the observed reordering delay (in ms)
+#define GAP_TIMEOUT_FACTOR 4
+#define MIN_GAP_TIMEOUT 50
+#define MAX_GAP_TIMEOUT 10000
+#define DEFAULT_REORDER_DELAY 100
+//Frames on ARQ channels may still be retransmitted by the link layer, so their gaps are given more time
+#define ARQ_GAP_TIMEOUT_FACTOR 4
+#define GAP_CHECK_INTERVAL 20
+
+//Frames that can be queued between the transceiver thread and the ingress thread. Must be a power of 2
+#define INGRESS_RING_CAPACITY 256
+//Maximum frames processed by the ingress thread per lock acquisition
+#define INGRESS_BATCH_SIZE 32
+
+//Maximum fragments delivered in a single chunk on streaming ports
+#define MAX_STREAM_CHUNK_FRAGMENTS 16
+
+//Memory (in bytes) that received packets may use while waiting to be delivered, in total and per port
+#define DEFAULT_RX_MEMORY_BUDGET (8 * 1024 * 1024)
+#define DEFAULT_RX_PORT_QUOTA (1024 * 1024)
+
+/**
+ * What a port does with incoming packets once its receive budget is exhausted.
+ * SHED_DROP_NEWEST: the incoming packet is dropped.
+ * SHED_DROP_OLDEST: the oldest messages buffered for the port are dropped, until the incoming packet fits.
+ * SHED_REFUSE: the incoming packet is dropped, and the port refuses to start new messages until
+ * it used up to half of its quota, so that the remaining memory goes to completing the messages in flight.
+ */
+enum RxShedPolicy : uint8_t {
+    SHED_DROP_NEWEST = 0,
+    SHED_DROP_OLDEST = 1,
+    SHED_REFUSE = 2
+};
+
+/**
+ * Packets shed by a port because of its receive budget, and why.
+ */
+typedef struct tag_s3tp_shed_stats {
+    uint32_t dropped_newest; //Incoming packets dropped
+    uint32_t dropped_oldest; //Buffered packets dropped to make room for incoming ones
+    uint32_t refused; //Incoming packets refused while the port was draining
+    uint32_t port_quota_exceeded; //Times the quota of the port was exhausted
+    uint32_t global_limit_exceeded; //Times the global limit was exhausted, while the port was within its quota
+
+    tag_s3tp_shed_stats() {
+        dropped_newest = 0;
+        dropped_oldest = 0;
+        refused = 0;
+        port_quota_exceeded = 0;
+        global_limit_exceeded = 0;
+    }
+}S3TP_SHED_STATS;
+
+/**
+ * Raw frame, as received from the transceiver.
+ */
+typedef struct tag_s3tp_ingress_frame {
+    bool arq;
+    int channel;
+    int length;
+    char data[MAX_LEN_S3TP_FRAME];
+}S3TP_INGRESS_FRAME;
+
+/**
+ * Reassembly progress of the incoming messages of a port, updated as packets arrive.
+ */
+typedef struct tag_s3tp_reassembly_state {
+    uint16_t expected_seq; //Port sequence of the next packet to be delivered
+    uint16_t fragments_present; //Packets available without gaps, starting from expected_seq
+    std::deque<uint16_t> last_fragments; //Port sequences of the last fragments found within those packets
+    uint64_t gap_since; //Time at which packets started waiting for a missing one, 0 if there is no gap
+    bool arq; //Whether the packets of the port are received on an ARQ channel
+    bool unordered; //Whether messages are delivered as soon as they are complete, regardless of their order
+    std::deque<uint16_t> ready_messages; //Port sequences of the first fragments of complete messages (unordered only)
+    bool streaming; //Whether messages are delivered in chunks, as their fragments become available in order
+    bool stream_open; //Whether the first chunks of the message at expected_seq were already delivered (streaming only)
+    bool stream_aborted; //Whether the application must be told that the open message will not be completed
+    std::set<uint16_t> given_up; //Port sequences of missing packets that were given up on, in case they still arrive
+
+    tag_s3tp_reassembly_state() {
+        expected_seq = 0;
+        fragments_present = 0;
+        gap_since = 0;
+        arq = false;
+        unordered = false;
+        streaming = false;
+        stream_open = false;
+        stream_aborted = false;
+    }
+}S3TP_REASSEMBLY_STATE;
+
+class RxModule: public Transceiver::LinkCallback {
 public:
     RxModule();
     ~RxModule();
@@ -34,39 +132,89 @@ public:
     void setStatusInterface(StatusInterface * statusInterface);
     void startModule();
     void stopModule();
-    int openPort(uint8_t port);
+    int openPort(uint8_t port, uint8_t options = 0);
     int closePort(uint8_t port);
     bool isActive();
     bool isNewMessageAvailable();
     void waitForNextAvailableMessage(pthread_mutex_t * callerMutex);
-    char * getNextCompleteMessage(uint16_t * len, int * error, uint8_t * port);
-    virtual int comparePriority(S3TP_PACKET* element1, S3TP_PACKET* element2);
-    virtual bool isElementValid(S3TP_PACKET * element);
-    virtual bool maximumWindowExceeded(S3TP_PACKET* queueHead, S3TP_PACKET* newElement);
+    char * getNextCompleteMessage(uint16_t * len, int * error, uint8_t * port, S3tpStreamMarker * marker = NULL);
+    void pausePort(uint8_t port);
+    uint32_t getDuplicateCount(uint8_t port);
+    uint32_t getLateCount(uint8_t port);
+    uint32_t getIngressOverflowCount();
+    uint32_t getLostCount(uint8_t port);
+    uint64_t getReorderDelay();
+    int setPortQuota(uint8_t port, size_t bytes);
+    void setShedPolicy(uint8_t port, RxShedPolicy policy);
+    int loadReceivePolicies(const char * path);
+    S3TP_SHED_STATS getShedStats(uint8_t port);
+    size_t getMemoryUsage();
+    void resumePort(uint8_t port);
     void reset();
 private:
     bool active;
-    Buffer * inBuffer;
-    uint8_t to_consume_global_seq;
-    uint8_t receiving_window;
-    uint8_t lastReceivedGlobalSeq;
+    ReorderBuffer * reorder_buffers[DEFAULT_MAX_IN_PORTS];
+    uint64_t reorder_delay;
+    //Sequence mode of the session, shared by all ports
+    bool wide_sequences;
     pthread_mutex_t rx_mutex;
     pthread_cond_t available_msg_cond;
 
     StatusInterface * statusInterface;
+
+    //Ingress
+    RingBuffer<S3TP_INGRESS_FRAME, INGRESS_RING_CAPACITY> * ingress_ring;
+    std::atomic<uint32_t> ingress_overflows;
+    std::atomic<bool> ingress_sleeping;
+    bool ingress_running;
+    pthread_t ingress_thread;
+    pthread_mutex_t ingress_mutex;
+    pthread_cond_t ingress_cond;
+    void ingressRoutine();
+    void discardIngressFrames();
+    static void * staticIngressRoutine(void * args);
+    S3TP_PACKET * decodeFrame(bool arq, int channel, const char * data, int length);
+    void handleSyncPacket(S3TP_PACKET * packet);
+    void bufferPackets(std::vector<S3TP_PACKET *>& packets);
     std::map<uint8_t, uint8_t> open_ports;
-    std::map<uint8_t, uint8_t> current_port_sequence;
+    std::map<uint8_t, S3TP_REASSEMBLY_STATE> reassembly;
     std::map<uint8_t, uint8_t> available_messages;
+    std::set<uint8_t> paused_ports;
+    uint8_t last_served_port;
+    uint32_t duplicate_frames[DEFAULT_MAX_IN_PORTS];
+    uint32_t lost_packets[DEFAULT_MAX_IN_PORTS];
+    uint32_t late_packets[DEFAULT_MAX_IN_PORTS];
+    MemoryBudget * memory_budget;
+    RxShedPolicy shed_policy[DEFAULT_MAX_IN_PORTS];
+    S3TP_SHED_STATS shed_stats[DEFAULT_MAX_IN_PORTS];
+    std::set<uint8_t> refusing_ports;
 
     // LinkCallback
     void handleFrame(bool arq, int channel, const void* data, int length);
-    int handleReceivedPacket(S3TP_PACKET * packet);
+    void handleAcknowledgements(const char * data, int length);
     virtual void handleBufferEmpty(int channel);
-    void synchronizeStatus(S3TP_SYNC& sync);
+    int synchronizeStatus(S3TP_SYNC& sync);
     void handleLinkStatus(bool linkStatus);
     bool isPortOpen(uint8_t port);
+    void rebasePort(uint8_t port, uint16_t sequence);
     bool isCompleteMessageForPortAvailable(int port);
-    void flushQueues();
+    bool isMessageComplete(ReorderBuffer * buffer, uint16_t start);
+    void updateReassembly(uint8_t port);
+    void resetReassembly(uint8_t port);
+    void checkGapTimers(uint64_t now);
+    void skipGap(uint8_t port);
+    void discardOrphanFragments(uint8_t port);
+    bool isWaitingForPackets(uint8_t port);
+    void discardPackets(uint8_t port, uint16_t steps);
+    int admitPacket(uint8_t port, S3TP_PACKET * packet);
+    uint16_t shedOldestMessage(uint8_t port);
+    void updateMemoryUsage(uint8_t port);
+    void abortStream(uint8_t port);
+    uint64_t getGapTimeout(bool arq);
+    uint64_t getGapStart(uint8_t port, uint64_t now);
+    uint16_t getPortWindow();
+    std::map<uint8_t, uint8_t>::iterator getNextAvailablePort();
+    int bufferPacket(S3TP_PACKET * packet, uint64_t now);
     //void consumeQueue(uint8_t port);
 };
 
@@ -19,14 +19,7 @@ S3TP::~S3TP() {
     }
 
     pthread_cond_destroy(&assembly_cond);
-    std::map<uint8_t, Client*>::iterator it;
-    pthread_mutex_lock(&clients_mutex);
-    while ((it = clients.begin()) != clients.end()) {
-        pthread_mutex_unlock(&clients_mutex);
-        it->second->kill();
-        pthread_mutex_lock(&clients_mutex);
-    }
-    pthread_mutex_unlock(&clients_mutex);
+    //Clients are owned and closed by the reactor
     pthread_mutex_destroy(&clients_mutex);
     pthread_mutex_unlock(&s3tp_mutex);
     pthread_mutex_destroy(&s3tp_mutex);
@@ -51,6 +44,7 @@ int S3TP::init(TRANSCEIVER_CONFIG * config) {
     }
 
     rx.setStatusInterface(this);
+    tx.setStatusInterface(this);
     pthread_mutex_unlock(&s3tp_mutex);
 
     transceiver->start();
@@ -67,6 +61,45 @@ int S3TP::init(TRANSCEIVER_CONFIG * config) {
     return CODE_SUCCESS;
 }
 
+/**
+ * Loads the contact windows used for planning transmissions. Can be called before or after init.
+ */
+int S3TP::loadContactSchedule(const char * path) {
+    return tx.loadContactSchedule(path);
+}
+
+/**
+ * Loads the receive quotas and shed policies of the ports (see RxModule::loadReceivePolicies).
+ * Can be called before or after init.
+ */
+int S3TP::loadReceivePolicies(const char * path) {
+    return rx.loadReceivePolicies(path);
+}
+
+/**
+ * Loads the transmit quotas and reservations of the ports (see TxModule::loadTransmitPolicies).
+ * Can be called before or after init.
+ */
+int S3TP::loadTransmitPolicies(const char * path) {
+    return tx.loadTransmitPolicies(path);
+}
+
+/**
+ * Sets the time (in ms) acknowledgements may wait for a data frame to piggyback on.
+ */
+void S3TP::setAcknowledgementDelay(uint64_t delay) {
+    tx.setAcknowledgementDelay(delay);
+}
+
+/**
+ * Allows using 16 bit sequences on this session, if the other side supports them as well.
+ * Wide sequences allow much more packets to be in flight, at the cost of 2 bytes per frame.
+ * Has to be called before init, the sequence mode cannot change during a session.
+ */
+void S3TP::setWideSequencesEnabled(bool enabled) {
+    tx.setWideSequencesEnabled(enabled);
+}
+
 int S3TP::stop() {
     //Deactivating module
     pthread_mutex_lock(&s3tp_mutex);
@@ -89,48 +122,35 @@ int S3TP::stop() {
     return CODE_SUCCESS;
 }
 
-void S3TP::synchronizeStatus(uint8_t syncId) {
+void S3TP::synchronizeStatus(uint8_t syncId, uint8_t peerSyncSeq) {
     pthread_mutex_lock(&clients_mutex);
     //Sending a sync message only if we have at least one open port, otherwise it's meaningless
     if (clients.size() > 0) {
-        tx.scheduleSync(syncId);
+        tx.scheduleSync(syncId, peerSyncSeq);
     }
     pthread_mutex_unlock(&clients_mutex);
 }
 
-Client * S3TP::getClientConnectedToPort(uint8_t port) {
+ClientPort * S3TP::getClientConnectedToPort(uint8_t port) {
     pthread_mutex_lock(&clients_mutex);
-    std::map<uint8_t, Client *>::iterator it = clients.find(port);
+    std::map<uint8_t, ClientPort *>::iterator it = clients.find(port);
     if (it == clients.end()) {
         pthread_mutex_unlock(&clients_mutex);
         return NULL;
     }
-    Client * cli = it->second;
+    ClientPort * cli = it->second;
     pthread_mutex_unlock(&clients_mutex);
     return cli;
 }
 
-void S3TP::cleanupClients() {
-    pthread_mutex_lock(&clients_mutex);
-    for (auto const& port: disconnectedClients) {
-        Client * cli = clients[port];
-        //Client disconnected from port. Mark that port as available again.
-        if (cli != nullptr) {
-            clients.erase(cli->getAppPort());
-            cli->kill();
-            delete cli;
-        }
-    }
-    disconnectedClients.clear();
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-int S3TP::sendToLinkLayer(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts) {
+int S3TP::sendToLinkLayer(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts, uint8_t priority,
+                          uint32_t messageId) {
     /* As messages should still be sent out sequentially.
      * There is not need for a separate fragmentation thread, as the
      * job will simply be done by the calling client thread.
      * We first check whether the message can actually be enqueued.
-     * If queue is full or link is not active, the message is not accepted and an error is returned.
+     * If the memory budget is exhausted or link is not active, the message is not accepted and an error is returned.
+     * Once accepted, the memory for the whole message is already charged to the port.
      * */
     int availability;
 
@@ -138,47 +158,58 @@ int S3TP::sendToLinkLayer(uint8_t channel, uint8_t port, void * data, size_t len
     bool isActive = active;
     pthread_mutex_unlock(&s3tp_mutex);
     if (isActive) {
-        availability = checkTransmissionAvailability(port, channel, (uint16_t)len);
-        if (availability != CODE_SUCCESS) {
-            return availability;
-        }
         if (len > MAX_PDU_LENGTH) {
             //Payload exceeds maximum length: drop packet and return error
             return CODE_ERROR_MAX_MESSAGE_SIZE;
-        } else if (len > LEN_S3TP_PDU) {
+        }
+        availability = checkTransmissionAvailability(port, channel, len, opts);
+        if (availability != CODE_SUCCESS) {
+            return availability;
+        }
+        if (len > LEN_S3TP_PDU) {
             //Packet needs fragmentation
-            return fragmentPayload(channel, port, data, len, opts);
+            return fragmentPayload(channel, port, data, len, opts, priority, messageId);
         } else {
             //Payload fits into one packet
-            return sendSimplePayload(channel, port, data, len, opts);
+            return sendSimplePayload(channel, port, data, len, opts, priority, messageId);
         }
     }
     return CODE_INTERNAL_ERROR;
 }
 
-int S3TP::sendSimplePayload(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts) {
+/**
+ * Removes a message that was not transmitted yet from the output buffer.
+ * @return  The amount of payload bytes reclaimed.
+ */
+size_t S3TP::cancelMessages(uint8_t port, uint32_t messageId) {
+    return tx.cancelMessages(port, messageId);
+}
+
+int S3TP::sendSimplePayload(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts, uint8_t priority,
+                            uint32_t messageId) {
     S3TP_PACKET * packet;
 
     //Send to Tx Module without fragmenting
     packet = new S3TP_PACKET((char *)data, (uint16_t) len);
     packet->channel = channel;
     packet->options = opts;
+    packet->priority = priority;
+    packet->message_id = messageId;
     packet->getHeader()->setPort(port);
 
     return tx.enqueuePacket(packet, 0, false, channel, opts);
 }
 
-int S3TP::fragmentPayload(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts) {
-    S3TP_PACKET * packet;
+int S3TP::fragmentPayload(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts, uint8_t priority,
+                          uint32_t messageId) {
+    std::vector<S3TP_PACKET *> fragments;
 
     //Need to fragment
-    int written = 0;
-    int status = CODE_SUCCESS;
-    uint8_t fragment = 0;
-    bool moreFragments = true;
+    size_t written = 0;
     char * dataPtr = (char *) data;
 
     while (written < len) {
+        S3TP_PACKET * packet;
         if (written + LEN_S3TP_PDU > len) {
             //We are at the last packet, so don't need to write max payload
             packet = new S3TP_PACKET(dataPtr, (uint16_t)(len - written));
@@ -189,22 +220,15 @@ int S3TP::fragmentPayload(uint8_t channel, uint8_t port, void * data, size_t len
         packet->getHeader()->setPort(port);
         packet->options = opts;
         packet->channel = channel;
+        packet->priority = priority;
+        packet->message_id = messageId;
         written += packet->getHeader()->getPduLength();
-        dataPtr += written;
-
-        if (written >= len) {
-            moreFragments = false;
-        }
-        //Send to Tx Module
-        status = tx.enqueuePacket(packet, fragment, moreFragments, channel, opts);
-        if (status != CODE_SUCCESS) {
-            return status;
-        }
-        //Increasing current fragment number for next iteration
-        fragment++;
+        dataPtr += packet->getHeader()->getPduLength();
+        fragments.push_back(packet);
     }
 
-    return status;
+    //Send to Tx Module. Fragments are queued all at once, so a refused message leaves nothing behind
+    return tx.enqueueMessage(fragments);
 }
 
 /*
@@ -214,8 +238,8 @@ void S3TP::assemblyRoutine() {
     uint16_t len;
     int error;
     char * data;
-    Client * cli;
     uint8_t  port;
+    S3tpStreamMarker marker;
 
     pthread_mutex_lock(&s3tp_mutex);
     while(active && rx.isActive()) {
@@ -224,24 +248,17 @@ void S3TP::assemblyRoutine() {
             continue;
         }
         pthread_mutex_unlock(&s3tp_mutex);
-        data = rx.getNextCompleteMessage(&len, &error, &port);
-        if (error != CODE_SUCCESS) {
+        data = rx.getNextCompleteMessage(&len, &error, &port, &marker);
+        if (error != CODE_SUCCESS || data == NULL) {
             LOG_WARN("Error while trying to consume message");
+            pthread_mutex_lock(&s3tp_mutex);
+            continue;
         }
 
         LOG_DEBUG(std::string("Correctly consumed data from queue " + std::to_string((int)port)
                               + " (" + std::to_string(len) + " bytes)"));
 
-        pthread_mutex_lock(&clients_mutex);
-        cli = clients[port];
-        if (cli != NULL) {
-            cli->send(data, len);
-            delete[] data;
-        } else {
-            LOG_WARN(std::string("Port " + std::to_string((int)port)
-                                 + " is not open. Couldn't forward data to application"));
-        }
-        pthread_mutex_unlock(&clients_mutex);
+        deliverMessage(port, data, len, marker);
 
         pthread_mutex_lock(&s3tp_mutex);
     }
@@ -256,34 +273,64 @@ void * S3TP::staticAssemblyRoutine(void * args) {
     return NULL;
 }
 
-int S3TP::checkTransmissionAvailability(uint8_t port, uint8_t channel, uint16_t msg_len) {
-    if (tx.getCurrentState() == TxModule::STATE::BLOCKED) {
-        return CODE_LINK_UNAVAIABLE;
+/*
+ * Delivery logic
+ */
+/**
+ * Hands an assembled message to the application connected to its port. Never blocks:
+ * data the application is not reading yet is queued by the client, and written by the reactor.
+ * Once too much data is queued, the port is paused, so that remaining messages stay in the receive buffer
+ * (and are charged to its quota) until the application catches up.
+ */
+void S3TP::deliverMessage(uint8_t port, char * data, uint16_t len, S3tpStreamMarker marker) {
+    bool blocked = false;
+
+    pthread_mutex_lock(&clients_mutex);
+    std::map<uint8_t, ClientPort *>::iterator it = clients.find(port);
+    ClientPort * cli = (it != clients.end()) ? it->second : NULL;
+    if (cli != NULL) {
+        cli->send(data, len, marker);
+        blocked = cli->isOutputBlocked();
+    } else {
+        LOG_WARN(std::string("Port " + std::to_string((int)port)
+                             + " is not open. Couldn't forward data to application"));
     }
-    //Computing number of packets that need to be written
-    uint8_t no_packets = (uint8_t)(msg_len / LEN_S3TP_PDU);
-    if (msg_len % LEN_S3TP_PDU > 0) {
-        no_packets += 1;
+    pthread_mutex_unlock(&clients_mutex);
+    delete[] data;
+
+    if (!blocked) {
+        return;
     }
-    //Checking if transmission Q can contain the desired amount of packets
-    if (!tx.isQueueAvailable(port, no_packets)) {
-        return CODE_QUEUE_FULL;
+    rx.pausePort(port);
+    //Output may have been written in the meantime, in which case the resume notification was already issued
+    pthread_mutex_lock(&clients_mutex);
+    it = clients.find(port);
+    bool resume = it == clients.end() || it->second != cli || !cli->isOutputBlocked();
+    pthread_mutex_unlock(&clients_mutex);
+    if (resume) {
+        rx.resumePort(port);
+    }
+}
+
+int S3TP::checkTransmissionAvailability(uint8_t port, uint8_t channel, size_t msg_len, uint8_t opts) {
+    if (tx.getCurrentState() == TxModule::STATE::BLOCKED) {
+        return CODE_LINK_UNAVAIABLE;
     } else if (!tx.isChannelAvailable(channel)) {
         //Channel is currently broken
         return CODE_CHANNEL_BROKEN;
     }
+    //Checking if the memory budget can hold the whole message (this also charges the memory to the port)
+    if (!tx.admitMessage(port, msg_len, opts)) {
+        return CODE_QUEUE_FULL;
+    }
     return CODE_SUCCESS;
 }
 
 void S3TP::notifyAvailabilityToClients() {
-    S3TP_CONTROL control;
-    control.controlMessageType = AVAILABLE;
-    control.error = 0;
-
-    //Notifies all clients
+    //Clients submit the messages they held back again
     pthread_mutex_lock(&clients_mutex);
     for (auto const &it : clients) {
-        it.second->sendControlMessage(control);
+        it.second->requestRetry();
     }
     pthread_mutex_unlock(&clients_mutex);
 }
@@ -292,25 +339,60 @@ void S3TP::notifyAvailabilityToClients() {
  * Client Interface logic
  */
 void S3TP::onDisconnected(void * params) {
-    Client * cli = (Client *)params;
+    ClientPort * cli = (ClientPort *)params;
     pthread_mutex_lock(&clients_mutex);
-    disconnectedClients.push_back(cli->getAppPort());
+    std::map<uint8_t, ClientPort *>::iterator it = clients.find(cli->getAppPort());
+    if (it == clients.end() || it->second != cli) {
+        //Client was never registered (e.g. refused because the port was busy)
+        pthread_mutex_unlock(&clients_mutex);
+        return;
+    }
+    //Port is available again. The reactor destroys the port once this returns
+    clients.erase(it);
     pthread_mutex_unlock(&clients_mutex);
     rx.closePort(cli->getAppPort());
 }
 
-void S3TP::onConnected(void * params) {
-    Client * cli = (Client * )params;
+int S3TP::onConnected(void * params) {
+    ClientPort * cli = (ClientPort * )params;
     pthread_mutex_lock(&clients_mutex);
+    if (clients.find(cli->getAppPort()) != clients.end()) {
+        //A client port is already registered to this port
+        pthread_mutex_unlock(&clients_mutex);
+        LOG_INFO(std::string("Port " + std::to_string((int)cli->getAppPort()) + " is currently busy"));
+        return CODE_SERVER_PORT_BUSY;
+    }
     clients[cli->getAppPort()] = cli;
     pthread_mutex_unlock(&clients_mutex);
-    rx.openPort(cli->getAppPort());
-    synchronizeStatus(S3TP_SYNC_INITIATOR);
+    rx.openPort(cli->getAppPort(), cli->getOptions());
+    synchronizeStatus(S3TP_SYNC_INITIATOR, 0);
+    return CODE_SERVER_ACCEPT;
+}
+
+int S3TP::onApplicationMessage(void * data, size_t len, uint8_t priority, uint32_t messageId, void * params) {
+    ClientPort * cli = (ClientPort *)params;
+    int result = sendToLinkLayer(cli->getVirtualChannel(), cli->getAppPort(), data, len, cli->getOptions(), priority,
+                                 messageId);
+    switch (result) {
+        case CODE_QUEUE_FULL:
+        case CODE_LINK_UNAVAIABLE:
+        case CODE_CHANNEL_BROKEN:
+            //Temporary conditions: the client holds the message back, and is told when to try again
+            return CODE_SERVER_QUEUE_FULL;
+        default:
+            return result;
+    }
 }
 
-int S3TP::onApplicationMessage(void * data, size_t len, void * params) {
-    Client * cli = (Client *)params;
-    return sendToLinkLayer(cli->getVirtualChannel(), cli->getAppPort(), data, len, cli->getOptions());
+int S3TP::onCancelRequest(uint32_t messageId, void * params) {
+    ClientPort * cli = (ClientPort *)params;
+    return (int)cancelMessages(cli->getAppPort(), messageId);
+}
+
+void S3TP::onOutputAvailable(void * params) {
+    ClientPort * cli = (ClientPort *)params;
+    //Application caught up, messages held back in the receive buffer can be delivered again
+    rx.resumePort(cli->getAppPort());
 }
 
 /*
@@ -319,22 +401,21 @@ int S3TP::onApplicationMessage(void * data, size_t len, void * params) {
 void S3TP::onLinkStatusChanged(bool active) {
     tx.notifyLinkAvailability(active);
     if (active) {
-        synchronizeStatus(S3TP_SYNC_INITIATOR);
+        synchronizeStatus(S3TP_SYNC_INITIATOR, 0);
         notifyAvailabilityToClients();
     }
 }
 
 void S3TP::onChannelStatusChanged(uint8_t channel, bool active) {
     tx.setChannelAvailable(channel, active);
-
-    S3TP_CONTROL control;
-    control.controlMessageType = AVAILABLE;
-    control.error = 0;
+    if (!active) {
+        return;
+    }
     //Notify previously blocked clients
     pthread_mutex_lock(&clients_mutex);
     for (auto const &it : clients) {
         if (it.second->getVirtualChannel() == channel) {
-            it.second->sendControlMessage(control);
+            it.second->requestRetry();
         }
     }
     pthread_mutex_unlock(&clients_mutex);
@@ -344,25 +425,45 @@ void S3TP::onError(int error, void * params) {
     //TODO: implement
 }
 
-void S3TP::onSynchronization(uint8_t syncId) {
+void S3TP::onSynchronization(uint8_t syncId, uint8_t syncSeq) {
     if (syncId == S3TP_SYNC_INITIATOR) {
         // Sync init received. so we respond with an ack sync
-        synchronizeStatus(S3TP_SYNC_ACK);
+        synchronizeStatus(S3TP_SYNC_ACK, syncSeq);
     }
     //Otherwise don't care about the sync, as it simply an ack
 }
 
+void S3TP::onSynchronizationAck(uint8_t syncSeq) {
+    //Our sync reached the other side, so future syncs only need to contain changes since then
+    tx.acknowledgeSync(syncSeq);
+}
+
+void S3TP::onResyncRequested() {
+    //Other side lost our sequences (e.g. it restarted), so all of them are sent with our next sync
+    tx.resetSyncBaseline();
+    synchronizeStatus(S3TP_SYNC_INITIATOR, 0);
+}
+
 void S3TP::onOutputQueueAvailable(uint8_t port) {
     pthread_mutex_lock(&clients_mutex);
 
-    std::map<uint8_t, Client*>::iterator it = clients.find(port);
+    std::map<uint8_t, ClientPort*>::iterator it = clients.find(port);
     if (it != clients.end()) {
-        S3TP_CONTROL control;
-        control.controlMessageType = AVAILABLE;
-        control.error = 0;
-
-        it->second->sendControlMessage(control);
+        //May be called while the client is submitting a message, so the retry only happens later on
+        it->second->requestRetry();
     }
 
     pthread_mutex_unlock(&clients_mutex);
-}
\ No newline at end of file
+}
+
+void S3TP::onMessageConsumed(uint8_t port, uint16_t nextSeq) {
+    tx.scheduleAcknowledgement(port, nextSeq);
+}
+
+void S3TP::onAcknowledgement(uint8_t port, uint16_t nextSeq) {
+    tx.handleAcknowledgement(port, nextSeq);
+}
+
+void S3TP::onSequenceModeOffered(bool wide) {
+    tx.setPeerWideSequences(wide);
+}
@@ -10,7 +10,7 @@
 #include "SimpleQueue.h"
 #include "ClientInterface.h"
 #include "StatusInterface.h"
-#include "Client.h"
+#include "ClientPort.h"
 #include <cstring>
 #include <moveio/PinMapper.h>
 #include <trctrl/BackendFactory.h>
@@ -42,9 +42,15 @@ public:
     ~S3TP();
     int init(TRANSCEIVER_CONFIG * config);
     int stop();
-    int sendToLinkLayer(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts);
-    Client * getClientConnectedToPort(uint8_t port);
-    void cleanupClients();
+    int loadContactSchedule(const char * path);
+    int loadReceivePolicies(const char * path);
+    int loadTransmitPolicies(const char * path);
+    void setAcknowledgementDelay(uint64_t delay);
+    void setWideSequencesEnabled(bool enabled);
+    int sendToLinkLayer(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts, uint8_t priority,
+                        uint32_t messageId);
+    size_t cancelMessages(uint8_t port, uint32_t messageId);
+    ClientPort * getClientConnectedToPort(uint8_t port);
 
 private:
     pthread_t assembly_thread;
@@ -55,33 +61,42 @@ private:
 
     //Generic methods
     void reset();
-    void synchronizeStatus(uint8_t syncId);
+    void synchronizeStatus(uint8_t syncId, uint8_t peerSyncSeq);
 
     //TxModule
     TxModule tx;
-    int fragmentPayload(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts);
-    int sendSimplePayload(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts);
+    int fragmentPayload(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts, uint8_t priority,
+                        uint32_t messageId);
+    int sendSimplePayload(uint8_t channel, uint8_t port, void * data, size_t len, uint8_t opts, uint8_t priority,
+                          uint32_t messageId);
     //RxModule
     RxModule rx;
     void assemblyRoutine();
     static void * staticAssemblyRoutine(void * args);
+    void deliverMessage(uint8_t port, char * data, uint16_t len, S3tpStreamMarker marker);
 
     //Clients
-    std::map<uint8_t, Client*> clients;
+    std::map<uint8_t, ClientPort*> clients;
     pthread_mutex_t clients_mutex;
-    std::vector<uint8_t> disconnectedClients;
-    int checkTransmissionAvailability(uint8_t port, uint8_t channel, uint16_t msg_len);
+    int checkTransmissionAvailability(uint8_t port, uint8_t channel, size_t msg_len, uint8_t opts);
     void notifyAvailabilityToClients();
     virtual void onDisconnected(void * params);
-    virtual void onConnected(void * params);
-    virtual int onApplicationMessage(void * data, size_t len, void * params);
+    virtual int onConnected(void * params);
+    virtual int onApplicationMessage(void * data, size_t len, uint8_t priority, uint32_t messageId, void * params);
+    virtual int onCancelRequest(uint32_t messageId, void * params);
+    virtual void onOutputAvailable(void * params);
 
     //Status check
     virtual void onLinkStatusChanged(bool active);
     virtual void onChannelStatusChanged(uint8_t channel, bool active);
     virtual void onError(int error, void * params);
-    virtual void onSynchronization(uint8_t syncId);
+    virtual void onSynchronization(uint8_t syncId, uint8_t syncSeq);
+    virtual void onSynchronizationAck(uint8_t syncSeq);
+    virtual void onResyncRequested();
     virtual void onOutputQueueAvailable(uint8_t port);
+    virtual void onMessageConsumed(uint8_t port, uint16_t nextSeq);
+    virtual void onAcknowledgement(uint8_t port, uint16_t nextSeq);
+    virtual void onSequenceModeOffered(bool wide);
 };
 
 
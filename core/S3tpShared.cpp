@@ -3,6 +3,8 @@
 //
 
 #include "S3tpShared.h"
+#include <cstring>
+#include <errno.h>
 
 const int LOG_LEVEL = LOG_LEVEL_DEBUG;
 
@@ -11,8 +13,6 @@ char * socket_path = nullptr;
 int read_length_safe(int fd, size_t * out_length) {
     ssize_t rd = 0;
     S3TP_INTRO_REDUNDANT len;
-    int i = 0, j = 0;
-    int tempCount = 0, count = 0;
 
     //Receive structure, then check if all redundant values are the same, so that we are safe against bit flips
     rd = read(fd, &len, sizeof(len));
@@ -22,17 +22,27 @@ int read_length_safe(int fd, size_t * out_length) {
     } else if (rd == 0) {
         return CODE_ERROR_SOCKET_NO_CONN;
     }
+    return parse_length_safe(&len, out_length);
+}
 
-    *out_length = len.command[0];
+/**
+ * Extracts the length from a redundant structure that was already received.
+ * The value transmitted by the majority of the copies is taken, so that we are safe against bit flips.
+ */
+int parse_length_safe(const S3TP_INTRO_REDUNDANT * len, size_t * out_length) {
+    int i = 0, j = 0;
+    int tempCount = 0, count = 0;
+
+    *out_length = len->command[0];
 
     for (i=0; i<SAFE_TRANSMISSION_COUNT - 1; i++) {
         tempCount = 0;
         for (j=1; j<SAFE_TRANSMISSION_COUNT; j++) {
-            if (len.command[i] == len.command[j]) {
+            if (len->command[i] == len->command[j]) {
                 tempCount++;
             }
             if (tempCount > count) {
-                *out_length = len.command[i];
+                *out_length = len->command[i];
                 count = tempCount;
             }
         }
@@ -46,13 +56,16 @@ int read_length_safe(int fd, size_t * out_length) {
     return CODE_SUCCESS;
 }
 
-
-int write_length_safe(int fd, size_t len) {
-    S3TP_INTRO_REDUNDANT redundant_length;
+void encode_length_safe(S3TP_INTRO_REDUNDANT * redundant_length, size_t len) {
     //Transmit the data N times in a structure, so that we are safe against bit flips
     for (int i=0; i<SAFE_TRANSMISSION_COUNT; i++) {
-        redundant_length.command[i] = len;
+        redundant_length->command[i] = len;
     }
+}
+
+int write_length_safe(int fd, size_t len) {
+    S3TP_INTRO_REDUNDANT redundant_length;
+    encode_length_safe(&redundant_length, len);
     if (write(fd, &redundant_length, sizeof(redundant_length)) <= 0) {
         //Error occurred. Abort.
         return CODE_ERROR_SOCKET_WRITE;
@@ -60,6 +73,103 @@ int write_length_safe(int fd, size_t len) {
     return CODE_SUCCESS;
 }
 
+/**
+ * Builds the header of a frame.
+ * @param header  Buffer of at least FRAME_HEADER_MAX_LENGTH bytes.
+ * @param code  Priority or stream marker following the type, or NULL for frames without one.
+ * @param len  Length of the payload.
+ * @return  The length of the header.
+ */
+size_t encode_frame_header(char * header, AppMessageType type, const uint8_t * code, size_t len) {
+    S3TP_INTRO_REDUNDANT redundantLength;
+    size_t headerLength = 0;
+
+    header[headerLength++] = (char)type;
+    if (code != NULL) {
+        header[headerLength++] = (char)*code;
+    }
+    encode_length_safe(&redundantLength, len);
+    memcpy(header + headerLength, &redundantLength, sizeof(redundantLength));
+    return headerLength + sizeof(redundantLength);
+}
+
+/**
+ * Parses the header of a frame at the beginning of buffer, without consuming anything.
+ * @param hasCode  Whether the type is followed by a priority or stream marker, which is then stored in code.
+ * @param len  Output parameter that will hold the length of the payload.
+ * @return  The length of the header, 0 if more data is needed, or CODE_ERROR_LENGTH_CORRUPT.
+ */
+int decode_frame_header(const char * buffer, size_t available, bool hasCode, uint8_t * code, size_t * len) {
+    S3TP_INTRO_REDUNDANT redundantLength;
+    size_t headerLength = sizeof(AppMessageType);
+
+    if (hasCode) {
+        headerLength += sizeof(uint8_t);
+    }
+    if (available < headerLength + sizeof(redundantLength)) {
+        return 0;
+    }
+    if (hasCode) {
+        *code = (uint8_t)buffer[sizeof(AppMessageType)];
+    }
+    memcpy(&redundantLength, buffer + headerLength, sizeof(redundantLength));
+    if (parse_length_safe(&redundantLength, len) != CODE_SUCCESS) {
+        return CODE_ERROR_LENGTH_CORRUPT;
+    }
+    return (int)(headerLength + sizeof(redundantLength));
+}
+
+/**
+ * Writes what is left of a frame, starting at offset, with a single system call.
+ * Never raises SIGPIPE: a closed connection is reported as an error instead.
+ * @return  The amount of bytes written, or -1 with errno set.
+ */
+ssize_t send_frame(int fd, const void * header, size_t headerLength, const void * payload, size_t len,
+                   size_t offset) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    int count = 0;
+
+    if (offset < headerLength) {
+        iov[count].iov_base = (char *)header + offset;
+        iov[count].iov_len = headerLength - offset;
+        count++;
+        offset = 0;
+    } else {
+        offset -= headerLength;
+    }
+    if (offset < len) {
+        iov[count].iov_base = (char *)payload + offset;
+        iov[count].iov_len = len - offset;
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+/**
+ * Writes a whole frame on a blocking socket, resuming partial writes until everything was written.
+ */
+int write_frame_safe(int fd, const void * header, size_t headerLength, const void * payload, size_t len) {
+    size_t written = 0;
+
+    while (written < headerLength + len) {
+        ssize_t wr = send_frame(fd, header, headerLength, payload, len, written);
+        if (wr < 0 && errno == EINTR) {
+            continue;
+        } else if (wr <= 0) {
+            return CODE_ERROR_SOCKET_WRITE;
+        }
+        written += wr;
+    }
+    return CODE_SUCCESS;
+}
+
 uint8_t safe_bool_interpretation(uint8_t val) {
     if (val == 0x7F || val > 0x80) {
         return 0xFF;
@@ -68,29 +178,83 @@ uint8_t safe_bool_interpretation(uint8_t val) {
     }
 }
 
+/**
+ * Returns the control message type closest to the received value (in terms of hamming distance).
+ * If the value is equally close to more than one type, it cannot be interpreted safely and AMBIGUOUS is returned.
+ */
 AppControlMessageType safeMessageTypeInterpretation(uint8_t val) {
-    int i=0;
-    int count_low = 0, count_high = 0;
-    for (i = 0; i < 4; i++) {
-        if ((val % 2) != 0) {
-            //First bit is 1
-            count_low++;
+    static const AppControlMessageType types[] = {ACK, NACK, CANCEL, AVAILABLE, CREDIT, OPEN, RESERVED};
+    AppControlMessageType result = AMBIGUOUS;
+    int minDistance = 9;
+    bool ambiguous = false;
+    for (auto const &type : types) {
+        int distance = 0;
+        for (uint8_t diff = val ^ type; diff != 0; diff = diff >> 1) {
+            distance += diff & 0x01;
         }
-        val = val >> 1;
-    }
-    for (i = 0; i < 4; i++) {
-        if ((val % 2) != 0) {
-            //First bit is 1
-            count_high++;
+        if (distance < minDistance) {
+            minDistance = distance;
+            result = type;
+            ambiguous = false;
+        } else if (distance == minDistance) {
+            ambiguous = true;
         }
-        val = val >> 1;
     }
-    if (count_low <= 1 && count_high <= 1) {
-        return ACK; //Must be 0
-    } else if (count_high <= 1) {
-        return NACK;
-    } else if (count_low <= 1) {
-        return AVAILABLE;
+    return ambiguous ? AMBIGUOUS : result;
+}
+
+/*
+ * Priorities are transmitted using the same bit patterns as control messages,
+ * so that they can be interpreted safely in case of bit flips.
+ */
+uint8_t encodePriority(S3tpPriority priority) {
+    switch (priority) {
+        case PRIORITY_URGENT:
+            return NACK;
+        case PRIORITY_BULK:
+            return AVAILABLE;
+        default:
+            return ACK;
+    }
+}
+
+S3tpPriority safePriorityInterpretation(uint8_t val) {
+    switch (safeMessageTypeInterpretation(val)) {
+        case NACK:
+            return PRIORITY_URGENT;
+        case AVAILABLE:
+            return PRIORITY_BULK;
+        default:
+            return PRIORITY_NORMAL;
+    }
+}
+
+/*
+ * Stream markers are transmitted the same way as priorities.
+ * A marker that cannot be interpreted safely aborts the message, rather than delivering it corrupted.
+ */
+uint8_t encodeStreamMarker(S3tpStreamMarker marker) {
+    switch (marker) {
+        case STREAM_BEGIN:
+            return NACK;
+        case STREAM_END:
+            return AVAILABLE;
+        case STREAM_ABORT:
+            return CANCEL;
+        default:
+            return ACK;
+    }
+}
+
+S3tpStreamMarker safeStreamMarkerInterpretation(uint8_t val) {
+    switch (safeMessageTypeInterpretation(val)) {
+        case NACK:
+            return STREAM_BEGIN;
+        case ACK:
+            return STREAM_CONTINUE;
+        case AVAILABLE:
+            return STREAM_END;
+        default:
+            return STREAM_ABORT;
     }
-    return RESERVED;
 }
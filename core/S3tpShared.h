@@ -13,12 +13,24 @@
 #include <string>
 #include <iostream>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #define LOCK(mutex) pthread_mutex_lock(mutex)
 #define UNLOCK(mutex) pthread_mutex_unlock(mutex)
 
-#define S3TP_OPTION_ARQ 0x01;
-#define S3TP_OPTION_CUSTOM 0x02;
+#define S3TP_OPTION_ARQ 0x01
+#define S3TP_OPTION_CUSTOM 0x02
+//Latest-value-only port: a new message replaces all messages of the port which were not transmitted yet
+#define S3TP_OPTION_SUPERSEDE 0x04
+//Unordered port: received messages are delivered as soon as they are complete, without waiting for earlier ones
+#define S3TP_OPTION_UNORDERED 0x08
+//Streaming port: received messages are delivered in chunks, as soon as their next in-order fragments are available
+#define S3TP_OPTION_STREAMING 0x10
+//Messages are exchanged with the daemon through shared memory rings instead of the socket. Local to the host
+#define S3TP_OPTION_SHARED_MEMORY 0x20
+//Several ports are registered over the same connection to the daemon, every frame carrying the port it belongs to
+#define S3TP_OPTION_MULTIPLEX 0x40
 
 /*
  * Definition or status codes generated locally
@@ -33,6 +45,13 @@
 #define CODE_ERROR_LENGTH_CORRUPT -8
 #define CODE_ERROR_INVALID_LENGTH -9
 #define CODE_ERROR_INVALID_TYPE -10
+#define CODE_ERROR_SHARED_MEMORY -14
+//Messages are delivered to a callback, so they cannot be received synchronously
+#define CODE_ERROR_ASYNC_RECEIVE -15
+//Operation cannot be completed without blocking (non-blocking connectors only)
+#define CODE_ERROR_WOULD_BLOCK -16
+//Port was not registered by the connector
+#define CODE_ERROR_PORT_NOT_REGISTERED -17
 #define CODE_SUCCESS 0
 
 /*
@@ -42,19 +61,60 @@
 #define CODE_SERVER_PORT_BUSY -11
 #define CODE_SERVER_QUEUE_FULL -12
 #define CODE_SERVER_INTERNAL_ERROR -13
+//Connection accepted, but the shared memory offered by the application couldn't be used
+#define CODE_SERVER_ACCEPT_NO_SHARED_MEMORY 1
 
 
 #define APP_DATA_MESSAGE 0x00
 #define APP_CONTROL_MESSAGE 0xFF
+//Chunk of a message, only sent to applications using streaming ports. Same bit pattern as CANCEL
+#define APP_STREAM_MESSAGE 0x3C
 
 /*
  * Definition of control message types (including ack/nack bytes)
+ * Values keep a hamming distance of at least 4 to each other, so that single bit flips can be corrected.
  */
 enum AppControlMessageType : uint8_t {
     ACK = 0x00,
     NACK = 0x0F,
+    CANCEL = 0x3C,
     AVAILABLE = 0xF0,
-    RESERVED = 0xFF
+    CREDIT = 0xC3,
+    OPEN = 0x33,
+    RESERVED = 0xFF,
+    //Never sent: value returned for bytes that are equally close to several types. Matches no frame type either
+    AMBIGUOUS = 0x55
+};
+
+//Message id referring to all messages queued on a port
+#define S3TP_MESSAGE_ID_ALL 0
+
+/*
+ * Priority classes of a message within a port. Lower classes are transmitted first.
+ * Messages of the same class are delivered in the order in which they were sent,
+ * whereas no ordering is guaranteed between messages belonging to different classes.
+ * A message that is already being transmitted is never interrupted by a message of a higher class.
+ */
+enum S3tpPriority : uint8_t {
+    PRIORITY_URGENT = 0,
+    PRIORITY_NORMAL = 1,
+    PRIORITY_BULK = 2
+};
+
+#define S3TP_PRIORITY_CLASSES 3
+
+/*
+ * Position of a chunk within a message received on a streaming port.
+ * A message is either delivered in one piece (STREAM_COMPLETE, sent as a regular data message),
+ * or as a STREAM_BEGIN chunk, any number of STREAM_CONTINUE chunks and a STREAM_END chunk.
+ * STREAM_ABORT (without data) replaces the remaining chunks of a message whose missing fragments were given up.
+ */
+enum S3tpStreamMarker : uint8_t {
+    STREAM_COMPLETE = 0,
+    STREAM_BEGIN = 1,
+    STREAM_CONTINUE = 2,
+    STREAM_END = 3,
+    STREAM_ABORT = 4
 };
 
 #define SAFE_TRANSMISSION_COUNT 3
@@ -76,20 +136,80 @@ typedef struct tag_s3tp_config {
     void setArq(int active) {
         options ^= (active & 0x01);
     }
+
+    void setSupersede(int active) {
+        if (active) {
+            options |= S3TP_OPTION_SUPERSEDE;
+        } else {
+            options &= ~S3TP_OPTION_SUPERSEDE;
+        }
+    }
+
+    void setUnordered(int active) {
+        if (active) {
+            options |= S3TP_OPTION_UNORDERED;
+        } else {
+            options &= ~S3TP_OPTION_UNORDERED;
+        }
+    }
+
+    void setStreaming(int active) {
+        if (active) {
+            options |= S3TP_OPTION_STREAMING;
+        } else {
+            options &= ~S3TP_OPTION_STREAMING;
+        }
+    }
+
+    void setSharedMemory(int active) {
+        if (active) {
+            options |= S3TP_OPTION_SHARED_MEMORY;
+        } else {
+            options &= ~S3TP_OPTION_SHARED_MEMORY;
+        }
+    }
+
+    void setMultiplex(int active) {
+        if (active) {
+            options |= S3TP_OPTION_MULTIPLEX;
+        } else {
+            options &= ~S3TP_OPTION_MULTIPLEX;
+        }
+    }
 }S3TP_CONFIG;
 
 typedef uint8_t AppMessageType;
 typedef uint8_t S3tpError;
 
+/*
+ * CREDIT: the application may send length more bytes and messageId more messages.
+ * NACK: messageId is the message that was dropped, error the reason.
+ * CANCEL: messageId is the message to be cancelled (or S3TP_MESSAGE_ID_ALL).
+ * In the response, length holds the amount of payload bytes that were removed from the output buffer.
+ * OPEN: registers one more port on a multiplexed connection, with messageId holding the channel
+ * and length the options. The response carries the result in error (CODE_SERVER_ACCEPT or the reason
+ * of the refusal), followed by the initial credit of the port if it was accepted.
+ */
 typedef struct tag_s3tp_control {
     AppControlMessageType controlMessageType;
     S3tpError error;
+    uint32_t messageId;
+    uint32_t length;
 }S3TP_CONTROL;
 
 typedef struct tag_s3tp_length_redundant {
     size_t command[SAFE_TRANSMISSION_COUNT];
 }S3TP_INTRO_REDUNDANT;
 
+/*
+ * Framing of the messages exchanged between applications and the daemon: the type, then a priority or
+ * stream marker for the message types carrying one, then the redundant length, then the payload.
+ * The header is built in a small buffer, so that header and payload are written with a single system call.
+ */
+#define FRAME_HEADER_MAX_LENGTH (2 * sizeof(uint8_t) + sizeof(S3TP_INTRO_REDUNDANT))
+//On multiplexed connections, every frame exchanged after the handshake is preceded by its port
+#define FRAME_PORT_PREFIX_LENGTH sizeof(uint8_t)
+
 extern char * socket_path;
 
 /*
@@ -99,8 +219,19 @@ extern char * socket_path;
 #define MIN(a,b) (((a) > (b)) ? (a) : (b))
 
 int read_length_safe(int fd, size_t * out_length);
+int parse_length_safe(const S3TP_INTRO_REDUNDANT * len, size_t * out_length);
+void encode_length_safe(S3TP_INTRO_REDUNDANT * redundant_length, size_t len);
 int write_length_safe(int fd, size_t len);
+size_t encode_frame_header(char * header, AppMessageType type, const uint8_t * code, size_t len);
+int decode_frame_header(const char * buffer, size_t available, bool hasCode, uint8_t * code, size_t * len);
+ssize_t send_frame(int fd, const void * header, size_t headerLength, const void * payload, size_t len,
+                   size_t offset);
+int write_frame_safe(int fd, const void * header, size_t headerLength, const void * payload, size_t len);
 uint8_t safe_bool_interpretation(uint8_t val);
 AppControlMessageType safeMessageTypeInterpretation(uint8_t val);
+uint8_t encodePriority(S3tpPriority priority);
+S3tpPriority safePriorityInterpretation(uint8_t val);
+uint8_t encodeStreamMarker(S3tpStreamMarker marker);
+S3tpStreamMarker safeStreamMarkerInterpretation(uint8_t val);
 
 #endif //S3TP_S3TP_SHARED_H
\ No newline at end of file
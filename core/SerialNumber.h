@@ -0,0 +1,55 @@
+//
+// Created on 18/10/26.
+//
+
+#ifndef S3TP_SERIALNUMBER_H
+#define S3TP_SERIALNUMBER_H
+
+#include <cstdint>
+
+/*
+ * Serial number arithmetic as defined in RFC 1982.
+ * Sequence numbers wrap around, so s1 is considered lower than s2 if s2 can be reached from s1
+ * by moving forward less than half of the sequence space.
+ * Two numbers which are exactly half of the sequence space apart are not comparable in RFC 1982,
+ * here the first one is considered greater in that case.
+ */
+template <typename T>
+inline int serialCompare(T s1, T s2) {
+    const T half = (T)(1u << (sizeof(T) * 8 - 1));
+    if (s1 == s2) {
+        return 0;
+    } else if ((s1 < s2 && (T)(s2 - s1) < half) || (s1 > s2 && (T)(s1 - s2) > half)) {
+        return -1;
+    }
+    return 1;
+}
+
+template <typename T>
+inline bool serialLessThan(T s1, T s2) {
+    return serialCompare<T>(s1, s2) < 0;
+}
+
+//Number of steps needed to move forward from one sequence number to another
+template <typename T>
+inline T serialDistance(T from, T to) {
+    return (T)(to - from);
+}
+
+/*
+ * Sequences are always stored in 16 bits. If wide sequences are not in use,
+ * only the lower 8 bits are significant and arithmetic wraps around accordingly.
+ */
+inline int compareSequences(uint16_t s1, uint16_t s2, bool wide) {
+    return wide ? serialCompare<uint16_t>(s1, s2) : serialCompare<uint8_t>((uint8_t)s1, (uint8_t)s2);
+}
+
+inline uint16_t sequenceDistance(uint16_t from, uint16_t to, bool wide) {
+    return wide ? serialDistance<uint16_t>(from, to) : serialDistance<uint8_t>((uint8_t)from, (uint8_t)to);
+}
+
+inline uint16_t nextSequence(uint16_t seq, bool wide) {
+    return wide ? (uint16_t)(seq + 1) : (uint16_t)((uint8_t)(seq + 1));
+}
+
+#endif //S3TP_SERIALNUMBER_H
@@ -0,0 +1,285 @@
+//
+// Created on 18/10/26.
+//
+
+#include <new>
+#include "SharedRing.h"
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared rings require lock-free 64 bit atomics");
+
+#define SHM_RING_MASK (SHM_RING_CAPACITY - 1)
+
+SharedRing::SharedRing() {
+    header = NULL;
+    data = NULL;
+    consumer_doorbell = -1;
+    producer_doorbell = -1;
+    pending_record = NULL;
+    pending_length = 0;
+    next_position = 0;
+    corrupt = false;
+}
+
+void SharedRing::attach(SHM_RING_HEADER * header, char * data, int consumerDoorbell, int producerDoorbell) {
+    this->header = header;
+    this->data = data;
+    this->consumer_doorbell = consumerDoorbell;
+    this->producer_doorbell = producerDoorbell;
+}
+
+/**
+ * Whether a message of the given length can be stored in the ring.
+ * Records are limited to half of the ring, so that a record always fits once the ring is empty,
+ * regardless of the space wasted at the end of the ring.
+ */
+bool SharedRing::fits(size_t len) {
+    return getRecordSize(len) <= SHM_RING_CAPACITY / 2;
+}
+
+/**
+ * Reserves space for a message, which is then written directly into the ring.
+ * @return  Where the payload is to be written, or NULL if there currently is not enough space.
+ */
+char * SharedRing::reserve(size_t len) {
+    if (corrupt || !fits(len)) {
+        return NULL;
+    }
+    size_t needed = getRecordSize(len);
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    if (tail - head > SHM_RING_CAPACITY) {
+        LOG_WARN("Invalid position read from shared ring");
+        corrupt = true;
+        return NULL;
+    }
+    //Records never wrap, the end of the ring is skipped instead
+    size_t offset = tail & SHM_RING_MASK;
+    size_t skip = (SHM_RING_CAPACITY - offset < needed) ? SHM_RING_CAPACITY - offset : 0;
+    if (tail + skip + needed - head > SHM_RING_CAPACITY) {
+        return NULL;
+    }
+    if (skip > 0) {
+        ((SHM_RECORD *)(data + offset))->length = SHM_RECORD_WRAP;
+    }
+    pending_record = (SHM_RECORD *)(data + ((tail + skip) & SHM_RING_MASK));
+    pending_length = (uint32_t)len;
+    next_position = tail + skip + needed;
+    return (char *)(pending_record + 1);
+}
+
+/**
+ * Publishes the message previously reserved, waking the consumer up if it was waiting.
+ */
+void SharedRing::commit(uint8_t type, uint8_t priority, uint8_t marker, uint8_t port) {
+    pending_record->length = pending_length;
+    pending_record->type = type;
+    pending_record->priority = priority;
+    pending_record->marker = marker;
+    pending_record->port = port;
+    header->tail.store(next_position, std::memory_order_seq_cst);
+    if (header->consumer_waiting.exchange(0, std::memory_order_seq_cst) != 0) {
+        SharedMemoryChannel::ringDoorbell(consumer_doorbell);
+    }
+}
+
+/**
+ * Announces that the producer is going to sleep until the consumer frees some space.
+ * @return  False if enough space became available in the meantime, in which case the producer should not sleep.
+ */
+bool SharedRing::waitForSpace(size_t len) {
+    header->producer_waiting.store(1, std::memory_order_seq_cst);
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    uint64_t head = header->head.load(std::memory_order_seq_cst);
+    //Worst case, the end of the ring has to be skipped as well
+    return tail - head + 2 * getRecordSize(len) > SHM_RING_CAPACITY && !corrupt;
+}
+
+/**
+ * Returns the next message, without removing it from the ring.
+ * @param record  Output parameter receiving a copy of the record header.
+ * @return  The payload of the message, or NULL if the ring is empty (or corrupt).
+ */
+char * SharedRing::front(SHM_RECORD * record) {
+    if (corrupt) {
+        return NULL;
+    }
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    uint64_t tail = header->tail.load(std::memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    if (tail - head > SHM_RING_CAPACITY) {
+        LOG_WARN("Invalid position read from shared ring");
+        corrupt = true;
+        return NULL;
+    }
+    SHM_RECORD * current = (SHM_RECORD *)(data + (head & SHM_RING_MASK));
+    if (current->length == SHM_RECORD_WRAP) {
+        head += SHM_RING_CAPACITY - (head & SHM_RING_MASK);
+        current = (SHM_RECORD *)data;
+    }
+    memcpy(record, current, sizeof(SHM_RECORD));
+    if (head == tail || tail - head > SHM_RING_CAPACITY || !fits(record->length)
+        || getRecordSize(record->length) > tail - head) {
+        LOG_WARN("Invalid record read from shared ring");
+        corrupt = true;
+        return NULL;
+    }
+    next_position = head + getRecordSize(record->length);
+    return (char *)(current + 1);
+}
+
+/**
+ * Removes the message previously returned by front, waking the producer up if it was waiting for space.
+ */
+void SharedRing::pop() {
+    header->head.store(next_position, std::memory_order_seq_cst);
+    if (header->producer_waiting.exchange(0, std::memory_order_seq_cst) != 0) {
+        SharedMemoryChannel::ringDoorbell(producer_doorbell);
+    }
+}
+
+/**
+ * Announces that the consumer is going to sleep until the producer commits a message.
+ * @return  False if a message arrived in the meantime, in which case the consumer should not sleep.
+ */
+bool SharedRing::waitForData() {
+    header->consumer_waiting.store(1, std::memory_order_seq_cst);
+    return header->tail.load(std::memory_order_seq_cst) == header->head.load(std::memory_order_relaxed);
+}
+
+bool SharedRing::isCorrupt() {
+    return corrupt;
+}
+
+size_t SharedRing::getRecordSize(size_t len) {
+    return (sizeof(SHM_RECORD) + len + SHM_RECORD_ALIGNMENT - 1) & ~((size_t)SHM_RECORD_ALIGNMENT - 1);
+}
+
+/*
+ * Shared memory channel
+ */
+SharedMemoryChannel::SharedMemoryChannel() {
+    memfd = -1;
+    app_doorbell = -1;
+    daemon_doorbell = -1;
+    region = NULL;
+}
+
+SharedMemoryChannel::~SharedMemoryChannel() {
+    if (region != NULL) {
+        munmap(region, getRegionSize());
+    }
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    if (app_doorbell >= 0) {
+        close(app_doorbell);
+    }
+    if (daemon_doorbell >= 0) {
+        close(daemon_doorbell);
+    }
+}
+
+/**
+ * Creates the region and the doorbells. Called by the application.
+ */
+int SharedMemoryChannel::create() {
+    memfd = memfd_create("s3tp", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    app_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    daemon_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (memfd < 0 || app_doorbell < 0 || daemon_doorbell < 0 || ftruncate(memfd, getRegionSize()) != 0
+        || fcntl(memfd, F_ADD_SEALS, SHM_REQUIRED_SEALS) != 0) {
+        LOG_ERROR("Couldn't create shared memory channel");
+        return CODE_ERROR_SHARED_MEMORY;
+    }
+    if (map() != CODE_SUCCESS) {
+        return CODE_ERROR_SHARED_MEMORY;
+    }
+    //Both consumers start out sleeping
+    for (int i = 0; i < 2; i++) {
+        SHM_RING_HEADER * header = new (region + i * sizeof(SHM_RING_HEADER)) SHM_RING_HEADER();
+        header->head = 0;
+        header->tail = 0;
+        header->consumer_waiting = 1;
+        header->producer_waiting = 0;
+    }
+    return CODE_SUCCESS;
+}
+
+/**
+ * Maps a region created by the application. Called by the daemon, which takes ownership of the descriptors.
+ * The region must be sealed against resizing, as the daemon would otherwise crash on accessing a truncated mapping.
+ */
+int SharedMemoryChannel::attach(int memfd, int appDoorbell, int daemonDoorbell) {
+    struct stat info;
+
+    this->memfd = memfd;
+    this->app_doorbell = appDoorbell;
+    this->daemon_doorbell = daemonDoorbell;
+    int seals = fcntl(memfd, F_GET_SEALS);
+    if (seals < 0 || (seals & SHM_REQUIRED_SEALS) != SHM_REQUIRED_SEALS) {
+        LOG_WARN("Shared memory offered by application is not sealed");
+        return CODE_ERROR_SHARED_MEMORY;
+    }
+    if (fstat(memfd, &info) != 0 || (size_t)info.st_size != getRegionSize()) {
+        LOG_WARN("Shared memory offered by application has an unexpected size");
+        return CODE_ERROR_SHARED_MEMORY;
+    }
+    return map();
+}
+
+int SharedMemoryChannel::getMemfd() {
+    return memfd;
+}
+
+int SharedMemoryChannel::getAppDoorbell() {
+    return app_doorbell;
+}
+
+int SharedMemoryChannel::getDaemonDoorbell() {
+    return daemon_doorbell;
+}
+
+SharedRing * SharedMemoryChannel::getUpstream() {
+    return &upstream;
+}
+
+SharedRing * SharedMemoryChannel::getDownstream() {
+    return &downstream;
+}
+
+/**
+ * Both ring headers come first, followed by the upstream and downstream data.
+ */
+size_t SharedMemoryChannel::getRegionSize() {
+    return 2 * (sizeof(SHM_RING_HEADER) + SHM_RING_CAPACITY);
+}
+
+void SharedMemoryChannel::ringDoorbell(int doorbell) {
+    uint64_t value = 1;
+    if (write(doorbell, &value, sizeof(value)) < 0) {
+        LOG_DEBUG("Doorbell was already rung");
+    }
+}
+
+void SharedMemoryChannel::clearDoorbell(int doorbell) {
+    uint64_t value;
+    if (read(doorbell, &value, sizeof(value)) < 0) {
+        LOG_DEBUG("Doorbell was not rung");
+    }
+}
+
+int SharedMemoryChannel::map() {
+    void * address = mmap(NULL, getRegionSize(), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (address == MAP_FAILED) {
+        LOG_ERROR("Couldn't map shared memory channel");
+        return CODE_ERROR_SHARED_MEMORY;
+    }
+    region = (char *)address;
+    char * data = region + 2 * sizeof(SHM_RING_HEADER);
+    upstream.attach((SHM_RING_HEADER *)region, data, daemon_doorbell, app_doorbell);
+    downstream.attach((SHM_RING_HEADER *)(region + sizeof(SHM_RING_HEADER)), data + SHM_RING_CAPACITY,
+                      app_doorbell, daemon_doorbell);
+    return CODE_SUCCESS;
+}
@@ -0,0 +1,123 @@
+//
+// Created on 18/10/26.
+//
+
+#ifndef S3TP_SHAREDRING_H
+#define S3TP_SHAREDRING_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <atomic>
+#include <cstring>
+#include "S3tpShared.h"
+
+//Bytes available for records in each direction. Must be a power of 2
+#define SHM_RING_CAPACITY (1024 * 1024)
+//Records are aligned to this size, so that headers never straddle the end of the ring
+#define SHM_RECORD_ALIGNMENT 8
+//Descriptors passed by the application with its configuration: memfd, application doorbell, daemon doorbell
+#define SHM_DESCRIPTOR_COUNT 3
+//Length of the record filling the unused space at the end of the ring, when the next record didn't fit there
+#define SHM_RECORD_WRAP 0xFFFFFFFF
+//Seals the daemon requires on a region, so that the application cannot shrink it under the mapping (SIGBUS)
+#define SHM_REQUIRED_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+/**
+ * Header of a message stored in a ring. The payload follows right after it.
+ * Type, priority and marker are stored with the same encoding used on the socket.
+ * The port is only used on multiplexed connections, whose rings carry the messages of all their ports.
+ */
+typedef struct tag_shm_record {
+    uint32_t length;
+    uint8_t type;
+    uint8_t priority;
+    uint8_t marker;
+    uint8_t port;
+}SHM_RECORD;
+
+/**
+ * Control block of a ring, shared by both processes.
+ * Positions only grow, the offset within the ring is obtained by masking.
+ * A side which is about to sleep sets its waiting flag, so that the other side rings its doorbell.
+ */
+typedef struct tag_shm_ring_header {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> producer_waiting;
+}SHM_RING_HEADER;
+
+/**
+ * Single producer, single consumer queue of variable length messages, living in memory shared with another process.
+ *
+ * Records are contiguous, so that the producer writes messages in place (reserve + commit)
+ * and the consumer processes them without copying (front + pop).
+ * Record headers are only written on commit and copied on front, so the length used is always the validated one.
+ * Doorbells are eventfds, only written when the other side announced it is waiting.
+ * Positions written by the other process are validated, so that a misbehaving peer cannot make us access
+ * memory outside of the ring: the ring is reported as corrupt instead.
+ */
+class SharedRing {
+public:
+    SharedRing();
+    void attach(SHM_RING_HEADER * header, char * data, int consumerDoorbell, int producerDoorbell);
+    static bool fits(size_t len);
+    //Producer side
+    char * reserve(size_t len);
+    void commit(uint8_t type, uint8_t priority, uint8_t marker, uint8_t port = 0);
+    bool waitForSpace(size_t len);
+    //Consumer side
+    char * front(SHM_RECORD * record);
+    void pop();
+    bool waitForData();
+    bool isCorrupt();
+
+private:
+    SHM_RING_HEADER * header;
+    char * data;
+    int consumer_doorbell;
+    int producer_doorbell;
+    SHM_RECORD * pending_record;
+    uint32_t pending_length;
+    uint64_t next_position;
+    bool corrupt;
+
+    static size_t getRecordSize(size_t len);
+};
+
+/**
+ * Shared memory region holding one ring per direction, set up during the handshake of an application.
+ *
+ * The application creates the region (a memfd) and the two doorbells, then passes them to the daemon
+ * along with its configuration. Upstream carries messages from the application to the daemon,
+ * downstream carries delivered messages from the daemon to the application.
+ */
+class SharedMemoryChannel {
+public:
+    SharedMemoryChannel();
+    ~SharedMemoryChannel();
+    int create();
+    int attach(int memfd, int appDoorbell, int daemonDoorbell);
+    int getMemfd();
+    int getAppDoorbell();
+    int getDaemonDoorbell();
+    SharedRing * getUpstream();
+    SharedRing * getDownstream();
+    static size_t getRegionSize();
+    static void ringDoorbell(int doorbell);
+    static void clearDoorbell(int doorbell);
+
+private:
+    int memfd;
+    int app_doorbell;
+    int daemon_doorbell;
+    char * region;
+    SharedRing upstream;
+    SharedRing downstream;
+
+    int map();
+};
+
+#endif //S3TP_SHAREDRING_H
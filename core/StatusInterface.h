@@ -10,8 +10,13 @@ public:
     virtual void onLinkStatusChanged(bool active) = 0;
     virtual void onChannelStatusChanged(uint8_t channel, bool active) = 0;
     virtual void onError(int error, void * params) = 0;
-    virtual void onSynchronization(uint8_t syncId) = 0;
+    virtual void onSynchronization(uint8_t syncId, uint8_t syncSeq) = 0;
+    virtual void onSynchronizationAck(uint8_t syncSeq) = 0;
+    virtual void onResyncRequested() = 0;
     virtual void onOutputQueueAvailable(uint8_t port) = 0;
+    virtual void onMessageConsumed(uint8_t port, uint16_t nextSeq) = 0;
+    virtual void onAcknowledgement(uint8_t port, uint16_t nextSeq) = 0;
+    virtual void onSequenceModeOffered(bool wide) = 0;
 };
 
 #endif //S3TP_LINKSTATUSINTERFACE_H
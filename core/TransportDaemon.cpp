@@ -4,6 +4,9 @@
 
 #include "TransportDaemon.h"
 
+s3tp_daemon::s3tp_daemon() : reactor(&s3tp) {
+}
+
 int s3tp_daemon::init(void * args) {
     if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
         LOG_ERROR("Error creating daemon socket");
@@ -27,87 +30,39 @@ int s3tp_daemon::init(void * args) {
     return CODE_SUCCESS;
 }
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wmissing-noreturn"
-void s3tp_daemon::startDaemon() {
-    sockaddr_un cl_address;
-    socklen_t addrlen;
-    SOCKET new_socket;
-    S3TP_CONFIG config;
-    ssize_t rd, wr;
-    int commCode;
-
-    //Initializing struct for Client handshake timeout
-    struct timeval tv;
-
-    tv.tv_sec = 2;  /* 30 Secs Timeout */
-    tv.tv_usec = 0;  // Initialize to 0
-
-    listen(server, 5);
-    addrlen = sizeof (struct sockaddr_in);
-
-    //Ignore sigpipe signal in case a thread receives a forced disconnection
-    signal(SIGPIPE, SIG_IGN);
-    LOG_INFO("Daemon started listening...");
-
-    //Start s3tp_daemon service
-    while (true) {
-        new_socket = accept(server, (struct sockaddr *)&cl_address, &addrlen);
-        if (new_socket < 0) {
-            LOG_ERROR("Error connecting to new client");
-            continue;
-        }
+int s3tp_daemon::loadContactSchedule(const char * path) {
+    return s3tp.loadContactSchedule(path);
+}
 
-        LOG_INFO(std::string("Connected to new client on socket " + std::to_string(new_socket)));
+int s3tp_daemon::loadReceivePolicies(const char * path) {
+    return s3tp.loadReceivePolicies(path);
+}
 
-        //Remove disconnected clients from structure
-        s3tp.cleanupClients();
+int s3tp_daemon::loadTransmitPolicies(const char * path) {
+    return s3tp.loadTransmitPolicies(path);
+}
 
-        tv.tv_sec = 2;
-        setsockopt(new_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv,sizeof(struct timeval));
-        //Receive Client configuration
-        rd = read(new_socket, &config, sizeof(S3TP_CONFIG));
-        if (rd <= 0) {
-            LOG_WARN("Error reading from new connection to client. Closing socket");
-            close(new_socket);
-            continue;
-        }
+void s3tp_daemon::setAcknowledgementDelay(uint64_t delay) {
+    s3tp.setAcknowledgementDelay(delay);
+}
 
-        LOG_DEBUG(std::string("Received configuration from new client on socket "
-                              + std::to_string(new_socket)
-                              + ": port " + std::to_string((int)config.port)
-                              + ", channel: " + std::to_string((int)config.channel)));
+/**
+ * Allows the session to use 16 bit sequences (see S3TP::setWideSequencesEnabled). Has to be called before init.
+ */
+void s3tp_daemon::setWideSequencesEnabled(bool enabled) {
+    s3tp.setWideSequencesEnabled(enabled);
+}
 
-        tv.tv_sec = 0;
-        setsockopt(new_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(struct timeval));
-        if (s3tp.getClientConnectedToPort(config.port) != NULL) {
-            //A Client is already registered to this port
-            commCode = CODE_SERVER_PORT_BUSY;
-            if (write(new_socket, &commCode, sizeof(commCode)) != 0) {
-                close(new_socket);
-            }
-            LOG_INFO(std::string("Refused client " + std::to_string(new_socket)
-                                 + " as port " + std::to_string((int)config.port) + " is currently busy"));
+void s3tp_daemon::startDaemon() {
+    listen(server, DAEMON_LISTEN_BACKLOG);
 
-        } else {
-            commCode = CODE_SERVER_ACCEPT;
-            wr = write(new_socket, &commCode, sizeof(commCode));
-            if (wr == 0) {
-                LOG_WARN(std::string("Client " + std::to_string(new_socket) + " disconnected unexpectedly"));
-                continue;
-            } else if (wr < 0) {
-                LOG_WARN(std::string("Communication error with client " + std::to_string(new_socket)
-                                     + ". Closing socket"));
-                close(new_socket);
-                continue;
-            }
-            /*
-             * Create new Client with app_port.
-             * Client automatically starts working in background (on a different thread)
-             * S3tp module gets notified automatically of the new connection through the Client interface callback
-             */
-            new Client(new_socket, config, &s3tp);
-        }
+    //Ignore sigpipe signal in case a client is forcefully disconnected while writing to it
+    signal(SIGPIPE, SIG_IGN);
+    if (reactor.init(server) != CODE_SUCCESS) {
+        LOG_ERROR("Couldn't start daemon event loop");
+        return;
     }
+
+    //All clients are served by the reactor, on this thread
+    reactor.run();
 }
-#pragma clang diagnostic pop
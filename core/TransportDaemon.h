@@ -18,15 +18,26 @@
 #include <map>
 #include <csignal>
 #include "S3TP.h"
+#include "Reactor.h"
+
+//Connections waiting to be accepted by the reactor
+#define DAEMON_LISTEN_BACKLOG 128
 
 class s3tp_daemon {
 private:
     sockaddr_un address;
     SOCKET server;
     S3TP s3tp;
+    Reactor reactor;
 
 public:
+    s3tp_daemon();
     int init(void * args);
+    int loadContactSchedule(const char * path);
+    int loadReceivePolicies(const char * path);
+    int loadTransmitPolicies(const char * path);
+    void setAcknowledgementDelay(uint64_t delay);
+    void setWideSequencesEnabled(bool enabled);
     void startDaemon();
 };
 
@@ -3,15 +3,33 @@
 //
 
 #include "TxModule.h"
+#include <fstream>
+#include <sstream>
 
 //Ctor
 TxModule::TxModule() {
     state = WAITING;
     global_seq_num = 0;
+    wide_sequences_enabled = false;
+    peer_wide_sequences = false;
+    wide_sequences = false;
     scheduled_sync = false;
+    scheduled_sync_ack = false;
+    sync_deadline = 0;
+    last_sync_time = 0;
+    sync_seq = 0;
+    peer_sync_seq = 0;
+    awaiting_sync_ack = false;
+    resync_requested = true;
+    resync_sent = false;
+    ack_deadline = 0;
+    ack_delay = DEFAULT_ACK_DELAY;
     sendingFragments = false;
     active = false;
     currentPort = 0;
+    statusInterface = NULL;
+    link_up = false;
+    std::fill(channel_credit, channel_credit + S3TP_VIRTUAL_CHANNELS, DEFAULT_CHANNEL_CREDIT);
 
     //Setting up unique sync packet
     syncPacket.channel = DEFAULT_SYNC_CHANNEL;
@@ -25,8 +43,10 @@ TxModule::TxModule() {
     hdr->seq_port = 0;
 
     pthread_mutex_init(&tx_mutex, NULL);
-    pthread_cond_init(&tx_cond, NULL);
+    init_monotonic_cond(&tx_cond);
     outBuffer = new Buffer(this);
+    memoryBudget = new MemoryBudget(DEFAULT_TX_MEMORY_BUDGET, DEFAULT_TX_PORT_QUOTA);
+    planner = new ContactPlanner();
     LOG_DEBUG("Created Tx Module");
 }
 
@@ -35,6 +55,8 @@ TxModule::~TxModule() {
     pthread_mutex_lock(&tx_mutex);
     state = WAITING;
     delete outBuffer;
+    delete memoryBudget;
+    delete planner;
     pthread_mutex_unlock(&tx_mutex);
     pthread_mutex_destroy(&tx_mutex);
     LOG_DEBUG("Destroyed Tx Module");
@@ -43,28 +65,232 @@ TxModule::~TxModule() {
 void TxModule::reset() {
     pthread_mutex_lock(&tx_mutex);
     global_seq_num = 0;
-    port_sequence.clear();
+    peer_wide_sequences = false;
+    wide_sequences = false;
     to_consume_port_seq.clear();
+    acked_port_seq.clear();
+    sent_port_seq.clear();
+    awaiting_sync_ack = false;
+    //Other side may still hold sequences from before the reset
+    resync_requested = true;
+    resync_sent = false;
+    pending_acks.clear();
     outBuffer->clear();
+    memoryBudget->reset();
+    refused_ports.clear();
+    planned_messages.clear();
+    std::fill(channel_credit, channel_credit + S3TP_VIRTUAL_CHANNELS, DEFAULT_CHANNEL_CREDIT);
     pthread_mutex_unlock(&tx_mutex);
 }
 
+/**
+ * Sends all pending sync requests as one single sync packet.
+ * The packet only contains the sequences of those ports which changed since the last sync
+ * that was acknowledged by the receiver. Sequences refer to the next packet that will be sent on each port.
+ */
 void TxModule::synchronizeStatus() {
     //Not locking, as the method should only be called from a synchronized code block
     S3TP_SYNC * syncStructure = (S3TP_SYNC *)syncPacket.getPayload();
-    std::fill(syncStructure->port_seq, syncStructure->port_seq + DEFAULT_MAX_OUT_PORTS, 0);
+    syncStructure->flags = wide_sequences_enabled ? S3TP_SYNC_FLAG_WIDE_SEQ : 0;
     syncStructure->tx_global_seq = global_seq_num;
-    for (std::map<uint8_t, uint8_t>::iterator it = port_sequence.begin(); it != port_sequence.end(); ++it) {
-        syncStructure->port_seq[it->first] = it->second;
+    syncStructure->entry_count = 0;
+    if (scheduled_sync) {
+        syncStructure->syncId = S3TP_SYNC_INITIATOR;
+        syncStructure->sync_seq = ++sync_seq;
+        if (scheduled_sync_ack) {
+            //Piggybacking the pending ack on our own sync
+            syncStructure->flags |= S3TP_SYNC_FLAG_ACK;
+        }
+        if (resync_requested) {
+            //Receiver must not rely on any baseline of its own until this sync was acknowledged
+            syncStructure->flags |= S3TP_SYNC_FLAG_RESYNC;
+        }
+        resync_sent = resync_requested;
+        //Remembering what was sent, so that it becomes the new baseline once the receiver acknowledges it
+        sent_port_seq = to_consume_port_seq;
+        awaiting_sync_ack = true;
+    } else {
+        syncStructure->syncId = S3TP_SYNC_ACK;
+        syncStructure->sync_seq = sync_seq;
+    }
+    syncStructure->ack_seq = peer_sync_seq;
+
+    for (auto const &it : to_consume_port_seq) {
+        std::map<uint8_t, uint16_t>::iterator acked = acked_port_seq.find(it.first);
+        if (acked == acked_port_seq.end() || acked->second != it.second) {
+            S3TP_SYNC_ENTRY& entry = syncStructure->entries[syncStructure->entry_count++];
+            entry.port = it.first;
+            entry.seq = it.second;
+        }
     }
 
     S3TP_HEADER * hdr = syncPacket.getHeader();
+    hdr->setPduLength(syncStructure->getLength());
     uint16_t crc = calc_checksum(syncPacket.getPayload(), hdr->getPduLength());
     hdr->crc = crc;
 
     bool arq = S3TP_ARQ;
-    LOG_DEBUG("TX: Sync Packet sent to receiver");
+    LOG_DEBUG(std::string("TX: Sync Packet sent to receiver ("
+                          + std::to_string((int)syncStructure->entry_count) + " port sequences)"));
     linkInterface->sendFrame(arq, syncPacket.channel, syncPacket.packet, syncPacket.getLength());
+
+    scheduled_sync = false;
+    scheduled_sync_ack = false;
+    last_sync_time = get_monotonic_time_ms();
+}
+
+/**
+ * Sends a sync packet without any port sequences, which is not answered by the receiver.
+ * It only serves to refresh the global sequence on the other side while no other sync is needed.
+ */
+void TxModule::sendKeepalive() {
+    //Not locking, as the method should only be called from a synchronized code block
+    S3TP_SYNC * syncStructure = (S3TP_SYNC *)syncPacket.getPayload();
+    syncStructure->syncId = S3TP_SYNC_INITIATOR;
+    syncStructure->flags = S3TP_SYNC_FLAG_KEEPALIVE;
+    if (wide_sequences_enabled) {
+        syncStructure->flags |= S3TP_SYNC_FLAG_WIDE_SEQ;
+    }
+    syncStructure->sync_seq = sync_seq;
+    syncStructure->ack_seq = peer_sync_seq;
+    syncStructure->tx_global_seq = global_seq_num;
+    syncStructure->entry_count = 0;
+
+    S3TP_HEADER * hdr = syncPacket.getHeader();
+    hdr->setPduLength(syncStructure->getLength());
+    hdr->crc = calc_checksum(syncPacket.getPayload(), hdr->getPduLength());
+
+    LOG_DEBUG("TX: Keepalive sent to receiver");
+    linkInterface->sendFrame(false, syncPacket.channel, syncPacket.packet, syncPacket.getLength());
+
+    last_sync_time = get_monotonic_time_ms();
+}
+
+/**
+ * Waits until either new data is available, or the next sync (or keepalive) needs to be sent.
+ * Must be called while holding the tx_mutex.
+ */
+void TxModule::waitForSyncEvent() {
+    if (!_isChannelAvailable(DEFAULT_SYNC_CHANNEL)) {
+        //Channel will be whitelisted again by the link layer, which also wakes up the routine
+        pthread_cond_wait(&tx_cond, &tx_mutex);
+        return;
+    }
+    struct timespec deadline;
+    uint64_t wakeup = (scheduled_sync || scheduled_sync_ack) ?
+                      sync_deadline :
+                      last_sync_time + SYNC_KEEPALIVE_INTERVAL;
+    if (!pending_acks.empty() && ack_deadline < wakeup) {
+        wakeup = ack_deadline;
+    }
+    if (channel_credit[DEFAULT_SYNC_CHANNEL] == 0) {
+        //Sync cannot be sent before the transceiver has room for it again
+        wakeup = MAX(wakeup, get_monotonic_time_ms() + CHANNEL_CREDIT_PROBE_INTERVAL);
+    }
+    compute_monotonic_deadline(&deadline, wakeup);
+    pthread_cond_timedwait(&tx_cond, &tx_mutex, &deadline);
+}
+
+/**
+ * Sends all pending acknowledgements inside a standalone frame.
+ * Must be called while holding the tx_mutex.
+ */
+void TxModule::sendAcknowledgement() {
+    S3TP_HEADER * hdr = (S3TP_HEADER *)frame_buffer;
+    memset(hdr, 0, sizeof(S3TP_HEADER));
+    hdr->setMessageType(S3TP_MSG_ACK);
+    hdr->setPduLength(0);
+    hdr->crc = calc_checksum(frame_buffer + sizeof(S3TP_HEADER), 0);
+
+    int length = sizeof(S3TP_HEADER);
+    length += _appendAcknowledgements(frame_buffer + length, MAX_LEN_S3TP_FRAME - length);
+
+    LOG_DEBUG("TX: Standalone acknowledgement sent to receiver");
+    linkInterface->sendFrame(false, DEFAULT_SYNC_CHANNEL, frame_buffer, length);
+}
+
+/**
+ * Writes as many pending acknowledgements as fit into the given space.
+ * Acknowledgements that were written are not pending anymore.
+ * Must be called while holding the tx_mutex.
+ * @return  The amount of bytes written, or 0 if not even one acknowledgement fits.
+ */
+int TxModule::_appendAcknowledgements(char * buffer, int maxLength) {
+    if (maxLength < (int)(LEN_S3TP_ACK_HDR + sizeof(S3TP_SYNC_ENTRY))) {
+        return 0;
+    }
+    S3TP_ACK * ack = (S3TP_ACK *)buffer;
+    ack->entry_count = 0;
+    std::map<uint8_t, uint16_t>::iterator it = pending_acks.begin();
+    while (it != pending_acks.end()
+           && LEN_S3TP_ACK_HDR + (ack->entry_count + 1) * sizeof(S3TP_SYNC_ENTRY) <= (size_t)maxLength) {
+        S3TP_SYNC_ENTRY& entry = ack->entries[ack->entry_count++];
+        entry.port = it->first;
+        entry.seq = it->second;
+        it = pending_acks.erase(it);
+    }
+    ack->crc = calc_checksum(buffer + sizeof(uint16_t), (uint16_t)(ack->getLength() - sizeof(uint16_t)));
+    return ack->getLength();
+}
+
+/**
+ * Schedules a cumulative acknowledgement for a port, i.e. the next port sequence expected from the other side.
+ * The acknowledgement is piggybacked on the next data frame or, if none is sent within the ack delay,
+ * sent within a standalone frame. Newer acknowledgements for the same port replace older ones.
+ */
+void TxModule::scheduleAcknowledgement(uint8_t port, uint16_t nextSeq) {
+    pthread_mutex_lock(&tx_mutex);
+    if (pending_acks.empty()) {
+        ack_deadline = get_monotonic_time_ms() + ack_delay;
+        pthread_cond_signal(&tx_cond);
+    }
+    pending_acks[port] = nextSeq;
+    pthread_mutex_unlock(&tx_mutex);
+}
+
+/**
+ * Nothing is retransmitted on the transport level, so the acknowledgements of the other side are only traced.
+ */
+void TxModule::handleAcknowledgement(uint8_t port, uint16_t nextSeq) {
+    LOG_DEBUG(std::string("TX: Port " + std::to_string((int)port) + " acknowledged up to sequence "
+                          + std::to_string((int)nextSeq)));
+}
+
+void TxModule::setAcknowledgementDelay(uint64_t delay) {
+    pthread_mutex_lock(&tx_mutex);
+    ack_delay = delay;
+    pthread_mutex_unlock(&tx_mutex);
+}
+
+/**
+ * Offers wide (16 bit) sequences to the other side with every sync.
+ * Wide sequences are only used once the other side offered them as well.
+ * The offer is part of the session, so it can only be changed before the routine is started.
+ */
+void TxModule::setWideSequencesEnabled(bool enabled) {
+    pthread_mutex_lock(&tx_mutex);
+    if (active) {
+        LOG_WARN("TX: Cannot change the sequence mode of a running session");
+    } else {
+        wide_sequences_enabled = enabled;
+    }
+    pthread_mutex_unlock(&tx_mutex);
+}
+
+void TxModule::setPeerWideSequences(bool wide) {
+    pthread_mutex_lock(&tx_mutex);
+    if (wide != peer_wide_sequences) {
+        LOG_INFO(std::string("TX: Other side ") + (wide ? "offers" : "doesn't support") + " wide sequences");
+    }
+    peer_wide_sequences = wide;
+    pthread_mutex_unlock(&tx_mutex);
+}
+
+bool TxModule::isUsingWideSequences() {
+    pthread_mutex_lock(&tx_mutex);
+    bool result = wide_sequences;
+    pthread_mutex_unlock(&tx_mutex);
+    return result;
 }
 
 void TxModule::setStatusInterface(StatusInterface * statusInterface) {
@@ -77,23 +303,44 @@ void TxModule::setStatusInterface(StatusInterface * statusInterface) {
 void TxModule::txRoutine() {
     pthread_mutex_lock(&tx_mutex);
     while(active) {
-        if (!linkInterface->getLinkStatus() || !_channelsAvailable()) {
+        bool linkStatus = linkInterface->getLinkStatus();
+        if (linkStatus != link_up) {
+            link_up = linkStatus;
+            if (link_up) {
+                //Acquisition of signal: deciding what to send during this contact
+                _planContact();
+            } else {
+                planned_messages.clear();
+            }
+        }
+        if (!linkStatus || !_channelsAvailable()) {
             state = BLOCKED;
             pthread_cond_wait(&tx_cond, &tx_mutex);
             continue;
         }
-        //Sync has priority over any other packet
-        if (scheduled_sync && _isChannelAvailable(DEFAULT_SYNC_CHANNEL)) {
-            if (linkInterface->getBufferFull(DEFAULT_SYNC_CHANNEL)) {
-                _setChannelAvailable(DEFAULT_SYNC_CHANNEL, false);
-            } else {
-                synchronizeStatus();
-                scheduled_sync = false;
+        //Sync has priority over any other packet, once its debounce window expired
+        uint64_t now = get_monotonic_time_ms();
+        if (_isChannelAvailable(DEFAULT_SYNC_CHANNEL)) {
+            bool syncDue = (scheduled_sync || scheduled_sync_ack) && now >= sync_deadline;
+            bool keepaliveDue = !scheduled_sync && !scheduled_sync_ack
+                                && now >= last_sync_time + SYNC_KEEPALIVE_INTERVAL;
+            if ((syncDue || keepaliveDue) && _hasCredit(DEFAULT_SYNC_CHANNEL)) {
+                if (syncDue) {
+                    synchronizeStatus();
+                } else {
+                    sendKeepalive();
+                }
+                _consumeCredit(DEFAULT_SYNC_CHANNEL);
+            }
+            if (!pending_acks.empty() && now >= ack_deadline && _hasCredit(DEFAULT_SYNC_CHANNEL)) {
+                //No data frame was sent in time, which could have carried the acknowledgements
+                sendAcknowledgement();
+                _consumeCredit(DEFAULT_SYNC_CHANNEL);
             }
         }
         if(!outBuffer->packetsAvailable()) {
             state = WAITING;
-            pthread_cond_wait(&tx_cond, &tx_mutex);
+            waitForSyncEvent();
             continue;
         }
         state = RUNNING;
@@ -106,42 +353,79 @@ void TxModule::txRoutine() {
          */
         S3TP_PACKET * packet = (sendingFragments) ?
                                outBuffer->getNextPacket(currentPort) :
-                               outBuffer->getNextAvailablePacket();
+                               _getNextPlannedPacket();
 
         if (packet == NULL) {
-            //Channels are currently blocked and packets cannot be sent
+            //Channels are currently blocked or out of credit, hence packets cannot be sent
+            if (_probeExhaustedChannels()) {
+                continue;
+            }
             state = BLOCKED;
-            pthread_cond_wait(&tx_cond, &tx_mutex);
+            struct timespec deadline;
+            compute_monotonic_deadline(&deadline, get_monotonic_time_ms() + CHANNEL_CREDIT_PROBE_INTERVAL);
+            pthread_cond_timedwait(&tx_cond, &tx_mutex, &deadline);
             continue;
         }
+        if (!sendingFragments) {
+            //Sequence mode only changes between messages, so that all fragments of a message use the same one
+            wide_sequences = wide_sequences_enabled && peer_wide_sequences;
+        }
         S3TP_HEADER * hdr = packet->getHeader();
         currentPort = hdr->getPort();
         sendingFragments = hdr->moreFragments();
 
-        hdr->setGlobalSequence(global_seq_num);
+        bool wide = wide_sequences;
+        uint16_t globalSeq = global_seq_num;
         if (!hdr->moreFragments()) {
             //Need to increase the current global sequence
-            global_seq_num++;
+            global_seq_num = nextSequence(global_seq_num, wide);
+        }
+        /*
+         * Port sequence is assigned only now, as messages of a higher priority class may overtake
+         * messages that were enqueued earlier on the same port.
+         * The receiver will therefore deliver messages in the order in which they were transmitted.
+         */
+        uint16_t portSeq = to_consume_port_seq[hdr->getPort()];
+        to_consume_port_seq[hdr->getPort()] = nextSequence(portSeq, wide);
+        hdr->setGlobalSequence((uint8_t)globalSeq);
+        hdr->seq_port = (uint8_t)portSeq;
+        hdr->setWideSequences(wide);
+        packet->ext.global_seq_high = (uint8_t)(globalSeq >> 8);
+        packet->ext.port_seq_high = (uint8_t)(portSeq >> 8);
+        _consumeCredit(packet->channel);
+        size_t footprint = PACKET_MEMORY_OVERHEAD + hdr->getPduLength();
+
+        char * frame = packet->packet;
+        int frameLength = packet->getLength();
+        if (wide || !pending_acks.empty()) {
+            //Frame differs from the buffered packet, so it is assembled separately
+            frameLength = sizeof(S3TP_HEADER);
+            memcpy(frame_buffer, packet->packet, sizeof(S3TP_HEADER));
+            if (wide) {
+                memcpy(frame_buffer + frameLength, &packet->ext, sizeof(S3TP_HEADER_EXT));
+                frameLength += sizeof(S3TP_HEADER_EXT);
+            }
+            memcpy(frame_buffer + frameLength, packet->getPayload(), hdr->getPduLength());
+            frameLength += hdr->getPduLength();
+            //Piggybacking pending acknowledgements on the data frame, if there is room left
+            frameLength += _appendAcknowledgements(frame_buffer + frameLength, MAX_LEN_S3TP_FRAME - frameLength);
+            frame = frame_buffer;
         }
-        to_consume_port_seq[hdr->getPort()]++;
         pthread_mutex_unlock(&tx_mutex);
 
         LOG_DEBUG(std::string("TX: Packet sent from port " + std::to_string((int)hdr->getPort())
-                              + " to Link Layer -> glob_seq: " + std::to_string((int)hdr->getGlobalSequence())
+                              + " to Link Layer -> glob_seq: " + std::to_string((int)globalSeq)
                               + ", sub_seq: " + std::to_string((int)hdr->getSubSequence())
-                              + ", port_seq: " + std::to_string((int)hdr->seq_port)));
+                              + ", port_seq: " + std::to_string((int)portSeq)));
 
         bool arq = packet->options & S3TP_ARQ;
 
         //TODO: check if sendFrame failed. If yes, need to blacklist channel
-        linkInterface->sendFrame(arq, packet->channel, packet->packet, packet->getLength());
+        linkInterface->sendFrame(arq, packet->channel, frame, frameLength);
         //TODO: save in history queue (once implemented)
 
-        //Since a packet was just popped from the buffer, the queue is definitely available
-        if (outBuffer->getSizeOfQueue(hdr->getPort()) + 1 == MAX_QUEUE_SIZE
-            && statusInterface != nullptr) {
-            statusInterface->onOutputQueueAvailable(hdr->getPort());
-        }
+        //Packet left the buffer, so its memory can be given back to the budget
+        releasePacketMemory(hdr->getPort(), footprint);
 
         pthread_mutex_lock(&tx_mutex);
 
@@ -152,16 +436,93 @@ void TxModule::txRoutine() {
     pthread_exit(NULL);
 }
 
-void TxModule::scheduleSync(uint8_t syncId) {
+/**
+ * Schedules a sync to be sent to the receiver.
+ * Requests arriving within the same debounce window are coalesced into a single sync packet.
+ * @param syncId  Either S3TP_SYNC_INITIATOR, or S3TP_SYNC_ACK when responding to a sync of the other side.
+ * @param peerSyncSeq  Sequence of the sync being acknowledged. Ignored for initiator syncs.
+ */
+void TxModule::scheduleSync(uint8_t syncId, uint8_t peerSyncSeq) {
     pthread_mutex_lock(&tx_mutex);
-    scheduled_sync = true;
-    S3TP_SYNC * syncStructure = (S3TP_SYNC *)syncPacket.getPayload();
-    syncStructure->syncId = syncId;
+    if (!scheduled_sync && !scheduled_sync_ack) {
+        //Opening a new debounce window
+        sync_deadline = get_monotonic_time_ms() + SYNC_DEBOUNCE_WINDOW;
+    }
+    if (syncId == S3TP_SYNC_ACK) {
+        scheduled_sync_ack = true;
+        peer_sync_seq = peerSyncSeq;
+    } else {
+        scheduled_sync = true;
+    }
     //Notifying routine thread that a new sync message is waiting
     pthread_cond_signal(&tx_cond);
     pthread_mutex_unlock(&tx_mutex);
 }
 
+void TxModule::acknowledgeSync(uint8_t syncSeq) {
+    pthread_mutex_lock(&tx_mutex);
+    //Acks for older syncs are ignored, as the next delta will still be computed against the old baseline
+    if (awaiting_sync_ack && syncSeq == sync_seq) {
+        acked_port_seq = sent_port_seq;
+        awaiting_sync_ack = false;
+        if (resync_sent) {
+            resync_requested = false;
+            resync_sent = false;
+        }
+        LOG_DEBUG(std::string("TX: Sync " + std::to_string((int)syncSeq) + " acknowledged by receiver"));
+    }
+    pthread_mutex_unlock(&tx_mutex);
+}
+
+/**
+ * Drops the sequences acknowledged by the receiver, because it lost them (e.g. after a restart).
+ * Following syncs contain all port sequences, until one of them is acknowledged again.
+ */
+void TxModule::resetSyncBaseline() {
+    pthread_mutex_lock(&tx_mutex);
+    acked_port_seq.clear();
+    //Acks of syncs sent before must not restore the old baseline
+    awaiting_sync_ack = false;
+    //The restarted side uses narrow sequences until it offers wide ones again
+    peer_wide_sequences = false;
+    LOG_DEBUG("TX: Receiver requested a full sync");
+    pthread_mutex_unlock(&tx_mutex);
+}
+
+/**
+ * Removes a queued message (or all messages queued on the port) before it is transmitted.
+ * A message which is already being transmitted is always sent completely.
+ * @param messageId  Id of the message, or S3TP_MESSAGE_ID_ALL.
+ * @return  The amount of payload bytes that were removed.
+ */
+size_t TxModule::cancelMessages(uint8_t port, uint32_t messageId) {
+    size_t bytes = 0, footprint = 0;
+
+    pthread_mutex_lock(&tx_mutex);
+    std::vector<S3TP_PACKET *> removed = outBuffer->removeMessages(port, messageId);
+    std::deque<S3TP_MESSAGE_INFO>::iterator it = planned_messages.begin();
+    while (it != planned_messages.end()) {
+        if (it->port == port && (messageId == S3TP_MESSAGE_ID_ALL || it->message_id == messageId)) {
+            it = planned_messages.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    pthread_mutex_unlock(&tx_mutex);
+
+    for (auto const &packet : removed) {
+        bytes += packet->getHeader()->getPduLength();
+        footprint += PACKET_MEMORY_OVERHEAD + packet->getHeader()->getPduLength();
+        delete packet;
+    }
+    if (footprint > 0) {
+        releasePacketMemory(port, footprint);
+    }
+    LOG_DEBUG(std::string("TX: Cancelled " + std::to_string(removed.size()) + " packets on port "
+                          + std::to_string((int)port) + " (" + std::to_string(bytes) + " bytes)"));
+    return bytes;
+}
+
 void * TxModule::staticTxRoutine(void * args) {
     static_cast<TxModule*>(args)->txRoutine();
     return NULL;
@@ -172,6 +533,8 @@ void TxModule::startRoutine(Transceiver::LinkInterface * spi_if) {
     pthread_mutex_lock(&tx_mutex);
     linkInterface = spi_if;
     active = true;
+    link_up = false;
+    last_sync_time = get_monotonic_time_ms();
     int txId = pthread_create(&tx_thread, NULL, &TxModule::staticTxRoutine, this);
     pthread_mutex_unlock(&tx_mutex);
 
@@ -194,14 +557,165 @@ TxModule::STATE TxModule::getCurrentState() {
     return current;
 }
 
-bool TxModule::isQueueAvailable(uint8_t port, uint8_t no_packets) {
-    return outBuffer->getSizeOfQueue(port) + no_packets <= MAX_QUEUE_SIZE;
+/**
+ * Computes the memory needed for buffering a message of the given length, including all of its fragments.
+ */
+size_t TxModule::computeMemoryFootprint(size_t len) {
+    size_t no_packets = len / LEN_S3TP_PDU;
+    if (len % LEN_S3TP_PDU > 0 || len == 0) {
+        no_packets += 1;
+    }
+    return no_packets * PACKET_MEMORY_OVERHEAD + len;
+}
+
+/**
+ * Charges the memory needed by a message of the given length to the port, if the budget allows it.
+ * If the message is refused, the port will be notified via the status interface
+ * as soon as enough memory for such a message is available again.
+ * On ports with the S3TP_OPTION_SUPERSEDE option, the memory of the queued messages counts as available,
+ * as the new message replaces them when written. They stay queued until then, even if the message is refused.
+ * @return  True if the message can be enqueued, false otherwise.
+ */
+bool TxModule::admitMessage(uint8_t port, size_t len, uint8_t options) {
+    size_t footprint = computeMemoryFootprint(len);
+    size_t replaced = 0;
+    if (options & S3TP_OPTION_SUPERSEDE) {
+        size_t packets;
+        size_t payload = outBuffer->getSupersededPayload(port, &packets);
+        replaced = packets * PACKET_MEMORY_OVERHEAD + payload;
+    }
+    pthread_mutex_lock(&tx_mutex);
+    bool result = memoryBudget->reserve(port, footprint, replaced);
+    if (!result) {
+        refused_ports[port] = footprint;
+    }
+    pthread_mutex_unlock(&tx_mutex);
+    return result;
+}
+
+/**
+ * Gives back the memory charged for a message (or the remaining part of a message) that will not be enqueued.
+ */
+void TxModule::releaseMessage(uint8_t port, size_t len) {
+    releasePacketMemory(port, computeMemoryFootprint(len));
+}
+
+int TxModule::setPortQuota(uint8_t port, size_t bytes) {
+    if (bytes > MAX_QUEUE_SIZE) {
+        //The queue of a port could not hold that many packets anyway
+        return CODE_ERROR_BUDGET_EXCEEDED;
+    }
+    return memoryBudget->setPortQuota(port, bytes);
+}
+
+int TxModule::setPortReservation(uint8_t port, size_t bytes) {
+    return memoryBudget->setPortReservation(port, bytes);
+}
+
+/**
+ * Loads the transmit quotas, reservations and deadlines of the ports from a file.
+ * Every line has the format "port quota [reservation [deadline]]", with sizes in bytes and the deadline in ms
+ * (the maximum age of a message when sent, 0 meaning no deadline). Lines starting with '#' are ignored.
+ * Ports not listed in the file keep their current settings. Nothing is applied if the file is invalid.
+ */
+int TxModule::loadTransmitPolicies(const char * path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        LOG_ERROR(std::string("Couldn't open transmit policies " + std::string(path)));
+        return CODE_ERROR_POLICY_FILE;
+    }
+
+    std::map<uint8_t, std::pair<size_t, size_t>> policies;
+    std::map<uint8_t, uint64_t> deadlines;
+    std::string line;
+    int lineNo = 0;
+    size_t reservedTotal = 0;
+    while (std::getline(file, line)) {
+        lineNo++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream stream(line);
+        int port;
+        long long quota;
+        long long reservation = 0;
+        long long deadline = 0;
+        if (!(stream >> port >> quota) || port < 0 || port >= DEFAULT_MAX_OUT_PORTS
+            || quota < 0 || quota > MAX_QUEUE_SIZE) {
+            LOG_ERROR(std::string("Invalid transmit policy in line " + std::to_string(lineNo)));
+            return CODE_ERROR_POLICY_FORMAT;
+        }
+        if ((!(stream >> reservation) || !(stream >> deadline)) && !stream.eof()) {
+            LOG_ERROR(std::string("Invalid transmit reservation or deadline in line " + std::to_string(lineNo)));
+            return CODE_ERROR_POLICY_FORMAT;
+        }
+        if (deadline < 0) {
+            LOG_ERROR(std::string("Invalid transmit deadline in line " + std::to_string(lineNo)));
+            return CODE_ERROR_POLICY_FORMAT;
+        }
+        if (reservation < 0 || reservation > quota) {
+            LOG_ERROR(std::string("Transmit reservation exceeds the quota in line " + std::to_string(lineNo)));
+            return CODE_ERROR_POLICY_FORMAT;
+        }
+        if (policies.find((uint8_t)port) != policies.end()) {
+            reservedTotal -= policies[(uint8_t)port].second;
+        }
+        policies[(uint8_t)port] = std::make_pair((size_t)quota, (size_t)reservation);
+        reservedTotal += (size_t)reservation;
+        deadlines[(uint8_t)port] = (uint64_t)deadline;
+    }
+    if (reservedTotal > memoryBudget->getLimit()) {
+        LOG_ERROR("Transmit reservations exceed the transmit budget");
+        return CODE_ERROR_POLICY_FORMAT;
+    }
+
+    for (auto& entry : policies) {
+        //Dropping the old reservation first, as the quota may not go below it
+        if (memoryBudget->setPortReservation(entry.first, 0) != CODE_SUCCESS
+            || setPortQuota(entry.first, entry.second.first) != CODE_SUCCESS
+            || setPortReservation(entry.first, entry.second.second) != CODE_SUCCESS) {
+            LOG_ERROR(std::string("Couldn't apply the transmit policy of port " + std::to_string((int)entry.first)));
+            return CODE_ERROR_POLICY_FORMAT;
+        }
+        setPortDeadline(entry.first, deadlines[entry.first]);
+    }
+    LOG_INFO(std::string("Loaded transmit policies for " + std::to_string(policies.size()) + " ports"));
+    return CODE_SUCCESS;
+}
+
+void TxModule::releasePacketMemory(uint8_t port, size_t bytes) {
+    std::vector<uint8_t> availablePorts;
+
+    memoryBudget->release(port, bytes);
+    pthread_mutex_lock(&tx_mutex);
+    std::map<uint8_t, size_t>::iterator it = refused_ports.begin();
+    while (it != refused_ports.end()) {
+        if (memoryBudget->canReserve(it->first, it->second)) {
+            availablePorts.push_back(it->first);
+            it = refused_ports.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    StatusInterface * listener = statusInterface;
+    pthread_mutex_unlock(&tx_mutex);
+
+    //Notifying outside of the critical section, as listener may write to client sockets
+    if (listener != NULL) {
+        for (auto const &availablePort : availablePorts) {
+            listener->onOutputQueueAvailable(availablePort);
+        }
+    }
 }
 
 void TxModule::setChannelAvailable(uint8_t channel, bool available) {
     pthread_mutex_lock(&tx_mutex);
     if (available) {
         channel_blacklist.erase(channel);
+        //Channel buffer inside the transceiver is empty again
+        if (channel < S3TP_VIRTUAL_CHANNELS) {
+            channel_credit[channel] = DEFAULT_CHANNEL_CREDIT;
+        }
         LOG_DEBUG(std::string("Whitelisted channel " + std::to_string((int)channel)));
         pthread_cond_signal(&tx_cond);
     } else {
@@ -219,6 +733,82 @@ bool TxModule::isChannelAvailable(uint8_t channel) {
     return result;
 }
 
+int TxModule::loadContactSchedule(const char * path) {
+    return planner->loadSchedule(path);
+}
+
+void TxModule::setPortDeadline(uint8_t port, uint64_t maxAge) {
+    planner->setPortDeadline(port, maxAge);
+}
+
+/*
+ * Internal contact planning methods (do not use locking)
+ */
+
+/**
+ * Plans the current (or next) contact window with the messages that are queued right now.
+ * The plan replaces any previous one and is followed by the Tx routine until it is exhausted.
+ * This happens on every acquisition of signal.
+ * @return  The plan, containing the messages which fit into the window and those which were deferred.
+ */
+CONTACT_PLAN TxModule::_planContact() {
+    CONTACT_PLAN result;
+    time_t now = time(NULL);
+    planned_messages.clear();
+    if (!planner->getContact(now, &result.window)) {
+        LOG_INFO("TX: No contact window known. Transmitting queued messages by priority class");
+        return result;
+    }
+    result = planner->plan(outBuffer->getQueuedMessages(), result.window, now);
+    planned_messages = result.toSend;
+
+    LOG_INFO(std::string("TX: Contact plan until LOS " + std::to_string((long long)result.window.los)
+                         + ": " + std::to_string(result.toSend.size()) + " messages ("
+                         + std::to_string(result.bytesToSend) + " bytes) to send, "
+                         + std::to_string(result.deferred.size()) + " messages ("
+                         + std::to_string(result.bytesDeferred) + " bytes) deferred"));
+    std::map<uint8_t, size_t> deferredPerPort;
+    for (auto const &it : result.deferred) {
+        deferredPerPort[it.port] += it.bytes;
+    }
+    for (auto const &it : deferredPerPort) {
+        LOG_DEBUG(std::string("TX: Port " + std::to_string((int)it.first) + " deferred "
+                              + std::to_string(it.second) + " bytes to a later contact"));
+    }
+    return result;
+}
+
+/**
+ * Returns the next packet according to the current contact plan.
+ * Messages of a higher class than the next planned one, which were queued after planning, are sent first.
+ * Planned messages whose channel is currently unavailable are passed over, keeping their place in the plan.
+ * Once the plan is exhausted (or all of it is blocked), remaining messages are sent by priority class,
+ * as long as the link stays up.
+ */
+S3TP_PACKET * TxModule::_getNextPlannedPacket() {
+    std::deque<S3TP_MESSAGE_INFO>::iterator next = planned_messages.begin();
+    while (next != planned_messages.end()) {
+        S3TP_PACKET * packet = outBuffer->getNextAvailablePacket(next->priority);
+        if (packet != NULL) {
+            return packet;
+        }
+        packet = outBuffer->getNextPacket(next->port, next->priority);
+        if (packet != NULL) {
+            //Remaining fragments are taken from the same queue by the Tx routine
+            planned_messages.erase(next);
+            return packet;
+        }
+        if (outBuffer->getSizeOfQueue(next->port, next->priority) == 0) {
+            //Message was removed from the buffer in the meantime
+            next = planned_messages.erase(next);
+        } else {
+            //Channel of the planned message is currently unavailable
+            ++next;
+        }
+    }
+    return outBuffer->getNextAvailablePacket();
+}
+
 /*
  * Internal channel utility methods
  */
@@ -241,6 +831,37 @@ bool TxModule::_isChannelAvailable(uint8_t channel) {
     return channel_blacklist.find(channel) == channel_blacklist.end();
 }
 
+bool TxModule::_hasCredit(uint8_t channel) {
+    if (channel >= S3TP_VIRTUAL_CHANNELS) {
+        return false;
+    }
+    if (channel_credit[channel] == 0 && !linkInterface->getBufferFull(channel)) {
+        //Credit estimate ran out, but the transceiver still has at least one free slot
+        channel_credit[channel] = 1;
+    }
+    return channel_credit[channel] > 0;
+}
+
+void TxModule::_consumeCredit(uint8_t channel) {
+    if (channel < S3TP_VIRTUAL_CHANNELS && channel_credit[channel] > 0) {
+        channel_credit[channel]--;
+    }
+}
+
+/**
+ * Asks the transceiver whether channels which ran out of credit can accept frames again.
+ * @return  True if at least one channel obtained new credit.
+ */
+bool TxModule::_probeExhaustedChannels() {
+    bool result = false;
+    for (uint8_t channel = 0; channel < S3TP_VIRTUAL_CHANNELS; channel++) {
+        if (channel_credit[channel] == 0 && _isChannelAvailable(channel) && _hasCredit(channel)) {
+            result = true;
+        }
+    }
+    return result;
+}
+
 void TxModule::notifyLinkAvailability(bool available) {
     if (available) {
         pthread_cond_signal(&tx_cond);
@@ -250,65 +871,111 @@ void TxModule::notifyLinkAvailability(bool available) {
 /**
  * This method is supposed to be called with an already well-formed S3TP packet.
  * The header fields will be filled within this method, but the length of the payload must be already set.
+ * The packet is put into the queue matching its port and priority class.
  * Header fields that will be filled automatically include:
- * - global sequence number;
  * - sub-sequence number (used for fragmentation);
- * - port sequence;
  * - CRC.
+ * Global sequence and port sequence are only assigned once the packet is actually transmitted.
  */
 int TxModule::enqueuePacket(S3TP_PACKET * packet,
                             uint8_t frag_no,
                             bool more_fragments,
                             uint8_t spi_channel,
                             uint8_t options) {
-    pthread_mutex_lock(&tx_mutex);
-    if (!active) {
-        //If is not active, do not attempt to enqueue something
-        pthread_mutex_unlock(&tx_mutex);
-        return CODE_INACTIVE_ERROR;
-    }
     S3TP_HEADER * hdr = packet->getHeader();
-    hdr->setMessageType(S3TP_MSG_DATA);
-    //Not setting global seq, as it will be set by transmission thread, when actually sending the packet to L2
     hdr->setSubSequence(frag_no);
     if (more_fragments) {
         hdr->setMoreFragments();
     } else {
         hdr->unsetMoreFragments();
     }
-    //Increasing port sequence
-    int port = hdr->getPort();
-    hdr->seq_port = port_sequence[port]++;
-    pthread_mutex_unlock(&tx_mutex);
+    std::vector<S3TP_PACKET *> packets(1, packet);
+    return writePackets(packets);
+}
 
-    uint16_t crc = calc_checksum(packet->getPayload(), hdr->getPduLength());
-    hdr->crc = crc;
+/**
+ * Enqueues all fragments of a message at once, filling their headers like enqueuePacket does.
+ * Either the whole message is queued or none of it, so that the fragments of a refused message
+ * are never transmitted and never take port sequences.
+ * The packets are owned by the module afterwards, even in case of errors.
+ */
+int TxModule::enqueueMessage(std::vector<S3TP_PACKET *>& fragments) {
+    for (size_t i = 0; i < fragments.size(); i++) {
+        S3TP_HEADER * hdr = fragments[i]->getHeader();
+        hdr->setSubSequence((uint8_t)i);
+        if (i + 1 < fragments.size()) {
+            hdr->setMoreFragments();
+        } else {
+            hdr->unsetMoreFragments();
+        }
+    }
+    return writePackets(fragments);
+}
 
-    outBuffer->write(packet);
+/**
+ * Writes the packets of one message into the buffer, after completing their headers.
+ * The memory of packets that could not be written is given back to the budget.
+ */
+int TxModule::writePackets(std::vector<S3TP_PACKET *>& packets) {
+    if (packets.empty()) {
+        return CODE_SUCCESS;
+    }
+    int port = packets.front()->getHeader()->getPort();
+    size_t footprint = 0;
+    uint64_t now = get_monotonic_time_ms();
+    for (auto const &packet : packets) {
+        S3TP_HEADER * hdr = packet->getHeader();
+        //Not setting global seq, as it will be set by transmission thread, when actually sending the packet to L2
+        hdr->setMessageType(S3TP_MSG_DATA);
+        hdr->crc = calc_checksum(packet->getPayload(), hdr->getPduLength());
+        packet->timestamp = now;
+        footprint += PACKET_MEMORY_OVERHEAD + hdr->getPduLength();
+    }
+
+    pthread_mutex_lock(&tx_mutex);
+    bool isActive = active;
+    pthread_mutex_unlock(&tx_mutex);
+    std::vector<S3TP_PACKET *> superseded;
+    //If is not active, do not attempt to enqueue something
+    int result = isActive ? outBuffer->writeMessage(packets, &superseded) : CODE_INACTIVE_ERROR;
+    if (!superseded.empty()) {
+        size_t supersededFootprint = 0;
+        for (auto const &old : superseded) {
+            supersededFootprint += PACKET_MEMORY_OVERHEAD + old->getHeader()->getPduLength();
+            delete old;
+        }
+        LOG_DEBUG(std::string("TX: New message on port " + std::to_string(port) + " superseded "
+                              + std::to_string(superseded.size()) + " queued packets"));
+        releasePacketMemory((uint8_t)port, supersededFootprint);
+    }
+    if (result != CODE_SUCCESS) {
+        releasePacketMemory((uint8_t)port, footprint);
+        for (auto const &packet : packets) {
+            delete packet;
+        }
+        return result;
+    }
+    pthread_mutex_lock(&tx_mutex);
     pthread_cond_signal(&tx_cond);
+    pthread_mutex_unlock(&tx_mutex);
 
     return CODE_SUCCESS;
 }
 
 int TxModule::comparePriority(S3TP_PACKET* element1, S3TP_PACKET* element2) {
-    int comp = 0;
-    uint8_t seq1, seq2, offset;
-    pthread_mutex_lock(&tx_mutex);
-
-    offset = to_consume_port_seq[element1->getHeader()->getPort()];
-    seq1 = element1->getHeader()->seq_port - offset;
-    seq2 = element2->getHeader()->seq_port - offset;
-    if (seq1 < seq2) {
-        comp = -1; //Element 1 is lower, hence has higher priority
-    } else if (seq1 > seq2) {
-        comp = 1; //Element 2 is lower, hence has higher priority
+    //Each queue only holds packets of one port and priority class, which are transmitted in the order they were sent
+    int comp = serialCompare<uint32_t>(element1->message_id, element2->message_id);
+    if (comp == 0) {
+        comp = serialCompare<uint8_t>(element1->getHeader()->getSubSequence(), element2->getHeader()->getSubSequence());
     }
-    pthread_mutex_unlock(&tx_mutex);
-    return comp;
+    //Keeping FIFO order for equal elements
+    return (comp == 0) ? -1 : comp;
 }
 
 bool TxModule::isElementValid(S3TP_PACKET * element) {
-    return _isChannelAvailable(element->channel);
+    return _isChannelAvailable(element->channel)
+           && element->channel < S3TP_VIRTUAL_CHANNELS
+           && channel_credit[element->channel] > 0;
 }
 
 bool TxModule::maximumWindowExceeded(S3TP_PACKET* queueHead, S3TP_PACKET* newElement) {
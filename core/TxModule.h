@@ -7,17 +7,34 @@
 
 #include "Constants.h"
 #include "Buffer.h"
+#include "MemoryBudget.h"
+#include "ContactPlanner.h"
+#include "SerialNumber.h"
 #include "utilities.h"
 #include "StatusInterface.h"
 #include <map>
 #include <trctrl/LinkInterface.h>
 #include <set>
+#include <vector>
 
 #define TX_PARAM_RECOVERY 0x01
 #define TX_PARAM_CUSTOM 0x02
 #define CODE_INACTIVE_ERROR -1
 
 #define DEFAULT_SYNC_CHANNEL 0
+#define SYNC_DEBOUNCE_WINDOW 50 //in ms
+#define SYNC_KEEPALIVE_INTERVAL 10000 //in ms
+//Time an acknowledgement may wait for a data frame to piggyback on, before being sent on its own
+#define DEFAULT_ACK_DELAY 200 //in ms
+
+//Number of frames the transceiver can buffer for each virtual channel
+#define DEFAULT_CHANNEL_CREDIT 16
+#define CHANNEL_CREDIT_PROBE_INTERVAL 100 //in ms
+
+#define DEFAULT_TX_MEMORY_BUDGET (8*MB)
+#define DEFAULT_TX_PORT_QUOTA MAX_QUEUE_SIZE
+//Memory used by a packet in addition to its payload
+#define PACKET_MEMORY_OVERHEAD (sizeof(S3TP_PACKET) + sizeof(S3TP_HEADER))
 
 class TxModule : public PolicyActor<S3TP_PACKET *> {
 public:
@@ -34,15 +51,38 @@ public:
     void startRoutine(Transceiver::LinkInterface * spi_if);
     void stopRoutine();
     int enqueuePacket(S3TP_PACKET * packet, uint8_t frag_no, bool more_fragments, uint8_t spi_channel, uint8_t options);
+    int enqueueMessage(std::vector<S3TP_PACKET *>& fragments);
     void reset();
-    void scheduleSync(uint8_t syncId);
+    void scheduleSync(uint8_t syncId, uint8_t peerSyncSeq);
+    void acknowledgeSync(uint8_t syncSeq);
+    void resetSyncBaseline();
     void setStatusInterface(StatusInterface * statusInterface);
+    size_t cancelMessages(uint8_t port, uint32_t messageId);
+
+    //Public acknowledgement methods
+    void scheduleAcknowledgement(uint8_t port, uint16_t nextSeq);
+    void handleAcknowledgement(uint8_t port, uint16_t nextSeq);
+    void setAcknowledgementDelay(uint64_t delay);
+
+    //Public sequence mode methods
+    void setWideSequencesEnabled(bool enabled);
+    void setPeerWideSequences(bool wide);
+    bool isUsingWideSequences();
 
     //Public channel and link methods
     void notifyLinkAvailability(bool available);
-    bool isQueueAvailable(uint8_t port, uint8_t no_packets);
+    bool admitMessage(uint8_t port, size_t len, uint8_t options = 0);
+    void releaseMessage(uint8_t port, size_t len);
+    int setPortQuota(uint8_t port, size_t bytes);
+    int setPortReservation(uint8_t port, size_t bytes);
+    int loadTransmitPolicies(const char * path);
+    static size_t computeMemoryFootprint(size_t len);
     void setChannelAvailable(uint8_t channel, bool available);
     bool isChannelAvailable(uint8_t channel);
+
+    //Public contact planning methods
+    int loadContactSchedule(const char * path);
+    void setPortDeadline(uint8_t port, uint64_t maxAge);
 private:
     STATE state;
     bool active;
@@ -50,6 +90,7 @@ private:
     pthread_mutex_t tx_mutex;
     pthread_cond_t tx_cond;
     std::set<uint8_t> channel_blacklist;
+    uint16_t channel_credit[S3TP_VIRTUAL_CHANNELS];
     bool sendingFragments;
     uint8_t currentPort;
     Transceiver::LinkInterface * linkInterface;
@@ -57,23 +98,59 @@ private:
 
     //Sync variables
     bool scheduled_sync;
+    bool scheduled_sync_ack;
+    uint64_t sync_deadline;
+    uint64_t last_sync_time;
+    uint8_t sync_seq;
+    uint8_t peer_sync_seq;
+    bool awaiting_sync_ack;
+    bool resync_requested;
+    bool resync_sent;
+    std::map<uint8_t, uint16_t> acked_port_seq;
+    std::map<uint8_t, uint16_t> sent_port_seq;
     S3TP_SYNC prototypeSync = S3TP_SYNC(); //Used only for initialization. Never afterwards
     S3TP_PACKET syncPacket = S3TP_PACKET((char *)&prototypeSync, sizeof(S3TP_SYNC));
 
+    //Acknowledgement variables
+    std::map<uint8_t, uint16_t> pending_acks;
+    uint64_t ack_deadline;
+    uint64_t ack_delay;
+    char frame_buffer[MAX_LEN_S3TP_FRAME];
+
     //Buffer and port sequences
-    std::map<uint8_t, uint8_t> to_consume_port_seq;
-    std::map<uint8_t, uint8_t> port_sequence;
-    uint8_t global_seq_num;
+    std::map<uint8_t, uint16_t> to_consume_port_seq;
+    uint16_t global_seq_num;
+    bool wide_sequences_enabled;
+    bool peer_wide_sequences;
+    bool wide_sequences;
     Buffer * outBuffer;
+    MemoryBudget * memoryBudget;
+    std::map<uint8_t, size_t> refused_ports;
+
+    //Contact planning
+    ContactPlanner * planner;
+    std::deque<S3TP_MESSAGE_INFO> planned_messages;
+    bool link_up;
 
     void txRoutine();
     static void * staticTxRoutine(void * args);
     void synchronizeStatus();
+    void sendKeepalive();
+    void waitForSyncEvent();
+    void sendAcknowledgement();
+    int _appendAcknowledgements(char * buffer, int maxLength);
+    void releasePacketMemory(uint8_t port, size_t bytes);
+    int writePackets(std::vector<S3TP_PACKET *>& packets);
+    CONTACT_PLAN _planContact();
+    S3TP_PACKET * _getNextPlannedPacket();
 
     //Internal methods for accessing channels (do not use locking)
     bool _channelsAvailable();
     void _setChannelAvailable(uint8_t channel, bool available);
     bool _isChannelAvailable(uint8_t channel);
+    bool _hasCredit(uint8_t channel);
+    void _consumeCredit(uint8_t channel);
+    bool _probeExhaustedChannels();
 
     //Policy Actor implementation
     virtual int comparePriority(S3TP_PACKET* element1, S3TP_PACKET* element2);
@@ -70,6 +70,38 @@ bool verify_checksum(const char *data, uint16_t len, uint16_t checksum) {
 	return checksum == crc;
 }
 
+/**
+ * Returns the current time of the monotonic clock in milliseconds.
+ * Used for protocol timers, which must not be affected by changes of the system time.
+ */
+uint64_t get_monotonic_time_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + (uint64_t)(now.tv_nsec / 1000000);
+}
+
+/**
+ * Initializes a condition variable, so that timed waits on it are measured with the monotonic clock.
+ */
+void init_monotonic_cond(pthread_cond_t * cond)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/**
+ * Converts an absolute monotonic time (in ms) into a timespec usable by pthread_cond_timedwait.
+ */
+void compute_monotonic_deadline(struct timespec * deadline, uint64_t time_ms)
+{
+	deadline->tv_sec = (time_t)(time_ms / 1000);
+	deadline->tv_nsec = (long)((time_ms % 1000) * 1000000);
+}
+
 /**
  * Calculate the CRC and check against stored CRC
  */
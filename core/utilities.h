@@ -9,10 +9,14 @@
 #define CORE_UTILITIES_H_
 
 #include "CommonTypes.h"
+#include <time.h>
 
 uint16_t calc_checksum(const char *data, uint16_t size);
 bool verify_checksum(const char *data, uint16_t len, uint16_t checksum);
 //u64 get_timestamp();
+uint64_t get_monotonic_time_ms();
+void init_monotonic_cond(pthread_cond_t * cond);
+void compute_monotonic_deadline(struct timespec * deadline, uint64_t time_ms);
 
 
 #endif /* CORE_UTILITIES_H_ */
@@ -0,0 +1,217 @@
+//
+// Created on 18/10/26.
+//
+
+#include "../core/S3tpShared.h"
+#include <sys/socket.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+/*
+ * Benchmark of the framing used between applications and the daemon.
+ *
+ * Messages are written to one end of a socket pair, while a reader thread parses the frames on the other end
+ * and checks that none of them was truncated. Three ways of writing are compared:
+ * - separate writes: type, priority, length and payload with one write each, as the connector used to do
+ * - framed: header and payload with a single sendmsg (write_frame_safe), on a blocking socket
+ * - framed, non-blocking: same, on a non-blocking socket with a small send buffer, so that writes are often
+ *   partial and have to be resumed once the socket is writable again (as the daemon does)
+ *
+ * System calls are counted by wrapping write and sendmsg for the writing end of the socket pair.
+ *
+ * Usage: framing_bench [messages] [message size]
+ * Results are printed on stdout.
+ */
+
+static std::atomic<int> counted_fd(-1);
+static std::atomic<size_t> syscalls(0);
+
+extern "C" ssize_t write(int fd, const void * buf, size_t count) {
+    static ssize_t (*real_write)(int, const void *, size_t) =
+            (ssize_t (*)(int, const void *, size_t))dlsym(RTLD_NEXT, "write");
+    if (fd == counted_fd) {
+        syscalls++;
+    }
+    return real_write(fd, buf, count);
+}
+
+extern "C" ssize_t sendmsg(int fd, const struct msghdr * msg, int flags) {
+    static ssize_t (*real_sendmsg)(int, const struct msghdr *, int) =
+            (ssize_t (*)(int, const struct msghdr *, int))dlsym(RTLD_NEXT, "sendmsg");
+    if (fd == counted_fd) {
+        syscalls++;
+    }
+    return real_sendmsg(fd, msg, flags);
+}
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)(now.tv_nsec / 1000);
+}
+
+/*
+ * Reader side: parses data frames (type, priority, redundant length, payload) and checks their payload
+ */
+typedef struct tag_read_result {
+    size_t frames;
+    size_t corrupt;
+}READ_RESULT;
+
+static void readFrames(int fd, size_t expected, size_t size, READ_RESULT * result) {
+    std::vector<char> buffer;
+    std::vector<char> chunk(256 * 1024);
+    size_t offset = 0;
+    size_t headerLength = 2 * sizeof(uint8_t) + sizeof(S3TP_INTRO_REDUNDANT);
+
+    result->frames = 0;
+    result->corrupt = 0;
+    while (result->frames < expected) {
+        ssize_t rd = read(fd, chunk.data(), chunk.size());
+        if (rd <= 0) {
+            break;
+        }
+        buffer.insert(buffer.end(), chunk.data(), chunk.data() + rd);
+        while (buffer.size() - offset >= headerLength) {
+            S3TP_INTRO_REDUNDANT redundantLength;
+            size_t len;
+            memcpy(&redundantLength, buffer.data() + offset + 2, sizeof(redundantLength));
+            if (parse_length_safe(&redundantLength, &len) != CODE_SUCCESS) {
+                //Stream is out of sync, nothing else can be parsed
+                result->corrupt++;
+                return;
+            }
+            if (buffer.size() - offset < headerLength + len) {
+                break;
+            }
+            char * payload = buffer.data() + offset + headerLength;
+            if ((uint8_t)buffer[offset] != APP_DATA_MESSAGE || len != size || payload[0] != 'p'
+                || payload[len - 1] != 'q') {
+                result->corrupt++;
+            }
+            result->frames++;
+            offset += headerLength + len;
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + offset);
+        offset = 0;
+    }
+}
+
+/*
+ * Writer side
+ */
+static bool writeSeparately(int fd, const std::vector<char>& payload, uint8_t priorityCode) {
+    AppMessageType type = APP_DATA_MESSAGE;
+    return write(fd, &type, sizeof(type)) > 0
+           && write(fd, &priorityCode, sizeof(priorityCode)) > 0
+           && write_length_safe(fd, payload.size()) == CODE_SUCCESS
+           && write(fd, payload.data(), payload.size()) > 0;
+}
+
+static bool writeFramed(int fd, const std::vector<char>& payload, uint8_t priorityCode) {
+    char header[FRAME_HEADER_MAX_LENGTH];
+    size_t headerLength = encode_frame_header(header, APP_DATA_MESSAGE, &priorityCode, payload.size());
+    return write_frame_safe(fd, header, headerLength, payload.data(), payload.size()) == CODE_SUCCESS;
+}
+
+static bool writeFramedNonBlocking(int fd, const std::vector<char>& payload, uint8_t priorityCode,
+                                   size_t * partialWrites) {
+    char header[FRAME_HEADER_MAX_LENGTH];
+    size_t headerLength = encode_frame_header(header, APP_DATA_MESSAGE, &priorityCode, payload.size());
+    size_t written = 0;
+
+    while (written < headerLength + payload.size()) {
+        ssize_t wr = send_frame(fd, header, headerLength, payload.data(), payload.size(), written);
+        if (wr < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            poll(&pfd, 1, -1);
+            continue;
+        } else if (wr < 0 && errno == EINTR) {
+            continue;
+        } else if (wr <= 0) {
+            return false;
+        }
+        written += wr;
+        if (written < headerLength + payload.size()) {
+            (*partialWrites)++;
+        }
+    }
+    return true;
+}
+
+enum MODE {
+    SEPARATE,
+    FRAMED,
+    FRAMED_NON_BLOCKING
+};
+
+static void runMode(MODE mode, const char * label, int messages, size_t size) {
+    int fds[2];
+    std::vector<char> payload(size, 'x');
+    uint8_t priorityCode = encodePriority(PRIORITY_NORMAL);
+    READ_RESULT result;
+    size_t partialWrites = 0;
+    bool ok = true;
+
+    payload[0] = 'p';
+    payload[size - 1] = 'q';
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        fprintf(stderr, "Couldn't create socket pair\n");
+        return;
+    }
+    if (mode == FRAMED_NON_BLOCKING) {
+        int sendBuffer = 16 * 1024;
+        setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    }
+    std::thread reader(readFrames, fds[1], (size_t)messages, size, &result);
+
+    syscalls = 0;
+    counted_fd = fds[0];
+    uint64_t start = now_us();
+    for (int m = 0; m < messages && ok; m++) {
+        switch (mode) {
+            case SEPARATE:
+                ok = writeSeparately(fds[0], payload, priorityCode);
+                break;
+            case FRAMED:
+                ok = writeFramed(fds[0], payload, priorityCode);
+                break;
+            case FRAMED_NON_BLOCKING:
+                ok = writeFramedNonBlocking(fds[0], payload, priorityCode, &partialWrites);
+                break;
+        }
+    }
+    counted_fd = -1;
+    shutdown(fds[0], SHUT_WR);
+    reader.join();
+    uint64_t elapsed = now_us() - start;
+
+    printf("%-24s %6.2f syscalls/msg  %10.0f msgs/s  %8.1f MB/s  %8zu partial writes  %zu/%d frames ok\n",
+           label, (double)syscalls / messages, messages * 1e6 / elapsed,
+           (double)messages * size / elapsed, partialWrites, result.frames - result.corrupt, messages);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(int argc, char* argv[]) {
+    int messages = (argc > 1) ? atoi(argv[1]) : 200000;
+    size_t size = (argc > 2) ? (size_t)atoi(argv[2]) : 256;
+
+    if (messages <= 0 || size < 2) {
+        fprintf(stderr, "Usage: framing_bench [messages] [message size >= 2]\n");
+        return 1;
+    }
+    printf("%d messages of %zu bytes\n", messages, size);
+    runMode(SEPARATE, "separate writes:", messages, size);
+    runMode(FRAMED, "framed:", messages, size);
+    runMode(FRAMED_NON_BLOCKING, "framed, non-blocking:", messages, size);
+    return 0;
+}
@@ -0,0 +1,268 @@
+//
+// Created on 18/10/26.
+//
+
+#include "../core/Reactor.h"
+#include "../connector/S3tpConnector.h"
+#include <sys/wait.h>
+#include <atomic>
+#include <fstream>
+#include <vector>
+
+/*
+ * Benchmark of the daemon event loop with many connected applications.
+ *
+ * The parent process runs the reactor, with a listener standing in for S3TP that simply counts messages.
+ * A child process connects the applications (one connector each), so that the memory and threads
+ * reported for the daemon side are not mixed up with the ones of the applications.
+ *
+ * Upstream: every application sends its messages to the daemon, within the credit granted by the daemon.
+ * Downstream: the daemon sends messages to all applications, as fast as their sockets allow.
+ *
+ * Usage: reactor_bench [clients] [messages per client] [message size] [shm] [mux]
+ * With "shm", applications exchange messages with the daemon through shared memory instead of the socket.
+ * With "mux", all ports are registered over a single connection (one socket and one listener thread),
+ * instead of one connector per port.
+ * Results are printed on stdout, the module logs go to stderr.
+ */
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)(now.tv_nsec / 1000);
+}
+
+static std::string readStatus(const char * key) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, strlen(key), key) == 0) {
+            size_t start = line.find_first_not_of(" \t", strlen(key));
+            return line.substr(start);
+        }
+    }
+    return "?";
+}
+
+static void printStatus(const char * label) {
+    printf("%-28s RSS %12s  threads %s\n", label, readStatus("VmRSS:").c_str(), readStatus("Threads:").c_str());
+}
+
+/*
+ * Daemon side
+ */
+class BenchListener: public ClientInterface {
+public:
+    std::atomic<size_t> connected;
+    std::atomic<size_t> received;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    std::vector<ClientPort *> clients;
+
+    BenchListener() : connected(0), received(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    virtual int onConnected(void * params) {
+        pthread_mutex_lock(&mutex);
+        clients.push_back((ClientPort *)params);
+        connected++;
+        pthread_mutex_unlock(&mutex);
+        return CODE_SERVER_ACCEPT;
+    }
+
+    virtual void onDisconnected(void * params) {
+        pthread_mutex_lock(&mutex);
+        for (size_t i = 0; i < clients.size(); i++) {
+            if (clients[i] == params) {
+                clients.erase(clients.begin() + i);
+                break;
+            }
+        }
+        connected--;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    virtual int onApplicationMessage(void *, size_t, uint8_t, uint32_t, void *) {
+        received++;
+        return CODE_SUCCESS;
+    }
+
+    virtual int onCancelRequest(uint32_t, void *) {
+        return 0;
+    }
+
+    virtual void onOutputAvailable(void *) {
+        pthread_mutex_lock(&mutex);
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+static void * reactorRoutine(void * args) {
+    static_cast<Reactor *>(args)->run();
+    return NULL;
+}
+
+/*
+ * Application side
+ */
+class BenchCallback: public S3tpCallback {
+public:
+    std::atomic<size_t> * received;
+
+    virtual void onNewMessage(char * data, size_t) {
+        (*received)++;
+        delete[] data;
+    }
+
+    virtual void onError(int, char *) {
+    }
+};
+
+static int runApplications(int clientCount, int messages, size_t size, bool sharedMemory, bool multiplexed) {
+    std::vector<S3tpConnector *> connectors;
+    std::vector<S3TP_CONFIG> configs;
+    std::vector<std::thread> senders;
+    std::atomic<size_t> received(0);
+    BenchCallback callback;
+    std::vector<char> payload(size, 'x');
+
+    callback.received = &received;
+    for (int i = 0; i < clientCount; i++) {
+        S3TP_CONFIG config;
+        config.port = (uint8_t)i;
+        config.channel = 0;
+        config.options = 0;
+        config.setSharedMemory(sharedMemory);
+        configs.push_back(config);
+    }
+    for (int i = 0; i < (multiplexed ? 1 : clientCount); i++) {
+        S3tpConnector * connector = new S3tpConnector();
+        int result = multiplexed ? connector->init(configs, &callback) : connector->init(configs[i], &callback);
+        if (result != CODE_SUCCESS) {
+            fprintf(stderr, "Couldn't connect application %d\n", i);
+            return 1;
+        }
+        connectors.push_back(connector);
+    }
+    printStatus("applications connected:");
+    fflush(stdout);
+    //Waiting for the daemon to start the upstream phase
+    sleep(1);
+    for (int i = 0; i < clientCount; i++) {
+        senders.push_back(std::thread([&, i]() {
+            S3tpConnector * connector = connectors[multiplexed ? 0 : i];
+            for (int m = 0; m < messages; m++) {
+                connector->sendToPort((uint8_t)i, payload.data(), payload.size(), PRIORITY_NORMAL, NULL);
+            }
+        }));
+    }
+    for (std::thread& sender : senders) {
+        sender.join();
+    }
+    //Downstream phase, the daemon is told once everything arrived
+    while (received < (size_t)clientCount * messages) {
+        usleep(1000);
+    }
+    connectors[0]->send(payload.data(), payload.size());
+    sleep(1);
+    for (S3tpConnector * connector : connectors) {
+        delete connector;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int clientCount = (argc > 1) ? atoi(argv[1]) : 128;
+    int messages = (argc > 2) ? atoi(argv[2]) : 1000;
+    size_t size = (argc > 3) ? (size_t)atoi(argv[3]) : 256;
+    bool sharedMemory = false;
+    bool multiplexed = false;
+    std::string path = "/tmp/s3tp_reactor_bench_" + std::to_string(getpid());
+    struct sockaddr_un address;
+
+    for (int i = 4; i < argc; i++) {
+        sharedMemory = sharedMemory || strcmp(argv[i], "shm") == 0;
+        multiplexed = multiplexed || strcmp(argv[i], "mux") == 0;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    socket_path = (char *)path.c_str();
+    printf("%d clients, %d messages per client and direction, %zu bytes each, over %s%s\n", clientCount, messages,
+           size, sharedMemory ? "shared memory" : "the socket", multiplexed ? ", multiplexed" : "");
+    printStatus("idle daemon:");
+
+    SOCKET server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    if (server < 0 || bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server, 128) != 0) {
+        fprintf(stderr, "Couldn't create daemon socket\n");
+        return 1;
+    }
+
+    //Output buffered so far would be printed by both processes otherwise
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        close(server);
+        return runApplications(clientCount, messages, size, sharedMemory, multiplexed);
+    }
+
+    BenchListener listener;
+    Reactor reactor(&listener);
+    pthread_t reactorThread;
+    if (reactor.init(server) != CODE_SUCCESS) {
+        return 1;
+    }
+    pthread_create(&reactorThread, NULL, reactorRoutine, &reactor);
+
+    while (listener.connected < (size_t)clientCount) {
+        usleep(1000);
+    }
+    printStatus("clients connected:");
+
+    //Upstream, timed from the first message
+    size_t upstream = (size_t)clientCount * messages;
+    while (listener.received == 0) {
+        usleep(10);
+    }
+    uint64_t start = now_us();
+    while (listener.received < upstream) {
+        usleep(100);
+    }
+    uint64_t elapsed = now_us() - start;
+    printf("upstream   %10zu msgs in %8.3f s  %10.0f msgs/s\n", upstream, elapsed / 1e6, upstream * 1e6 / elapsed);
+
+    //Downstream
+    std::vector<char> payload(size, 'y');
+    size_t downstream = 0;
+    start = now_us();
+    for (int m = 0; m < messages; m++) {
+        pthread_mutex_lock(&listener.mutex);
+        for (ClientPort * cli : listener.clients) {
+            while (cli->isOutputBlocked() && cli->isConnected()) {
+                pthread_cond_wait(&listener.cond, &listener.mutex);
+            }
+            cli->send(payload.data(), payload.size());
+            downstream++;
+        }
+        pthread_mutex_unlock(&listener.mutex);
+    }
+    while (listener.received < upstream + 1) {
+        usleep(100);
+    }
+    elapsed = now_us() - start;
+    printf("downstream %10zu msgs in %8.3f s  %10.0f msgs/s\n", downstream, elapsed / 1e6,
+           downstream * 1e6 / elapsed);
+    printStatus("after traffic:");
+
+    waitpid(child, NULL, 0);
+    reactor.stop();
+    pthread_join(reactorThread, NULL);
+    close(server);
+    unlink(socket_path);
+    return 0;
+}
@@ -0,0 +1,116 @@
+//
+// Created on 18/10/26.
+//
+
+#include "../core/RxModule.h"
+#include <vector>
+
+/*
+ * Checks how the receiver gives up on missing packets of fragmented messages:
+ * - a gap skipped in the middle of a message must not deliver the remaining fragments as a message of their own
+ * - a message missing its last fragment must be given up on, even if no later packet arrives
+ *
+ * Every fragment carries its port sequence as payload, so that delivered messages can be told apart.
+ * Usage: rx_gap_test
+ * Exits with 0 if all checks passed. The module logs go to stderr.
+ */
+
+#define TEST_PORT 1
+
+static RxModule * rx;
+static int failures = 0;
+
+static void sendFragment(uint16_t seq, uint8_t subSequence, bool moreFragments) {
+    char buffer[MAX_LEN_S3TP_FRAME];
+    uint64_t value = seq;
+    S3TP_HEADER * hdr = (S3TP_HEADER *)buffer;
+    memset(buffer, 0, sizeof(S3TP_HEADER));
+    hdr->setPduLength(sizeof(value));
+    hdr->setMessageType(S3TP_MSG_DATA);
+    hdr->setPort(TEST_PORT);
+    if (moreFragments) {
+        hdr->setMoreFragments();
+    } else {
+        hdr->unsetMoreFragments();
+    }
+    hdr->setGlobalSequence((uint8_t)seq);
+    hdr->setSubSequence(subSequence);
+    hdr->seq_port = (uint8_t)seq;
+    memcpy(buffer + sizeof(S3TP_HEADER), &value, sizeof(value));
+    hdr->crc = calc_checksum(buffer + sizeof(S3TP_HEADER), sizeof(value));
+    static_cast<Transceiver::LinkCallback *>(rx)->handleFrame(false, 0, buffer, sizeof(S3TP_HEADER) + sizeof(value));
+}
+
+/**
+ * Waits for the ingress thread and returns the messages delivered meanwhile, each as the sequence of its first fragment.
+ */
+static std::vector<uint64_t> receive() {
+    std::vector<uint64_t> messages;
+    usleep(50000);
+    while (rx->isNewMessageAvailable()) {
+        uint16_t len;
+        int error;
+        uint8_t port;
+        char * data = rx->getNextCompleteMessage(&len, &error, &port);
+        if (data != NULL && len >= sizeof(uint64_t)) {
+            uint64_t first;
+            memcpy(&first, data, sizeof(first));
+            messages.push_back(first);
+        }
+        delete[] data;
+    }
+    return messages;
+}
+
+static void check(bool condition, const char * description) {
+    printf("%s: %s\n", condition ? "PASS" : "FAIL", description);
+    if (!condition) {
+        failures++;
+    }
+}
+
+/**
+ * Waits until the missing packets were given up on, at most as long as the longest gap timeout.
+ */
+static void waitForLoss(uint32_t lost) {
+    uint64_t deadline = get_monotonic_time_ms() + MAX_GAP_TIMEOUT + 1000;
+    while (rx->getLostCount(TEST_PORT) < lost && get_monotonic_time_ms() < deadline) {
+        usleep(10000);
+    }
+}
+
+int main() {
+    RxModule module;
+    rx = &module;
+    rx->startModule();
+    rx->openPort(TEST_PORT, 0);
+
+    //Message 0 is complete, the first fragment of message 1-3 is lost, its second fragment arrives
+    sendFragment(0, 0, false);
+    sendFragment(2, 1, true);
+    std::vector<uint64_t> messages = receive();
+    check(messages.size() == 1 && messages[0] == 0, "complete message before the gap is delivered");
+    waitForLoss(1);
+    check(rx->getLostCount(TEST_PORT) == 1, "gap in the middle of a message is skipped");
+    //Last fragment of the skipped message arrives after the skip, followed by message 4
+    sendFragment(3, 2, false);
+    sendFragment(4, 0, false);
+    messages = receive();
+    check(messages.size() == 1 && messages[0] == 4, "fragments of a skipped message are not delivered");
+
+    //Message 5-7 is missing its last fragment, and nothing arrives after it
+    sendFragment(5, 0, true);
+    sendFragment(6, 1, true);
+    check(receive().empty(), "incomplete message is not delivered");
+    waitForLoss(2);
+    check(rx->getLostCount(TEST_PORT) == 2, "missing last fragment is given up on without later packets");
+    check(rx->getMemoryUsage() == 0, "fragments of the incomplete message are released");
+    sendFragment(7, 2, false);
+    sendFragment(8, 0, false);
+    messages = receive();
+    check(messages.size() == 1 && messages[0] == 8, "reception resumes with the next message");
+
+    rx->stopModule();
+    printf("%d checks failed\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,182 @@
+//
+// Created on 18/10/26.
+//
+
+#include "../core/RxModule.h"
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+/*
+ * Benchmark comparing the delivery latency of ordered and unordered ports,
+ * when frames are lost and reordered on the link.
+ *
+ * Frames are generated at a fixed pace and carry their sequence and generation time.
+ * Each frame is delayed by a random amount of frame slots (reordering) or dropped (loss)
+ * before being handed to the receiver. Latency is measured from generation to delivery.
+ * Every frame handed to the receiver must be delivered exactly once, unless it arrived after it was given up on.
+ *
+ * Usage: rx_unordered_bench [loss percent] [max reordering in frames] [messages] [frame interval us]
+ * Results are printed on stdout, the module logs go to stderr. Exits with 1 if a delivery check failed.
+ */
+
+#define BENCH_PORT 1
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)(now.tv_nsec / 1000);
+}
+
+typedef struct tag_bench_frame {
+    uint32_t seq;
+    uint64_t release_slot;
+}BENCH_FRAME;
+
+typedef struct tag_bench_payload {
+    uint64_t timestamp;
+    uint64_t seq;
+}BENCH_PAYLOAD;
+
+static int buildFrame(char * buffer, uint32_t seq, uint64_t timestamp) {
+    S3TP_HEADER * hdr = (S3TP_HEADER *)buffer;
+    BENCH_PAYLOAD content;
+    content.timestamp = timestamp;
+    content.seq = seq;
+    memset(buffer, 0, sizeof(S3TP_HEADER) + sizeof(S3TP_HEADER_EXT));
+    hdr->setPduLength(sizeof(content));
+    hdr->setMessageType(S3TP_MSG_DATA);
+    hdr->setWideSequences(true);
+    hdr->setPort(BENCH_PORT);
+    hdr->unsetMoreFragments();
+    hdr->setGlobalSequence((uint8_t)seq);
+    hdr->setSubSequence(0);
+    hdr->seq_port = (uint8_t)seq;
+    S3TP_HEADER_EXT * ext = (S3TP_HEADER_EXT *)(buffer + sizeof(S3TP_HEADER));
+    ext->global_seq_high = (uint8_t)(seq >> 8);
+    ext->port_seq_high = (uint8_t)(seq >> 8);
+    char * payload = buffer + sizeof(S3TP_HEADER) + sizeof(S3TP_HEADER_EXT);
+    memcpy(payload, &content, sizeof(content));
+    hdr->crc = calc_checksum(payload, sizeof(content));
+    return sizeof(S3TP_HEADER) + sizeof(S3TP_HEADER_EXT) + sizeof(content);
+}
+
+static double percentile(std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[index] / 1000.0;
+}
+
+/**
+ * @return  Whether every frame handed to the receiver was delivered exactly once.
+ */
+static bool runBenchmark(bool unordered, int lossPercent, int reordering, int messages, int interval) {
+    RxModule rx;
+    Transceiver::LinkCallback * link = &rx;
+    char frame[MAX_LEN_S3TP_FRAME];
+    std::vector<uint64_t> latencies;
+    std::vector<BENCH_FRAME> pending;
+    std::vector<uint64_t> generated((size_t)messages);
+    std::vector<uint32_t> deliveries((size_t)messages, 0);
+    uint32_t handed = 0;
+    uint32_t unexpected = 0;
+
+    srand(42);
+    rx.startModule();
+    rx.openPort(BENCH_PORT, unordered ? (uint8_t)S3TP_OPTION_UNORDERED : (uint8_t)0);
+
+    uint64_t start = now_us();
+    uint64_t deadline = 0;
+    for (uint64_t slot = 0; ; slot++) {
+        if (slot < (uint64_t)messages) {
+            //Generating the next frame and deciding its fate
+            generated[slot] = start + slot * interval;
+            if (rand() % 100 >= lossPercent) {
+                BENCH_FRAME f;
+                f.seq = (uint32_t)slot;
+                f.release_slot = slot + (reordering > 0 ? rand() % (reordering + 1) : 0);
+                pending.push_back(f);
+            }
+        } else if (pending.empty()) {
+            if (deadline == 0) {
+                //Leaving time for gap timers to fire on the last losses
+                deadline = now_us() + MAX_GAP_TIMEOUT * 1000;
+            }
+            if (now_us() > deadline || (int)latencies.size() >= messages) {
+                break;
+            }
+        }
+        for (size_t i = 0; i < pending.size();) {
+            if (pending[i].release_slot <= slot) {
+                int len = buildFrame(frame, pending[i].seq, generated[pending[i].seq]);
+                link->handleFrame(false, 0, frame, len);
+                handed++;
+                pending.erase(pending.begin() + i);
+            } else {
+                i++;
+            }
+        }
+
+        //Consuming everything delivered so far, until the next frame slot
+        uint64_t nextSlot = start + (slot + 1) * interval;
+        do {
+            while (rx.isNewMessageAvailable()) {
+                uint16_t len;
+                int error;
+                uint8_t port;
+                char * data = rx.getNextCompleteMessage(&len, &error, &port);
+                if (data != NULL && len == sizeof(BENCH_PAYLOAD)) {
+                    BENCH_PAYLOAD content;
+                    memcpy(&content, data, sizeof(content));
+                    latencies.push_back(now_us() - content.timestamp);
+                    if (content.seq < (uint64_t)messages) {
+                        deliveries[content.seq]++;
+                    } else {
+                        unexpected++;
+                    }
+                } else {
+                    unexpected++;
+                }
+                delete[] data;
+            }
+            usleep(20);
+        } while (now_us() < nextSlot);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-9s delivered %6zu  lost %5u (late %4u)  duplicates %4u  p50 %8.2f ms  p99 %8.2f ms  p99.9 %8.2f ms"
+           "  max %8.2f ms\n",
+           unordered ? "unordered" : "ordered", latencies.size(), rx.getLostCount(BENCH_PORT),
+           rx.getLateCount(BENCH_PORT), rx.getDuplicateCount(BENCH_PORT),
+           percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+           latencies.empty() ? 0.0 : latencies.back() / 1000.0);
+
+    //Frames are never duplicated on the way, so only those arriving after they were given up on may be missing
+    uint32_t duplicated = 0;
+    for (uint32_t count : deliveries) {
+        if (count > 1) {
+            duplicated++;
+        }
+    }
+    bool exactlyOnce = duplicated == 0 && unexpected == 0
+                       && latencies.size() + rx.getLateCount(BENCH_PORT) == handed;
+    printf("%-9s handed %6u  delivered more than once %u  unexpected %u  -> %s\n",
+           unordered ? "unordered" : "ordered", handed, duplicated, unexpected, exactlyOnce ? "ok" : "FAILED");
+    rx.stopModule();
+    return exactlyOnce;
+}
+
+int main(int argc, char* argv[]) {
+    int lossPercent = (argc > 1) ? atoi(argv[1]) : 1;
+    int reordering = (argc > 2) ? atoi(argv[2]) : 8;
+    int messages = (argc > 3) ? atoi(argv[3]) : 5000;
+    int interval = (argc > 4) ? atoi(argv[4]) : 500;
+
+    printf("loss %d%%, reordering up to %d frames, %d messages, one frame every %d us\n",
+           lossPercent, reordering, messages, interval);
+    bool ordered = runBenchmark(false, lossPercent, reordering, messages, interval);
+    bool unordered = runBenchmark(true, lossPercent, reordering, messages, interval);
+    return (ordered && unordered) ? 0 : 1;
+}
@@ -3,17 +3,45 @@
 //
 
 #include "../core/TransportDaemon.h"
+#include <getopt.h>
 
 int main(int argc, char ** argv) {
-    if (argc != 4) {
-        std::cout << "Invalid arguments. Expected unix_path, transceiver_type, start_prt" << std::endl;
+    char * transmitPolicies = NULL;
+    bool wideSequences = false;
+    bool ackDelaySet = false;
+    uint64_t ackDelay = 0;
+    char * end;
+    bool invalidOption = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:a:w")) != -1) {
+        switch (opt) {
+            case 't':
+                transmitPolicies = optarg;
+                break;
+            case 'a':
+                ackDelay = strtoull(optarg, &end, 10);
+                ackDelaySet = true;
+                invalidOption |= (*optarg == '\0' || *end != '\0');
+                break;
+            case 'w':
+                wideSequences = true;
+                break;
+            default:
+                invalidOption = true;
+                break;
+        }
+    }
+    int positional = argc - optind;
+    if (invalidOption || positional < 3 || positional > 5) {
+        std::cout << "Invalid arguments. Expected [-t transmit_policies] [-a ack_delay_ms] [-w] unix_path,"
+                  << " transceiver_type, start_prt [, contact_schedule [, receive_policies]]" << std::endl;
         return -1;
     }
     s3tp_daemon daemon;
 
     TRANSCEIVER_CONFIG config;
 
-    int argi = 1;
+    int argi = optind;
     int start_port = 0;
 
     socket_path = argv[argi++];
@@ -43,6 +71,24 @@ int main(int argc, char ** argv) {
         return -2;
     }
 
+    //The sequence mode is fixed for the whole session, so it has to be chosen before starting it
+    daemon.setWideSequencesEnabled(wideSequences);
     daemon.init(&config);
+    if (positional >= 4 && daemon.loadContactSchedule(argv[argi]) != CODE_SUCCESS) {
+        std::cout << "Couldn't load contact schedule " << argv[argi] << std::endl;
+        return -3;
+    }
+    argi++;
+    if (positional == 5 && daemon.loadReceivePolicies(argv[argi]) != CODE_SUCCESS) {
+        std::cout << "Couldn't load receive policies " << argv[argi] << std::endl;
+        return -4;
+    }
+    if (transmitPolicies != NULL && daemon.loadTransmitPolicies(transmitPolicies) != CODE_SUCCESS) {
+        std::cout << "Couldn't load transmit policies " << transmitPolicies << std::endl;
+        return -5;
+    }
+    if (ackDelaySet) {
+        daemon.setAcknowledgementDelay(ackDelay);
+    }
     daemon.startDaemon();
 }